@@ -3,6 +3,13 @@ install(
     RUNTIME COMPONENT clox_runtime
 )
 
+if(TARGET clox-union)
+    install(
+        TARGETS clox-union
+        RUNTIME COMPONENT clox_runtime
+    )
+endif()
+
 if(PROJECT_IS_TOP_LEVEL)
     include(CPack)
 endif()
@@ -28,3 +28,57 @@ if(NOT PROJECT_IS_TOP_LEVEL)
         set(warning_guard SYSTEM)
     endif()
 endif()
+
+# ---- Dispatch strategy ----
+
+# Computed goto (labels-as-values) gives every opcode handler its own indirect
+# branch which the CPU can predict independently. This is a GNU extension so it
+# is checked for and the portable switch dispatch is used if it is unavailable
+option(CLOX_COMPUTED_GOTO "Use computed goto dispatch in the VM when supported" ON)
+
+if(CLOX_COMPUTED_GOTO)
+    include(CheckCSourceCompiles)
+    check_c_source_compiles(
+        "int main(void) {
+            static void *labels[] = {&&a, &&b};
+            goto *labels[0];
+        a:  return 0;
+        b:  return 1;
+        }"
+        CLOX_HAVE_COMPUTED_GOTO
+    )
+
+    if(NOT CLOX_HAVE_COMPUTED_GOTO)
+        message(STATUS "Computed goto unsupported, falling back to switch dispatch")
+    endif()
+endif()
+
+# ---- Baseline JIT ----
+
+# Hot functions are compiled to x86-64 machine code. Other targets always use the
+# interpreter, the JIT can also be turned off at runtime with --no-jit
+option(CLOX_JIT "Compile hot functions to machine code on x86-64" ON)
+
+if(CLOX_JIT)
+    if(CMAKE_SYSTEM_PROCESSOR MATCHES "^(x86_64|AMD64|amd64)$" AND UNIX)
+        set(CLOX_HAVE_JIT ON)
+    else()
+        set(CLOX_HAVE_JIT OFF)
+        message(STATUS "JIT unsupported on ${CMAKE_SYSTEM_PROCESSOR}, using the interpreter only")
+    endif()
+endif()
+
+# ---- Value representation ----
+
+# Values are NaN boxed doubles by default, which needs 64-bit pointers to fit in a
+# quiet NaN. The tagged union is twice the size but plain C, `both` additionally
+# builds it as clox-union next to clox so the two can be compared side by side
+set(
+    CLOX_VALUE_REPR "nan-boxing"
+    CACHE STRING "Value representation: nan-boxing, union or both"
+)
+set_property(CACHE CLOX_VALUE_REPR PROPERTY STRINGS nan-boxing union both)
+
+if(NOT CLOX_VALUE_REPR MATCHES "^(nan-boxing|union|both)$")
+    message(FATAL_ERROR "CLOX_VALUE_REPR must be nan-boxing, union or both")
+endif()
@@ -25,6 +25,8 @@ typedef enum {
     OP_SET_GLOBAL,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    OP_GET_ENCLOSING, //< Local of the enclosing function, in the caller's frame
+    OP_SET_ENCLOSING,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
@@ -42,7 +44,9 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL, //< OP_CALL in `return f(...)`, reuses the caller's frame
     OP_INVOKE,
+    OP_TAIL_INVOKE, //< OP_INVOKE in `return x.m(...)`, reuses the caller's frame
     OP_SUPER_INVOKE,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
@@ -50,8 +54,138 @@ typedef enum {
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
+
+    // Negated comparisons. The compiler emits OP_EQUAL, OP_GREATER or OP_LESS
+    // followed by OP_NOT and the optimizer fuses the pair, so these keep the
+    // meaning of the pair for NaN: `a <= b` is `!(a > b)`.
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+
+    // Superinstructions doing the work of the most frequent instruction pairs in
+    // one dispatch. The optimizer fuses the pairs, OP_POP_JUMP_IF_FALSE replaces
+    // OP_JUMP_IF_FALSE and OP_POP when the jump lands on another OP_POP, which
+    // the fused instruction skips.
+    OP_GET_LOCAL_CONSTANT,
+    OP_GET_LOCAL_GET_LOCAL,
+    OP_GET_LOCAL_PROPERTY,
+    OP_SET_LOCAL_POP,
+    OP_SET_GLOBAL_POP,
+    OP_POP_JUMP_IF_FALSE,
+
+    // Type-specialized variants of the arithmetic and comparison instructions.
+    // The compiler never emits these, the VM rewrites the generic instruction in
+    // place the first time it executes and rewrites it back on a type miss.
+    OP_GREATER_NUMBER,
+    OP_GREATER_EQUAL_NUMBER,
+    OP_LESS_NUMBER,
+    OP_LESS_EQUAL_NUMBER,
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
 } OpCode;
 
+/**
+ * @brief Maps quickened instructions back to the generic instruction, for code
+ * doing its own type checks where the distinction does not matter.
+ */
+static inline OpCode genericOpCode(OpCode op) {
+    switch (op) {
+        case OP_GREATER_NUMBER:
+            return OP_GREATER;
+        case OP_GREATER_EQUAL_NUMBER:
+            return OP_GREATER_EQUAL;
+        case OP_LESS_NUMBER:
+            return OP_LESS;
+        case OP_LESS_EQUAL_NUMBER:
+            return OP_LESS_EQUAL;
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+            return OP_ADD;
+        case OP_SUBTRACT_NUMBER:
+            return OP_SUBTRACT;
+        case OP_MULTIPLY_NUMBER:
+            return OP_MULTIPLY;
+        case OP_DIVIDE_NUMBER:
+            return OP_DIVIDE;
+        default:
+            return op;
+    }
+}
+
+/**
+ * @brief Hidden class describing the field layout of an instance
+ */
+typedef struct ObjShape ObjShape;
+
+/**
+ * @brief Lox class object
+ */
+typedef struct ObjClass ObjClass;
+
+/**
+ * @brief Lox closure object
+ */
+typedef struct ObjClosure ObjClosure;
+
+/**
+ * @brief Machine code recorded for a hot loop
+ */
+typedef struct Trace Trace;
+
+/**
+ * @brief Number of shapes a single property access site remembers before it
+ * starts evicting the oldest.
+ */
+#define PROPERTY_CACHE_SIZE 4
+
+/**
+ * @brief Inline cache entry mapping an instance shape to a field slot.
+ *
+ * @details For property stores that add a new field `transition` is the shape the
+ * instance moves to, otherwise it is the same as `shape`.
+ */
+typedef struct {
+    ObjShape *shape;
+    ObjShape *transition;
+    uint32_t slot;
+} PropertyCacheEntry;
+
+/**
+ * @brief Polymorphic inline cache for a single OP_GET_PROPERTY or OP_SET_PROPERTY.
+ */
+typedef struct {
+    PropertyCacheEntry entries[PROPERTY_CACHE_SIZE];
+} PropertyCache;
+
+/**
+ * @brief Monomorphic inline cache for a single OP_INVOKE or OP_SUPER_INVOKE.
+ *
+ * @details An entry is valid while the receiver's class is `klass`, the class's
+ * methods have not changed since (`version`) and, for OP_INVOKE, the receiver has
+ * `shape`, which guarantees no field shadows the method.
+ */
+typedef struct {
+    ObjClass *klass;
+    ObjShape *shape;
+    ObjClosure *method;
+    uint32_t version;
+} InvokeCache;
+
+/**
+ * @brief Back-edge counter and compiled trace of a single OP_LOOP.
+ *
+ * @details `aborts` counts failed recordings and traces thrown away because their
+ * variables changed type, so loops which can't be traced are eventually left alone.
+ */
+typedef struct {
+    uint32_t hotness;
+    uint32_t aborts;
+    Trace *trace;
+} LoopCache;
+
 /**
  * @brief Dynamic array of opcodes. An array is considered a 'Chunk' of the larger
  * bytecode program.
@@ -62,6 +196,18 @@ typedef struct {
     uint8_t *code;
     size_t *lines;
     ValueArray constants;
+
+    size_t propertyCacheCount;
+    size_t propertyCacheCapacity;
+    PropertyCache *propertyCaches;
+
+    size_t invokeCacheCount;
+    size_t invokeCacheCapacity;
+    InvokeCache *invokeCaches;
+
+    size_t loopCacheCount;
+    size_t loopCacheCapacity;
+    LoopCache *loopCaches;
 } Chunk;
 
 /**
@@ -74,10 +220,36 @@ void initChunk(Chunk *chunk);
  */
 void writeChunk(VM *vm, Compiler *compiler, Chunk *chunk, uint8_t byte, size_t line);
 
+/**
+ * @brief Length in bytes of the instruction at `offset`, including its operands.
+ */
+size_t instructionLength(Chunk *chunk, size_t offset);
+
 /**
  * @brief Adds constant to bytecode chunk's value pool.
  */
-uint8_t addConstant(VM *vm, Compiler *compiler, Chunk *chunk, Value value);
+size_t addConstant(VM *vm, Compiler *compiler, Chunk *chunk, Value value);
+
+/**
+ * @brief Adds an empty property inline cache to the chunk.
+ *
+ * @returns index of the new cache
+ */
+size_t addPropertyCache(VM *vm, Compiler *compiler, Chunk *chunk);
+
+/**
+ * @brief Adds an empty method inline cache to the chunk.
+ *
+ * @returns index of the new cache
+ */
+size_t addInvokeCache(VM *vm, Compiler *compiler, Chunk *chunk);
+
+/**
+ * @brief Adds a cold loop cache to the chunk.
+ *
+ * @returns index of the new cache
+ */
+size_t addLoopCache(VM *vm, Compiler *compiler, Chunk *chunk);
 
 /**
  * @brief Frees chunk.
@@ -22,7 +22,18 @@ typedef struct Compiler Compiler;
 // Forward declare ClassCompiler type
 typedef struct ClassCompiler ClassCompiler;
 
+// Values are NaN boxed unless the build asks for the portable tagged union, see
+// CLOX_VALUE_REPR
+#ifndef CLOX_TAGGED_UNION
 #define NAN_BOXING
+#endif
+
+// The JIT emits x86-64 code which assumes NaN boxed values and needs mmap
+#if defined(CLOX_JIT) &&                                                                 \
+    !(defined(NAN_BOXING) && defined(__x86_64__) &&                                      \
+      (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)))
+#undef CLOX_JIT
+#endif
 
 #ifdef CLOX_DEVELOPER_MODE
 #undef DEBUG_TRACE_EXECUTION
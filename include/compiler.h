@@ -76,6 +76,9 @@ struct Compiler {
     intmax_t localCount;
     Upvalue upvalues[UINT8_COUNT];
     intmax_t scopeDepth;
+
+    size_t lastCall; //< Last OP_CALL or OP_INVOKE, turned into a tail call by `return`
+    bool directCaptures; //< Enclosing locals are used in the caller's frame
 };
 
 struct ClassCompiler {
@@ -9,6 +9,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "regvm.h"
 
 /**
  * @brief Disassembles bytecode chunks.
@@ -20,4 +21,15 @@ void disassembleChunk(Chunk *chunk, const char *name);
  */
 size_t disassembleInstruction(Chunk *chunk, size_t offset);
 
+/**
+ * @brief Disassembles the register code of a function. Constants are looked up in
+ * the chunk it was translated from.
+ */
+void disassembleRegisterCode(RegisterCode *code, Chunk *chunk, const char *name);
+
+/**
+ * @brief Disassembles an individual register instruction along with its data words
+ */
+size_t disassembleRegisterInstruction(RegisterCode *code, Chunk *chunk, size_t index);
+
 #endif // clox_debug_h
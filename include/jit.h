@@ -0,0 +1,114 @@
+/**
+ * @brief Baseline template JIT compiling hot functions to x86-64 machine code
+ *
+ * @details Compiled code works directly on the VM stack and call frames using the
+ * same layout as the interpreter, so it can be entered and left at any call
+ * boundary. Anything that allocates, calls or reports an error goes through the
+ * slow paths in vm.c declared below. Functions using instructions the JIT does not
+ * handle keep running in the interpreter.
+ *
+ * The JIT only exists when CLOX_JIT is defined, which is only the case for NaN
+ * boxed x86-64 builds on platforms with mmap. Everywhere else `jitCompile` always
+ * fails.
+ *
+ * @file jit.h
+ */
+
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "trace.h"
+#include "vm.h"
+
+/**
+ * @brief Default number of interpreted calls before a function is compiled
+ */
+#define JIT_DEFAULT_THRESHOLD 100
+
+/**
+ * @brief Number of compiled calls which may be running at once. Each one nests on
+ * the C stack, so calls made deeper than this are interpreted instead.
+ */
+#define JIT_MAX_DEPTH 256
+
+/**
+ * @brief Entry point of a compiled function.
+ *
+ * @details Called with the function's frame already pushed. On INTERPRETER_OK the
+ * return value is left on top of the stack and the frame is still pushed.
+ */
+typedef InterpreterResult (*JitFunction)(VM *vm, CallFrame *frame);
+
+/**
+ * @brief Compiles a function's chunk to machine code, storing it in `jitCode`.
+ *
+ * @returns true on success, false if the function cannot be compiled
+ */
+bool jitCompile(VM *vm, ObjFunction *func);
+
+/**
+ * @brief Runs the compiled code of the function in `frame`
+ */
+InterpreterResult jitEnter(VM *vm, CallFrame *frame);
+
+/**
+ * @brief Releases a function's machine code
+ */
+void jitFree(ObjFunction *func);
+
+/**
+ * @brief Entry point of a compiled trace.
+ *
+ * @details Called with the frame's `ip` at the loop header. Returns the index of
+ * the snapshot it left through after writing it back, or -1 without touching
+ * anything if the variables it uses don't hold numbers.
+ */
+typedef int (*TraceFunction)(VM *vm, CallFrame *frame);
+
+/**
+ * @brief Compiles a recorded trace to machine code, storing it in `trace->code`.
+ *
+ * @returns true on success, false if the trace needs too many registers
+ */
+bool jitCompileTrace(VM *vm, Trace *trace);
+
+/**
+ * @brief Runs a compiled trace, leaving the frame and stack where it exited
+ *
+ * @returns index of the snapshot the trace exited through, or -1 if it wasn't
+ * entered
+ */
+int jitEnterTrace(VM *vm, CallFrame *frame, Trace *trace);
+
+/**
+ * @brief Releases a trace's machine code
+ */
+void jitFreeTrace(Trace *trace);
+
+/**
+ * @brief Prints the counters collected in `vm->jitStats` to stderr
+ */
+void jitPrintStats(VM *vm);
+
+/**
+ * @brief Slow paths called by compiled code, implemented in vm.c.
+ *
+ * @details Compiled code stores its frame's `ip` and the VM's `stackTop` before
+ * calling any of these so errors report the right line and the GC sees every live
+ * value. Those returning bool return false after reporting a runtime error, except
+ * `jitEqual()` which compares the two values on top of the stack.
+ * `jitCall()` returns the calling frame, which moves when the frame stack grows, or
+ * NULL after an error.
+ */
+bool jitAdd(VM *vm);
+CallFrame *jitCall(VM *vm, uint8_t argCount);
+bool jitEqual(VM *vm);
+bool jitOperandError(VM *vm);
+bool jitOperandsError(VM *vm);
+bool jitUndefinedVariable(VM *vm, uint16_t slot);
+void jitPrint(VM *vm);
+void jitCloseUpvalue(VM *vm);
+
+#endif // clox_jit_h
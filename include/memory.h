@@ -65,6 +65,11 @@ void markValue(VM *vm, Value value);
  */
 void collectGarbage(VM *vm, Compiler *compiler);
 
+/**
+ * @brief Prints the counters collected in `vm->gcStats` to stderr
+ */
+void printGcStats(VM *vm);
+
 /**
  * @brief Free heap objects from VM
  */
@@ -7,6 +7,12 @@
 #include "value.h"
 #include <stdint.h>
 
+/**
+ * @brief Concatenations shorter than this are copied straight away instead of
+ * making a rope
+ */
+#define ROPE_MIN_LENGTH 64
+
 /**
  * @brief Obtains the type tag of an object
  */
@@ -42,6 +48,11 @@
  */
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 
+/**
+ * @brief Checks if value is a shape object
+ */
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
+
 /**
  * @brief Checks if value is a string
  */
@@ -78,6 +89,11 @@
 #define AS_NATIVE_OBJ(value) ((ObjNative *)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->func)
 
+/**
+ * @brief Helper macro for casting value to a shape object
+ */
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
+
 /**
  * @brief Helper macros for extracting Lox strings and string data
  */
@@ -94,6 +110,7 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
@@ -107,8 +124,22 @@ struct Obj {
     struct Obj *next;
 };
 
+/**
+ * @brief Register code translated from a function's chunk
+ */
+typedef struct RegisterCode RegisterCode;
+
 /**
  * @brief Function object type with it's own bytecode chunk
+ *
+ * @details `calls` counts interpreted calls until the function is handed to the
+ * JIT, `jitCode` is the resulting machine code or NULL. `registerCode` is only set
+ * when the register engine is selected.
+ *
+ * A function without upvalues needs only one closure, which is created the first
+ * time it is evaluated and kept in `closure`. `usesCallerFrame` is set when the
+ * function reads or writes locals of its enclosing function in the caller's frame,
+ * see OP_GET_ENCLOSING.
  */
 typedef struct {
     Obj obj;
@@ -116,12 +147,22 @@ typedef struct {
     size_t upvalueCount;
     Chunk chunk;
     ObjString *name;
+    uint32_t calls;
+    void *jitCode;
+    size_t jitSize;
+    RegisterCode *registerCode;
+    ObjClosure *closure;
+    bool usesCallerFrame;
 } ObjFunction;
 
 /**
- * @brief Type of native/OS functions hoisted from C into Lox
+ * @brief Type of native/OS functions hoisted from C into Lox.
+ *
+ * @details Natives store their return value in `result`, or return false after
+ * reporting a runtime error. Their arguments stay on the stack, so they may
+ * allocate.
  */
-typedef Value (*NativeFn)(size_t argCount, Value *arg);
+typedef bool (*NativeFn)(VM *vm, size_t argCount, Value *args, Value *result);
 
 /**
  * @brief Native function object
@@ -134,45 +175,111 @@ typedef struct {
 
 /**
  * @brief Lox internal representation of strings
+ *
+ * @details The characters are stored right after the header, so a string takes a
+ * single allocation. Strings created by the compiler are interned, which makes them
+ * usable as table keys. A string made at runtime is interned when it is first
+ * compared, if that is with an interned string and no equal one is interned yet.
+ * Comparing it again then only compares identities. Other strings compare by their
+ * characters, which aren't hashed before they are compared with a string of the same
+ * length.
+ *
+ * A string with a `left` but no `right` is a view of `length` characters of `left`
+ * from `offset` on, which shares them instead of copying. Views always refer to a
+ * string with characters of its own and keep it alive.
+ *
+ * Concatenating long strings makes a rope instead, a string without characters of
+ * its own whose characters are those of `left` followed by those of `right`.
+ * `flattenString()` joins a rope before it is compared or printed, which drops the
+ * right half and turns the rope into a view of the joined string.
  */
 struct ObjString {
     Obj obj;
     size_t length;
-    char *chars;
-    uint32_t hash;
+    uint32_t hash;     //< 0 until computed for strings which aren't interned
+    uint32_t selector; //< Method selector of the name, 0 if it has none
+    ObjString *left;   //< First half of a rope or string a view refers to
+    ObjString *right;  //< Second half of a rope, NULL for other strings
+    size_t offset;     //< Start of a view in `left`
+    bool interned;     //< Whether the string is in `vm->strings`
+    char chars[];      //< NUL terminated characters, empty for views and ropes
 };
 
 /**
  * @brief Lox internal representation of Upvalues using the Object System
  * such that values are hooked into the GC.
+ *
+ * @details While open, an upvalue is linked into the VM's list of open upvalues
+ * through `next` and `prev`.
  */
 typedef struct {
     Obj obj;
     Value *location;
     Value closed;
     struct ObjUpvalue *next;
+    struct ObjUpvalue *prev;
 } ObjUpvalue;
 
 /**
  * @brief Lox internal representation of closures
  */
-typedef struct {
+struct ObjClosure {
     Obj obj;
     ObjFunction *func;
     ObjUpvalue **upvalues;
     size_t upvalueCount;
-} ObjClosure;
+};
 
-typedef struct {
+/**
+ * @brief Lox class. `version` is bumped whenever `methods` changes so method
+ * inline caches can tell when they are stale.
+ *
+ * @details `initializer` caches the `init` method, or is NULL if there is none, and
+ * `initArity` the number of arguments a construction takes. Both are refreshed when
+ * methods are defined or inherited. `fieldCount` is the most fields an instance of
+ * the class has needed so far, new instances get room for that many up front.
+ */
+struct ObjClass {
     Obj obj;
     ObjString *name;
-    Table methods;
-} ObjClass;
+    uint32_t version;
+    MethodTable methods;
+    ObjClosure *initializer;
+    uint8_t initArity;
+    uint32_t fieldCount;
+};
+
+/**
+ * @brief Hidden class shared by instances that had the same fields added in the
+ * same order.
+ *
+ * @details Shapes form a tree rooted at the VM's empty shape. Each shape adds one
+ * field, `name`, stored at slot `slotCount - 1` on top of its parent's fields.
+ * Shapes are kept alive by their parent's transition table so a shape pointer
+ * never dangles while the VM is alive.
+ */
+struct ObjShape {
+    Obj obj;
+    ObjShape *parent;
+    ObjString *name;
+    uint32_t slotCount;
+    Table transitions;
+};
 
+/**
+ * @brief Class instance. Field values live in `fields` at the slots given by `shape`.
+ *
+ * @details `fields` starts out pointing at `inlineFields`, allocated together with
+ * the instance, and moves to a separate array if the instance outgrows it.
+ */
 typedef struct {
     Obj obj;
     ObjClass *klass;
-    Table fields;
+    ObjShape *shape;
+    uint32_t fieldCapacity;
+    Value *fields;
+    uint32_t inlineCapacity;
+    Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -197,6 +304,26 @@ ObjFunction *newFunction(VM *vm, Compiler *compiler);
  */
 ObjInstance *newInstance(VM *vm, Compiler *compiler, ObjClass *klass);
 
+/**
+ * @brief Looks up the value of an instance's field
+ *
+ * @returns true if the field exists, false otherwise
+ */
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value);
+
+/**
+ * @brief Sets an instance field, transitioning the instance to a new shape if the
+ * field does not exist yet.
+ */
+void instanceSetField(VM *vm, Compiler *compiler, ObjInstance *instance,
+                      ObjString *name, Value value);
+
+/**
+ * @brief Makes sure an instance's field array can hold `slot`
+ */
+void instanceEnsureSlot(VM *vm, Compiler *compiler, ObjInstance *instance,
+                        uint32_t slot);
+
 /**
  * @brief Constructs a class object
  */
@@ -207,20 +334,75 @@ ObjClass *newClass(VM *vm, Compiler *compiler, ObjString *name);
  */
 ObjClosure *newClosure(VM *vm, Compiler *compiler, ObjFunction *func);
 
+/**
+ * @brief Constructs a shape which adds field `name` to `parent`
+ */
+ObjShape *newShape(VM *vm, Compiler *compiler, ObjShape *parent, ObjString *name);
+
+/**
+ * @brief Finds or creates the shape reached by adding field `name` to `shape`
+ */
+ObjShape *shapeTransition(VM *vm, Compiler *compiler, ObjShape *shape, ObjString *name);
+
+/**
+ * @brief Finds the slot holding field `name` in a shape
+ *
+ * @returns true if the field is part of the shape, false otherwise
+ */
+bool shapeFindSlot(ObjShape *shape, ObjString *name, uint32_t *slot);
+
 /**
  * @brief Constructs new native/OS function object
  */
 ObjNative *newNative(VM *vm, Compiler *compiler, NativeFn func, uint8_t arity);
 
 /**
- * @brief Takes ownership of raw char data it is passed
+ * @brief Returns the interned string with the given characters, copying them into
+ * a new string if there is none yet
+ */
+ObjString *copyString(VM *vm, Compiler *compiler, size_t length, const char *chars);
+
+/**
+ * @brief Concatenates two strings reachable by the GC. Short results are copied
+ * into a new string, longer ones make a rope. Neither is interned.
  */
-ObjString *takeString(VM *vm, Compiler *compiler, size_t length, char *chars);
+ObjString *concatenateStrings(VM *vm, Compiler *compiler, ObjString *a, ObjString *b);
 
 /**
- * @brief Copies a string literal from scanned texted into string object
+ * @brief Makes a view of `length` characters of a string reachable by the GC,
+ * starting at `start`. The string may not be a rope that hasn't been joined.
  */
-ObjString *copyString(VM *vm, Compiler *compiler, size_t length, const char *chars);
+ObjString *newStringView(VM *vm, Compiler *compiler, ObjString *string, size_t start,
+                         size_t length);
+
+/**
+ * @brief Returns a string with the characters of `string`, which is `string` itself
+ * unless it is a rope.
+ *
+ * @details Joining a rope allocates, so it has to be reachable by the GC.
+ */
+ObjString *flattenString(VM *vm, Compiler *compiler, ObjString *string);
+
+/**
+ * @brief Returns the interned string with the characters of `string`, which has to
+ * be reachable by the GC. If there is none yet, `string` is interned itself when it
+ * has characters of its own and returned as it is otherwise.
+ *
+ * @details Ropes have to be joined by `flattenString()` first.
+ */
+ObjString *internRuntimeString(VM *vm, Compiler *compiler, ObjString *string);
+
+/**
+ * @brief Compares the characters of two different strings. Ropes which haven't been
+ * joined compare unequal, `flattenString()` has to join them first.
+ */
+bool stringsEqual(ObjString *a, ObjString *b);
+
+/**
+ * @brief Returns the method selector of a name, giving it the next free one the
+ * first time.
+ */
+uint32_t stringSelector(VM *vm, ObjString *name);
 
 /**
  * @brief Constructs an Upvalue from a variable
@@ -236,4 +418,12 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
 }
 
+/**
+ * @brief Characters of a string which isn't a rope. Those of views are not NUL
+ * terminated.
+ */
+static inline const char *stringChars(ObjString *string) {
+    return string->left == NULL ? string->chars : string->left->chars + string->offset;
+}
+
 #endif // clox_object_h
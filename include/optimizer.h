@@ -0,0 +1,38 @@
+/**
+ * @brief Bytecode optimizer run over each chunk once it has been compiled
+ *
+ * @details The compiler emits code straight from the parser. Once a function is
+ * complete its chunk is decoded into a list of instructions, rewritten by the
+ * passes enabled for the optimization level and encoded again with fresh jump
+ * offsets and line information.
+ *
+ * Level 1 folds constant expressions, fuses comparisons followed by OP_NOT and
+ * removes values pushed only to be popped. Level 2 also threads chains of jumps,
+ * removes unreachable code and finally fuses frequent instruction pairs into
+ * superinstructions.
+ *
+ * @file optimizer.h
+ */
+
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+#include "common.h"
+
+/**
+ * @brief Optimization level used unless `-O` says otherwise
+ */
+#define OPTIMIZE_DEFAULT_LEVEL 2
+
+/**
+ * @brief Highest meaningful optimization level
+ */
+#define OPTIMIZE_MAX_LEVEL 2
+
+/**
+ * @brief Optimizes a compiled chunk in place. Level 0 leaves it untouched.
+ */
+void optimizeChunk(VM *vm, Compiler *compiler, Chunk *chunk, uint8_t level);
+
+#endif // clox_optimizer_h
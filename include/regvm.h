@@ -0,0 +1,152 @@
+/**
+ * @brief Register-based bytecode, an alternative to the stack bytecode
+ *
+ * @details Functions compiled while the register engine is selected are translated
+ * from their finished stack bytecode into three-address instructions whose
+ * operands name frame slots directly. The registers of a function are the slots its
+ * stack code would use, so locals keep their slot and every temporary lives in the
+ * slot the stack code would have pushed it to.
+ *
+ * While translating, loads of locals and constants are not copied to their slot
+ * straight away but handed to the instruction using them. Sequences such as
+ * `GET_LOCAL a; GET_LOCAL b; ADD; SET_LOCAL_POP c` become a single `ADD c a b`, and
+ * comparisons followed by a conditional jump become one compare-and-branch.
+ *
+ * Instructions are 32 bit words: an 8 bit opcode and either three 8 bit operands A,
+ * B and C or A and a 16 bit Bx. Some instructions are followed by a data word.
+ *
+ * @file regvm.h
+ */
+
+#ifndef clox_regvm_h
+#define clox_regvm_h
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+
+/**
+ * @brief Register instruction opcodes. R(x) is register x, K(x) is constant x.
+ */
+typedef enum {
+    REG_MOVE,          //< R(A) = R(B)
+    REG_LOAD_CONSTANT, //< R(A) = K(Bx)
+    REG_NIL,           //< R(A) = nil
+    REG_TRUE,          //< R(A) = true
+    REG_FALSE,         //< R(A) = false
+    REG_GET_GLOBAL,    //< R(A) = global Bx
+    REG_DEFINE_GLOBAL, //< global Bx = R(A)
+    REG_SET_GLOBAL,    //< global Bx = R(A), which must be defined
+    REG_GET_UPVALUE,   //< R(A) = upvalue B
+    REG_SET_UPVALUE,   //< upvalue B = R(A)
+    REG_GET_ENCLOSING, //< R(A) = slot B of the caller's frame
+    REG_SET_ENCLOSING, //< slot B of the caller's frame = R(A)
+    REG_GET_PROPERTY,  //< R(A) = R(B).K(C), followed by the property cache index
+    REG_SET_PROPERTY,  //< R(A).K(word >> 16) = R(B), R(C) = R(B), word holds the cache
+    REG_GET_SUPER,     //< R(A) = method K(B) of class R(A + 1) bound to R(A)
+    REG_EQUAL,         //< R(A) = R(B) == R(C)
+    REG_NOT_EQUAL,
+    REG_GREATER,
+    REG_GREATER_EQUAL,
+    REG_LESS,
+    REG_LESS_EQUAL,
+    REG_ADD, //< R(A) = R(B) + R(C)
+    REG_SUBTRACT,
+    REG_MULTIPLY,
+    REG_DIVIDE,
+    REG_ADD_CONSTANT, //< R(A) = R(B) + K(C)
+    REG_SUBTRACT_CONSTANT,
+    REG_MULTIPLY_CONSTANT,
+    REG_DIVIDE_CONSTANT,
+    REG_NOT,    //< R(A) = !R(B)
+    REG_NEGATE, //< R(A) = -R(B)
+    REG_PRINT,  //< print R(A)
+    REG_JUMP,   //< pc += sBx
+    REG_JUMP_IF_FALSE, //< if R(A) is falsey pc += sBx
+
+    // Compare-and-branch: jumps by the signed offset in the following word unless
+    // the comparison of R(A) with R(B) holds. The jump is taken exactly when the
+    // stack code's comparison followed by OP_POP_JUMP_IF_FALSE would jump.
+    REG_JUMP_UNLESS_EQUAL,
+    REG_JUMP_UNLESS_NOT_EQUAL,
+    REG_JUMP_UNLESS_GREATER,
+    REG_JUMP_UNLESS_GREATER_EQUAL,
+    REG_JUMP_UNLESS_LESS,
+    REG_JUMP_UNLESS_LESS_EQUAL,
+    // Same with K(B) as the second operand
+    REG_JUMP_UNLESS_EQUAL_CONSTANT,
+    REG_JUMP_UNLESS_NOT_EQUAL_CONSTANT,
+    REG_JUMP_UNLESS_GREATER_CONSTANT,
+    REG_JUMP_UNLESS_GREATER_EQUAL_CONSTANT,
+    REG_JUMP_UNLESS_LESS_CONSTANT,
+    REG_JUMP_UNLESS_LESS_EQUAL_CONSTANT,
+
+    REG_CALL,         //< Calls R(A) with B arguments in R(A + 1)...
+    REG_TAIL_CALL,    //< Same, reusing the frame if R(A) runs register code
+    REG_INVOKE,       //< Invokes K(C) on R(A) with B arguments, followed by the cache
+    REG_TAIL_INVOKE,  //< Same, reusing the frame if the cached method runs register code
+    REG_SUPER_INVOKE, //< REG_INVOKE on the superclass in R(A + B + 1)
+    REG_CLOSURE, //< R(A) = closure of K(Bx), followed by one word per upvalue
+    REG_CLOSE_UPVALUE, //< Closes the upvalue of R(A)
+    REG_RETURN,        //< Returns R(A)
+    REG_CLASS,         //< R(A) = class K(B)
+    REG_INHERIT,       //< Copies the methods of R(A) into R(A + 1)
+    REG_METHOD,        //< Adds closure R(A + 1) to class R(A) as method K(B)
+} RegOpCode;
+
+/**
+ * @brief Single register instruction or data word
+ */
+typedef uint32_t RegInstruction;
+
+/**
+ * @brief Number of registers a frame can address
+ */
+#define REG_MAX_REGISTERS UINT8_COUNT
+
+/**
+ * @brief Bias added to signed Bx operands so they can be stored unsigned
+ */
+#define REG_SBX_BIAS INT16_MAX
+
+#define REG_ENCODE(op, a, b, c)                                                          \
+    ((RegInstruction)(op) | (RegInstruction)(a) << 8 | (RegInstruction)(b) << 16 |       \
+     (RegInstruction)(c) << 24)
+
+#define REG_ENCODE_BX(op, a, bx)                                                         \
+    ((RegInstruction)(op) | (RegInstruction)(a) << 8 | (RegInstruction)(bx) << 16)
+
+#define REG_OP(ins)  ((RegOpCode)((ins)&0xff))
+#define REG_A(ins)   (((ins) >> 8) & 0xff)
+#define REG_B(ins)   (((ins) >> 16) & 0xff)
+#define REG_C(ins)   ((ins) >> 24)
+#define REG_BX(ins)  ((ins) >> 16)
+#define REG_SBX(ins) ((int32_t)REG_BX(ins) - REG_SBX_BIAS)
+
+/**
+ * @brief Register code of a function.
+ *
+ * @details `lines` holds the source line of every word. `frameSize` is the number
+ * of registers used, which the VM keeps inside its stack while the function runs.
+ */
+struct RegisterCode {
+    size_t count;
+    RegInstruction *code;
+    size_t *lines;
+    size_t frameSize;
+};
+
+/**
+ * @brief Translates the stack bytecode of a compiled function into register code.
+ *
+ * @returns NULL if the function needs more registers than a frame can address, in
+ * which case it is left to the stack interpreter
+ */
+RegisterCode *translateFunction(VM *vm, Compiler *compiler, ObjFunction *func);
+
+/**
+ * @brief Frees register code
+ */
+void freeRegisterCode(VM *vm, Compiler *compiler, RegisterCode *code);
+
+#endif // clox_regvm_h
@@ -1,6 +1,7 @@
 #ifndef clox_table_h
 #define clox_table_h
 
+#include "chunk.h"
 #include "common.h"
 #include "value.h"
 
@@ -56,18 +57,108 @@ bool tableGet(Table *from, ObjString *key, Value *value);
 bool tableDelete(Table *table, ObjString *key);
 
 /**
- * @brief Finds a particular string entry in a hash table, avoiding the use of findEntry()
+ * @brief Marks globals in the VMs hash table to not be swept by GC
  */
-ObjString *tableFindString(Table *table, const char *chars, size_t length, uint32_t hash);
+void markTable(VM *vm, Table *table);
 
 /**
- * @brief Removes the `week' references to strings marked for GC
+ * @brief Set of interned strings.
+ *
+ * @details Hashes and strings are kept in separate arrays so probing only reads
+ * hashes, and a string is only looked at once its hash matches. A zero hash marks
+ * an empty slot, so strings hashing to zero are stored with a hash of one. Strings
+ * are removed by moving the ones after them back in place, which leaves no
+ * tombstones behind.
  */
-void tableRemoveWhite(Table *table);
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *hashes;
+    ObjString **keys;
+} StringSet;
 
 /**
- * @brief Marks globals in the VMs hash table to not be swept by GC
+ * @brief Initializes string set
  */
-void markTable(VM *vm, Table *table);
+void initStringSet(StringSet *set);
+
+/**
+ * @brief Destroys string set
+ */
+void freeStringSet(VM *vm, Compiler *compiler, StringSet *set);
+
+/**
+ * @brief Adds a string which isn't in the set yet, using the hash stored in it
+ */
+void stringSetAdd(VM *vm, Compiler *compiler, StringSet *set, ObjString *string);
+
+/**
+ * @brief Finds the string in the set with the given characters
+ *
+ * @returns the string, or NULL if the set has none with those characters
+ */
+ObjString *stringSetFind(StringSet *set, const char *chars, size_t length, uint32_t hash);
+
+/**
+ * @brief Removes the strings the GC hasn't marked, since the set doesn't keep them
+ * alive
+ */
+void stringSetRemoveWhite(StringSet *set);
+
+/**
+ * @brief Method of a class, stored at the slot given by its name's selector
+ */
+typedef struct {
+    ObjString *name;
+    ObjClosure *method;
+} MethodEntry;
+
+/**
+ * @brief Hash table from method names to closures.
+ *
+ * @details Entries are found by probing linearly from the name's selector, a small
+ * integer given to every name the compiler uses, so no string is hashed. Methods
+ * are never removed and names are compared by identity.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    MethodEntry *entries;
+} MethodTable;
+
+/**
+ * @brief Initializes method table
+ */
+void initMethodTable(MethodTable *table);
+
+/**
+ * @brief Destroys method table
+ */
+void freeMethodTable(VM *vm, Compiler *compiler, MethodTable *table);
+
+/**
+ * @brief Adds a method or replaces the method of the same name. `name` must have
+ * a selector.
+ */
+void methodTableSet(VM *vm, Compiler *compiler, MethodTable *table, ObjString *name,
+                    ObjClosure *method);
+
+/**
+ * @brief Copies all methods from one table to another. Copying into an empty table
+ * copies the entries wholesale.
+ */
+void methodTableAddAll(VM *vm, Compiler *compiler, MethodTable *from, MethodTable *to);
+
+/**
+ * @brief Looks up a method
+ *
+ * @returns the method, or NULL if the table has none of that name
+ */
+ObjClosure *methodTableGet(MethodTable *table, ObjString *name);
+
+/**
+ * @brief Marks the names and closures in a method table
+ */
+void markMethodTable(VM *vm, MethodTable *table);
 
 #endif // clox_table_h
@@ -0,0 +1,157 @@
+/**
+ * @brief Tracing JIT for hot loops
+ *
+ * @details Every OP_LOOP counts how often its back-edge is taken. Once a loop is
+ * hot the recorder executes one iteration itself, starting at the loop header,
+ * and writes down what each instruction did as a linear SSA trace along with the
+ * types it saw and the branches it took. Recording gives up as soon as an
+ * instruction it doesn't understand comes up, leaving the interpreter to carry on
+ * from that instruction.
+ *
+ * Traces only deal in numbers. Local and global variables used by the loop are
+ * type checked once when the trace is entered and then kept unboxed in registers
+ * for as long as the trace runs. Every branch becomes a guard with a snapshot of
+ * the interpreter state at that point; a failing guard writes the state back and
+ * exits to the interpreter at the branch instruction.
+ *
+ * Values which were integers while recording stay integers in general purpose
+ * registers. Integer arithmetic exits to the interpreter through a snapshot taken
+ * before the instruction when its result would not be an integer, which lets the
+ * interpreter redo it in doubles.
+ *
+ * @file trace.h
+ */
+
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+/**
+ * @brief Number of back-edges taken before a loop is recorded
+ */
+#define TRACE_HOT_LOOP 50
+
+/**
+ * @brief Number of failed recordings before a loop is no longer recorded
+ */
+#define TRACE_MAX_ABORTS 3
+
+/**
+ * @brief Size limits of a single trace, recording is aborted past them
+ */
+#define TRACE_MAX_IR        256
+#define TRACE_MAX_VARS      8
+#define TRACE_MAX_STACK     16
+#define TRACE_MAX_SNAPSHOTS 32
+#define TRACE_MAX_FOLLOWED  4
+
+/**
+ * @brief Index of an instruction in a trace, which is also the value it produces
+ */
+typedef uint16_t IrRef;
+
+/**
+ * @brief Trace instructions
+ */
+typedef enum {
+    IR_VAR,   //< Value of variable `index` at the start of the iteration
+    IR_KNUM,  //< Number constant `number`
+    IR_KBOOL, //< Boolean constant `flag`, only used in snapshots
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_NEG,
+    IR_CONV, //< Integer `a` converted to a double
+    IR_LT, //< Comparisons are negated when `flag` is set and only used by guards
+    IR_GT,
+    IR_EQ,
+    IR_GUARD, //< Leaves through snapshot `index` unless comparison `a` is `flag`
+} IrOp;
+
+/**
+ * @brief Single trace instruction.
+ *
+ * @details Instructions marked `integer` produce an int32. Integer arithmetic
+ * leaves through snapshot `index` when its result is not an integer.
+ */
+typedef struct {
+    IrOp op;
+    IrRef a;
+    IrRef b;
+    bool flag;
+    bool integer;
+    uint16_t index;
+    double number;
+} IrIns;
+
+/**
+ * @brief Local or global variable carried in a register by a trace.
+ *
+ * @details `entry` holds the value at the start of each iteration and `current`
+ * the value at the back-edge. Every variable is checked to hold a number when the
+ * trace is entered, or an integer if it held one while recording, and only those
+ * `written` are stored back when it exits.
+ */
+typedef struct {
+    bool global;
+    uint16_t slot;
+    bool written;
+    IrRef entry;
+    IrRef current;
+} TraceVar;
+
+/**
+ * @brief Interpreter state to restore when a guard fails.
+ *
+ * @details `stack` holds the values of the frame slots above the trace's entry
+ * depth. Variables from `varCount` on were first used after the snapshot so still
+ * hold their entry value.
+ */
+typedef struct {
+    uint8_t *ip;
+    uint8_t stackCount;
+    uint8_t varCount;
+    IrRef stack[TRACE_MAX_STACK];
+    IrRef vars[TRACE_MAX_VARS];
+} Snapshot;
+
+/**
+ * @brief Recorded and compiled loop. The loop starts at `anchor` with
+ * `entryDepth` values in its frame.
+ */
+struct Trace {
+    uint8_t *anchor;
+    size_t entryDepth;
+
+    size_t irCount;
+    IrIns ir[TRACE_MAX_IR];
+
+    size_t varCount;
+    TraceVar vars[TRACE_MAX_VARS];
+
+    size_t snapshotCount;
+    Snapshot snapshots[TRACE_MAX_SNAPSHOTS];
+
+    void *code;
+    size_t codeSize;
+};
+
+/**
+ * @brief Records the loop starting at the frame's `ip` and compiles it into
+ * `loop->trace`. The trace is closed by the first back-edge returning to its start.
+ *
+ * @details Instructions are executed while they are recorded, on return the frame's
+ * `ip` and the VM's `stackTop` say where the interpreter should continue.
+ */
+void traceRecord(VM *vm, CallFrame *frame, LoopCache *loop);
+
+/**
+ * @brief Frees a trace and its machine code
+ */
+void traceFree(VM *vm, Compiler *compiler, Trace *trace);
+
+#endif // clox_trace_h
@@ -30,9 +30,19 @@ typedef struct ObjString ObjString;
 #define QNAN      ((uint64_t)0x7ffc000000000000)
 #define SIGN_BIT  ((uint64_t)0x8000000000000000)
 
-#define TAG_NIL   1 // 01.
-#define TAG_FALSE 2 // 10.
-#define TAG_TRUE  3 // 11.
+#define TAG_NIL       1 // 001.
+#define TAG_FALSE     2 // 010.
+#define TAG_TRUE      3 // 011.
+#define TAG_UNDEFINED 4 // 100.
+
+/**
+ * @brief Tag of integers, stored in the low 32 bits of a quiet NaN
+ *
+ * @details Bit 48 is never set by the singleton tags above and sits below the bits
+ * of the NaNs produced by arithmetic, so the upper half of an integer is unique.
+ */
+#define TAG_INT       ((uint64_t)0x0001000000000000)
+#define INT_HIGH      ((uint32_t)((QNAN | TAG_INT) >> 32))
 
 typedef uint64_t  Value;
 
@@ -41,32 +51,53 @@ typedef uint64_t  Value;
  */
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
-#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_DOUBLE(value)    (((value) & QNAN) != QNAN)
+#define IS_INT(value)       ((uint32_t)((value) >> 32) == INT_HIGH)
+#define ARE_INTS(a, b)                                                                   \
+    (((((a) ^ (QNAN | TAG_INT)) | ((b) ^ (QNAN | TAG_INT))) >> 32) == 0)
+#define ARE_DOUBLES(a, b)   (IS_DOUBLE(a) && IS_DOUBLE(b))
+#define IS_NUMBER(value)    valueIsNum(value)
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 /**
  * @brief Extracts value from NaN-Boxed type 
  */
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_INT(value)       ((int32_t)(uint32_t)(value))
+#define AS_DOUBLE(value)    valueToDouble(value)
 #define AS_NUMBER(value)    valueToNum(value)
 #define AS_OBJ(value)       ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
 /**
  * @brief Helper macros for constructing a NaN-Boxed Value of a particular type
+ *
+ * @details UNDEFINED_VAL is internal to the VM. It marks global slots which have
+ * been reserved by the compiler but not yet defined and is never seen by Lox code.
  */
 #define BOOL_VAL(b)         ((b) ? TRUE_VAL : FALSE_VAL)
 #define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define INT_VAL(i)          ((Value)(QNAN | TAG_INT | (uint32_t)(int32_t)(i)))
 #define NUMBER_VAL(num)     numToValue(num)
 #define OBJ_VAL(obj)        (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
-static inline double valueToNum(Value value) {
+static inline bool valueIsNum(Value value) {
+    return IS_DOUBLE(value) || IS_INT(value);
+}
+
+static inline double valueToDouble(Value value) {
     double num;
     memcpy(&num, &value, sizeof(value));
     return num;
 }
 
+static inline double valueToNum(Value value) {
+    return IS_INT(value) ? AS_INT(value) : valueToDouble(value);
+}
+
 static inline Value numToValue(double num) {
     Value value;
     memcpy(&value, &num, sizeof(double));
@@ -84,6 +115,7 @@ typedef enum {
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 /**
@@ -105,11 +137,17 @@ typedef struct {
 #define IS_NIL(value)       ((value).type == VAL_NIL)
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#define IS_INT(value)       ((void)(value), false)
+#define ARE_INTS(a, b)      ((void)(a), (void)(b), false)
+#define ARE_DOUBLES(a, b)   (IS_NUMBER(a) && IS_NUMBER(b))
 
 /**
  * @brief Extracts value from dynamic Lox type (tagged union)
  */
 #define AS_BOOL(value)      ((value).as.boolean)
+#define AS_INT(value)       ((int32_t)(value).as.number)
+#define AS_DOUBLE(value)    ((value).as.number)
 #define AS_NUMBER(value)    ((value).as.number)
 #define AS_OBJ(value)       ((value).as.obj)
 
@@ -118,19 +156,64 @@ typedef struct {
  */
 #define BOOL_VAL(value)     ((Value){VAL_BOOL, { .boolean = (value) }})
 #define NIL_VAL             ((Value){VAL_NIL, { .number = 0 }})
+#define INT_VAL(value)      NUMBER_VAL((double)(value))
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, { .number = (value) }})
 #define OBJ_VAL(object)     ((Value){VAL_OBJ, { .obj = (Obj *)(object) }})
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, { .number = 0 }})
 
 #endif // NAN_BOXING
 
 // clang-format on
 
+/**
+ * @brief Boxes the result of integer arithmetic, as a double if it does not fit in
+ * 32 bits
+ */
+static inline Value intResult(int64_t result) {
+    return result == (int32_t)result ? INT_VAL(result) : NUMBER_VAL((double)result);
+}
+
+/**
+ * @brief Arithmetic on two integers.
+ *
+ * @details Lox numbers are doubles, integers are only a faster representation of
+ * some of them. Results stay integers while they are whole and fit in 32 bits and are
+ * otherwise exactly the doubles the same operation on doubles produces, including
+ * negative zero, which has no integer form. Quotients are always doubles, as in
+ * Lua, so a variable updated by division keeps one representation.
+ */
+static inline Value intAdd(int32_t a, int32_t b) {
+    return intResult((int64_t)a + b);
+}
+
+static inline Value intSubtract(int32_t a, int32_t b) {
+    return intResult((int64_t)a - b);
+}
+
+static inline Value intMultiply(int32_t a, int32_t b) {
+    int64_t result = (int64_t)a * b;
+
+    if (result == 0 && (a < 0 || b < 0)) {
+        return NUMBER_VAL(-0.0);
+    }
+
+    return intResult(result);
+}
+
+static inline Value intDivide(int32_t a, int32_t b) {
+    return NUMBER_VAL((double)a / b);
+}
+
+static inline Value intNegate(int32_t a) {
+    return a == 0 ? NUMBER_VAL(-0.0) : intResult(-(int64_t)a);
+}
+
 /**
  * @brief Dynamic array of values.
  */
 typedef struct {
-    uint8_t capacity;
-    uint8_t count;
+    size_t capacity;
+    size_t count;
     Value *values;
 } ValueArray;
 
@@ -151,6 +234,8 @@ void freeValueArray(VM *vm, Compiler *compiler, ValueArray *array);
 
 /**
  * @brief Checks if two Values are equal.
+ *
+ * @details Strings compare by their characters, ropes only once they are joined.
  */
 bool valuesEqual(Value a, Value b);
 
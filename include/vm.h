@@ -10,38 +10,142 @@
 #include "chunk.h"
 #include "common.h"
 #include "object.h"
+#include "regvm.h"
 #include "scanner.h"
 #include "table.h"
 #include "value.h"
 
+/**
+ * @brief Default call depth limit of a VM, see `framesMax`
+ */
 #define FRAMES_MAX 64
+
+/**
+ * @brief Stack slots each frame is guaranteed: room for 256 locals and as many
+ * temporaries or values pushed by the VM's helpers.
+ */
+#define FRAME_SLOTS (2 * UINT8_COUNT)
+
+/**
+ * @brief Default value stack limit of a VM, see `stackMax`
+ */
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL  FRAME_SLOTS
+
+/**
+ * @brief Number of entries in the VM's method lookup cache, a power of two
+ */
+#define METHOD_CACHE_SIZE 1024
+
+/**
+ * @brief Method lookup cache entry, valid while `klass` has `version`
+ */
+typedef struct {
+    ObjClass *klass;
+    ObjString *name;
+    ObjClosure *method;
+    uint32_t version;
+} MethodCacheEntry;
+
+/**
+ * @brief Active function call. Frames run by the register engine use `pc` in place
+ * of `ip`, which is NULL in all others.
+ */
 typedef struct {
     ObjClosure *closure;
     uint8_t *ip;
     Value *slots;
+    RegInstruction *pc;
 } CallFrame;
 
+/**
+ * @brief Interpreter running the program, selected with `--engine`
+ */
+typedef enum {
+    ENGINE_STACK,
+    ENGINE_REGISTER,
+} Engine;
+
+/**
+ * @brief Counters reported by `--jit-stats`. Times are in seconds.
+ */
+typedef struct {
+    bool enabled; //< Trace execution is only timed when the report is wanted
+
+    size_t functionsCompiled;
+    size_t functionsRejected;
+    size_t tracesCompiled;
+    size_t tracesAborted;
+    size_t traceEntries;
+    size_t traceEntryFailures;
+    uint64_t traceExits;
+
+    double compileTime;
+    double traceTime;
+} JitStats;
+
+/**
+ * @brief Counters reported by `--gc-stats`. Times are in seconds.
+ */
+typedef struct {
+    bool enabled; //< Collections are only timed when the report is wanted
+
+    size_t collections;
+    size_t bytesFreed;
+    size_t peakBytes; //< Largest heap seen when a collection started
+
+    double markTime; //< Marking roots and tracing references
+    double sweepTime;
+} GcStats;
+
 /**
  * @brief VM structure.
+ *
+ * @details Both stacks live on the heap, counted like any other allocation, and grow
+ * on demand, up to `framesMax` frames and `stackMax` values. Those limits may be
+ * changed between `initVM()` and the first call to `interpret()`. Growing the value
+ * stack moves it, so pointers into it are only valid until the next call.
  */
 struct VM {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     size_t frameCount;
+    size_t frameCapacity;
+    size_t framesMax;
 
-    Value stack[STACK_MAX];
+    Value *stack;
+    size_t stackCapacity;
+    size_t stackMax;
     Value *stackTop;
+    Value *stackHigh; //< Slots below have been cleared or written since the last GC
+
+    uint8_t optimizeLevel;
+    Engine engine;
 
-    Table globals;
-    Table strings;
+    bool jitEnabled;
+    uint32_t jitThreshold;
+    uint32_t jitDepth; //< Compiled calls running, each nested on the C stack
+    JitStats jitStats;
+
+    Table globalNames;
+    ValueArray globalValues;
+    StringSet strings;
+    uint32_t selectorCount;
+
+    // METHOD_CACHE_SIZE entries, cleared by every GC so they never refer to freed
+    // classes
+    MethodCacheEntry *methodCache;
 
     ObjString *initString;
-    ObjUpvalue *openUpvalues;
+    ObjShape *emptyShape;
+    ObjUpvalue *openUpvalues;  //< Open upvalues, most recently captured first
+    ObjUpvalue **upvalueSlots; //< Open upvalue of every stack slot, or NULL
 
     size_t bytesAllocated;
     size_t nextGC;
     Obj *objects;
+    GcStats gcStats;
 
     size_t greyCount;
     size_t greyCapacity;
@@ -72,6 +176,12 @@ void freeVM(VM *vm, Compiler *compiler);
  */
 InterpreterResult interpret(VM *vm, Scanner *scanner, const char *source);
 
+/**
+ * @brief Finds the slot of a global variable in `globalValues`, reserving a new
+ * undefined slot the first time a name is seen.
+ */
+size_t resolveGlobal(VM *vm, Compiler *compiler, ObjString *name);
+
 /**
  * @brief Push to VM stack.
  */
@@ -1,8 +1,12 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
+#include "jit.h"
+#include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "vm.h"
 
@@ -53,18 +57,18 @@ static char *readFile(const char *path) {
     return buffer;
 }
 
-static void runFile(VM *vm, Scanner *scanner, const char *path) {
+static InterpreterResult runFile(VM *vm, Scanner *scanner, const char *path) {
     char *source = readFile(path);
     InterpreterResult result = interpret(vm, scanner, source);
     free(source);
+    return result;
+}
 
-    if (result == INTERPRETER_COMPILE_ERR) {
-        exit(65);
-    }
-
-    if (result == INTERPRETER_RUNTIME_ERR) {
-        exit(70);
-    }
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: clox [-O<level>] [--engine=stack|register] [--max-frames=<depth>] "
+            "[--no-jit] [--jit-threshold=<calls>] [--jit-stats] [--gc-stats] [path]\n");
+    exit(64);
 }
 
 int main(int argc, char *argv[]) {
@@ -72,17 +76,84 @@ int main(int argc, char *argv[]) {
     initVM(&vm);
 
     Scanner scanner;
+    const char *path = NULL;
+
+    for (int idx = 1; idx < argc; idx++) {
+        const char *arg = argv[idx];
+
+        if (arg[0] == '-' && arg[1] == 'O') {
+            if (arg[2] < '0' || arg[2] > '0' + OPTIMIZE_MAX_LEVEL || arg[3] != '\0') {
+                usage();
+            }
+
+            vm.optimizeLevel = (uint8_t)(arg[2] - '0');
+        } else if (strcmp(arg, "--engine=stack") == 0) {
+            vm.engine = ENGINE_STACK;
+        } else if (strcmp(arg, "--engine=register") == 0) {
+            vm.engine = ENGINE_REGISTER;
+        } else if (strncmp(arg, "--max-frames=", 13) == 0) {
+            char *end = NULL;
+            unsigned long frames = strtoul(arg + 13, &end, 10);
+
+            if (*end != '\0' || frames < 1 || frames > SIZE_MAX / FRAME_SLOTS) {
+                usage();
+            }
+
+            // The value stack limit grows with the call depth
+            vm.framesMax = (size_t)frames;
+            vm.stackMax = (size_t)frames * UINT8_COUNT;
+        } else if (strcmp(arg, "--no-jit") == 0) {
+            vm.jitEnabled = false;
+        } else if (strncmp(arg, "--jit-threshold=", 16) == 0) {
+            char *end = NULL;
+            unsigned long threshold = strtoul(arg + 16, &end, 10);
+
+            if (*end != '\0' || threshold < 1 || threshold > UINT32_MAX) {
+                usage();
+            }
+
+            vm.jitThreshold = (uint32_t)threshold;
+        } else if (strcmp(arg, "--jit-stats") == 0) {
+            vm.jitStats.enabled = true;
+        } else if (strcmp(arg, "--gc-stats") == 0) {
+            vm.gcStats.enabled = true;
+        } else if (arg[0] != '-' && path == NULL) {
+            path = arg;
+        } else {
+            usage();
+        }
+    }
+
+    // The JIT compiles stack bytecode only
+    if (vm.engine == ENGINE_REGISTER) {
+        vm.jitEnabled = false;
+    }
+
+    InterpreterResult result = INTERPRETER_OK;
 
-    if (argc == 1) {
+    if (path == NULL) {
         repl(&vm, &scanner);
-    } else if (argc == 2) {
-        runFile(&vm, &scanner, argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        result = runFile(&vm, &scanner, path);
+    }
+
+    if (vm.jitStats.enabled) {
+        jitPrintStats(&vm);
+    }
+
+    if (vm.gcStats.enabled) {
+        printGcStats(&vm);
     }
 
     freeVM(&vm, NULL);
 
+    if (result == INTERPRETER_COMPILE_ERR) {
+        return 65;
+    }
+
+    if (result == INTERPRETER_RUNTIME_ERR) {
+        return 70;
+    }
+
     return 0;
 }
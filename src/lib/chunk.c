@@ -1,5 +1,6 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 #include "vm.h"
 
@@ -9,6 +10,18 @@ void initChunk(Chunk *chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+
+    chunk->propertyCacheCount = 0;
+    chunk->propertyCacheCapacity = 0;
+    chunk->propertyCaches = NULL;
+
+    chunk->invokeCacheCount = 0;
+    chunk->invokeCacheCapacity = 0;
+    chunk->invokeCaches = NULL;
+
+    chunk->loopCacheCount = 0;
+    chunk->loopCacheCapacity = 0;
+    chunk->loopCaches = NULL;
 }
 
 void writeChunk(VM *vm, Compiler *compiler, Chunk *chunk, uint8_t byte, size_t line) {
@@ -26,7 +39,51 @@ void writeChunk(VM *vm, Compiler *compiler, Chunk *chunk, uint8_t byte, size_t l
     chunk->count++;
 }
 
-uint8_t addConstant(VM *vm, Compiler *compiler, Chunk *chunk, Value value) {
+size_t instructionLength(Chunk *chunk, size_t offset) {
+    switch ((OpCode)chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_SET_ENCLOSING:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_GET_LOCAL_CONSTANT:
+        case OP_GET_LOCAL_GET_LOCAL:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 4;
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_GET_LOCAL_PROPERTY:
+            return 5;
+        case OP_CLOSURE: {
+            Value func = chunk->constants.values[chunk->code[offset + 1]];
+            return 2 + 2 * AS_FUNCTION(func)->upvalueCount;
+        }
+        default:
+            return 1;
+    }
+}
+
+size_t addConstant(VM *vm, Compiler *compiler, Chunk *chunk, Value value) {
     // Push-pop of value is done so that value is reachable
     // by VM and thus isn't swept if the GC is triggered by
     // `writeValueArray'.
@@ -36,9 +93,68 @@ uint8_t addConstant(VM *vm, Compiler *compiler, Chunk *chunk, Value value) {
     return chunk->constants.count - 1;
 }
 
+size_t addPropertyCache(VM *vm, Compiler *compiler, Chunk *chunk) {
+    if (chunk->propertyCacheCapacity < chunk->propertyCacheCount + 1) {
+        size_t oldCapacity = chunk->propertyCacheCapacity;
+        chunk->propertyCacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->propertyCaches =
+            GROW_ARRAY(vm, compiler, PropertyCache, chunk->propertyCaches, oldCapacity,
+                       chunk->propertyCacheCapacity);
+    }
+
+    PropertyCache *cache = &chunk->propertyCaches[chunk->propertyCacheCount];
+
+    for (size_t idx = 0; idx < PROPERTY_CACHE_SIZE; idx++) {
+        cache->entries[idx].shape = NULL;
+        cache->entries[idx].transition = NULL;
+        cache->entries[idx].slot = 0;
+    }
+
+    return chunk->propertyCacheCount++;
+}
+
+size_t addInvokeCache(VM *vm, Compiler *compiler, Chunk *chunk) {
+    if (chunk->invokeCacheCapacity < chunk->invokeCacheCount + 1) {
+        size_t oldCapacity = chunk->invokeCacheCapacity;
+        chunk->invokeCacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->invokeCaches =
+            GROW_ARRAY(vm, compiler, InvokeCache, chunk->invokeCaches, oldCapacity,
+                       chunk->invokeCacheCapacity);
+    }
+
+    InvokeCache *cache = &chunk->invokeCaches[chunk->invokeCacheCount];
+    cache->klass = NULL;
+    cache->shape = NULL;
+    cache->method = NULL;
+    cache->version = 0;
+
+    return chunk->invokeCacheCount++;
+}
+
+size_t addLoopCache(VM *vm, Compiler *compiler, Chunk *chunk) {
+    if (chunk->loopCacheCapacity < chunk->loopCacheCount + 1) {
+        size_t oldCapacity = chunk->loopCacheCapacity;
+        chunk->loopCacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->loopCaches = GROW_ARRAY(vm, compiler, LoopCache, chunk->loopCaches,
+                                       oldCapacity, chunk->loopCacheCapacity);
+    }
+
+    LoopCache *cache = &chunk->loopCaches[chunk->loopCacheCount];
+    cache->hotness = 0;
+    cache->aborts = 0;
+    cache->trace = NULL;
+
+    return chunk->loopCacheCount++;
+}
+
 void freeChunk(VM *vm, Compiler *compiler, Chunk *chunk) {
     FREE_ARRAY(vm, compiler, uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(vm, compiler, size_t, chunk->lines, chunk->capacity);
     freeValueArray(vm, compiler, &chunk->constants);
+    FREE_ARRAY(vm, compiler, PropertyCache, chunk->propertyCaches,
+               chunk->propertyCacheCapacity);
+    FREE_ARRAY(vm, compiler, InvokeCache, chunk->invokeCaches,
+               chunk->invokeCacheCapacity);
+    FREE_ARRAY(vm, compiler, LoopCache, chunk->loopCaches, chunk->loopCacheCapacity);
     initChunk(chunk);
 }
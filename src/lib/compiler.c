@@ -10,6 +10,7 @@
 #include "compiler.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
 #include "vm.h"
@@ -106,7 +107,8 @@ static size_t emitJump(Parser *parser, uint8_t instruction, Compiler *compiler,
 static void emitLoop(Parser *parser, size_t loopStart, Compiler *compiler, VM *vm) {
     emitByte(parser, OP_LOOP, compiler, vm);
 
-    size_t offset = currentChunk(compiler)->count - loopStart + 2;
+    // Jump is taken after reading both the offset and the loop cache operands
+    size_t offset = currentChunk(compiler)->count - loopStart + 4;
 
     if (offset > UINT16_MAX) {
         error(parser, "Loop body too large.");
@@ -114,6 +116,14 @@ static void emitLoop(Parser *parser, size_t loopStart, Compiler *compiler, VM *v
 
     emitByte(parser, (offset >> 8) & 0xff, compiler, vm);
     emitByte(parser, offset & 0xff, compiler, vm);
+
+    size_t cache = addLoopCache(vm, compiler, currentChunk(compiler));
+
+    if (cache > UINT16_MAX) {
+        error(parser, "Too many loops in one chunk.");
+    }
+
+    emitBytes(parser, (cache >> 8) & 0xff, cache & 0xff, compiler, vm);
 }
 
 static void emitReturn(Parser *parser, Compiler *compiler, VM *vm) {
@@ -127,14 +137,14 @@ static void emitReturn(Parser *parser, Compiler *compiler, VM *vm) {
 }
 
 static uint8_t makeConstant(Parser *parser, Value value, Compiler *compiler, VM *vm) {
-    uint8_t constant = addConstant(vm, compiler, currentChunk(compiler), value);
+    size_t constant = addConstant(vm, compiler, currentChunk(compiler), value);
 
     if (constant > UINT8_MAX) {
         error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
-    return constant;
+    return (uint8_t)constant;
 }
 
 static void emitConstant(Parser *parser, Value value, Compiler *compiler, VM *vm) {
@@ -142,6 +152,26 @@ static void emitConstant(Parser *parser, Value value, Compiler *compiler, VM *vm
               vm);
 }
 
+static void emitPropertyCache(Parser *parser, Compiler *compiler, VM *vm) {
+    size_t cache = addPropertyCache(vm, compiler, currentChunk(compiler));
+
+    if (cache > UINT16_MAX) {
+        error(parser, "Too many property accesses in one chunk.");
+    }
+
+    emitBytes(parser, (cache >> 8) & 0xff, cache & 0xff, compiler, vm);
+}
+
+static void emitInvokeCache(Parser *parser, Compiler *compiler, VM *vm) {
+    size_t cache = addInvokeCache(vm, compiler, currentChunk(compiler));
+
+    if (cache > UINT16_MAX) {
+        error(parser, "Too many method calls in one chunk.");
+    }
+
+    emitBytes(parser, (cache >> 8) & 0xff, cache & 0xff, compiler, vm);
+}
+
 static void patchJump(Parser *parser, size_t offset, Compiler *compiler) {
     size_t jump = currentChunk(compiler)->count - offset - 2;
 
@@ -158,10 +188,23 @@ static ObjFunction *endCompiler(Parser *parser, Compiler *compiler, VM *vm) {
 
     ObjFunction *func = compiler->func;
 
+    if (!parser->hadError) {
+        optimizeChunk(vm, compiler, &func->chunk, vm->optimizeLevel);
+
+        if (vm->engine == ENGINE_REGISTER) {
+            func->registerCode = translateFunction(vm, compiler, func);
+        }
+    }
+
 #ifdef DEBUG_PRINT_CODE
     if (!parser->hadError) {
         disassembleChunk(currentChunk(compiler),
                          func->name != NULL ? func->name->chars : "<script>");
+
+        if (func->registerCode != NULL) {
+            disassembleRegisterCode(func->registerCode, currentChunk(compiler),
+                                    func->name != NULL ? func->name->chars : "<script>");
+        }
     }
 #endif // DEBUG_PRINT_CODE
 
@@ -199,9 +242,28 @@ static void parsePrecedence(Parser *parser, Scanner *scanner, VM *vm, Compiler *
 
 static uint8_t identifierConstant(Parser *parser, Token *name, Compiler *compiler,
                                   VM *vm) {
-    return makeConstant(parser,
-                        OBJ_VAL(copyString(vm, compiler, name->length, name->start)),
-                        compiler, vm);
+    // Any identifier constant may name a method, so each gets its selector now
+    ObjString *string = copyString(vm, compiler, name->length, name->start);
+    stringSelector(vm, string);
+    return makeConstant(parser, OBJ_VAL(string), compiler, vm);
+}
+
+static uint16_t globalSlot(Parser *parser, Token *name, Compiler *compiler, VM *vm) {
+    size_t slot =
+        resolveGlobal(vm, compiler, copyString(vm, compiler, name->length, name->start));
+
+    if (slot > UINT16_MAX) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
+}
+
+static void emitGlobal(Parser *parser, OpCode op, uint16_t slot, Compiler *compiler,
+                       VM *vm) {
+    emitByte(parser, op, compiler, vm);
+    emitBytes(parser, (uint8_t)(slot >> 8), (uint8_t)(slot & 0xff), compiler, vm);
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
@@ -245,18 +307,50 @@ static intmax_t addUpvalue(Compiler *compiler, Parser *parser, uint8_t index,
     }
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
-    compiler->upvalues[upvalueCount].index = index = isLocal;
+    compiler->upvalues[upvalueCount].index = index;
     return (intmax_t)compiler->func->upvalueCount++;
 }
 
+/**
+ * @brief Turns the direct accesses to enclosing locals emitted so far back into
+ * upvalue accesses.
+ *
+ * @details Needed when a function compiled with `directCaptures` turns out to need
+ * upvalues anyway, because it uses a variable from further out or a function
+ * declared in it captures one of the enclosing locals through it.
+ */
+static void captureEnclosingLocals(Compiler *compiler, Parser *parser) {
+    if (!compiler->directCaptures) {
+        return;
+    }
+
+    Compiler *enclosing = (Compiler *)compiler->enclosing;
+    Chunk *chunk = currentChunk(compiler);
+
+    compiler->directCaptures = false;
+    compiler->func->usesCallerFrame = false;
+
+    for (size_t offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+
+        if (code[0] == OP_GET_ENCLOSING || code[0] == OP_SET_ENCLOSING) {
+            enclosing->locals[code[1]].isCaptured = true;
+            code[0] = code[0] == OP_GET_ENCLOSING ? OP_GET_UPVALUE : OP_SET_UPVALUE;
+            code[1] = (uint8_t)addUpvalue(compiler, parser, code[1], true);
+        }
+    }
+}
+
 static intmax_t resolveUpvalue(Compiler *compiler, Parser *parser, Token *name) {
     if (compiler->enclosing == NULL) {
         return -1;
     }
 
-    intmax_t local = resolveLocal(parser, compiler, name);
+    intmax_t local = resolveLocal(parser, (Compiler *)compiler->enclosing, name);
 
     if (local != -1) {
+        captureEnclosingLocals(compiler, parser);
         ((Compiler *)compiler->enclosing)->locals[local].isCaptured = true;
         return addUpvalue(compiler, parser, (uint8_t)local, true);
     }
@@ -264,6 +358,7 @@ static intmax_t resolveUpvalue(Compiler *compiler, Parser *parser, Token *name)
     intmax_t upvalue = resolveUpvalue((Compiler *)compiler->enclosing, parser, name);
 
     if (upvalue != -1) {
+        captureEnclosingLocals(compiler, parser);
         return addUpvalue(compiler, parser, (uint8_t)upvalue, false);
     }
 
@@ -370,6 +465,7 @@ static uint8_t argumentList(Parser *parser, Scanner *scanner, VM *vm, Compiler *
 static void call(Parser *parser, Scanner *scanner, VM *vm, Compiler *compiler,
                  ClassCompiler *currentClass, bool canAssign) {
     uint8_t argCount = argumentList(parser, scanner, vm, compiler, currentClass);
+    compiler->lastCall = currentChunk(compiler)->count;
     emitBytes(parser, OP_CALL, argCount, compiler, vm);
 }
 
@@ -381,12 +477,16 @@ static void dot(Parser *parser, Scanner *scanner, VM *vm, Compiler *compiler,
     if (canAssign && match(parser, scanner, TOKEN_EQUAL)) {
         expression(parser, scanner, vm, compiler, currentClass);
         emitBytes(parser, OP_SET_PROPERTY, name, compiler, vm);
+        emitPropertyCache(parser, compiler, vm);
     } else if (match(parser, scanner, TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList(parser, scanner, vm, compiler, currentClass);
+        compiler->lastCall = currentChunk(compiler)->count;
         emitBytes(parser, OP_INVOKE, name, compiler, vm);
         emitByte(parser, argCount, compiler, vm);
+        emitInvokeCache(parser, compiler, vm);
     } else {
         emitBytes(parser, OP_GET_PROPERTY, name, compiler, vm);
+        emitPropertyCache(parser, compiler, vm);
     }
 }
 
@@ -438,7 +538,13 @@ static void grouping(Parser *parser, Scanner *scanner, VM *vm, Compiler *compile
 static void number(Parser *parser, Scanner *scanner, VM *vm, Compiler *compiler,
                    ClassCompiler *currentClass, bool canAssign) {
     double value = strtod(parser->previous.start, NULL);
-    emitConstant(parser, NUMBER_VAL(value), compiler, vm);
+
+    // Whole numbers in range start out as integers, see intAdd
+    if (value >= INT32_MIN && value <= INT32_MAX && value == (int32_t)value) {
+        emitConstant(parser, INT_VAL((int32_t)value), compiler, vm);
+    } else {
+        emitConstant(parser, NUMBER_VAL(value), compiler, vm);
+    }
 }
 
 static void string(Parser *parser, Scanner *scanner, VM *vm, Compiler *compiler,
@@ -453,18 +559,31 @@ static void namedVariable(Parser *parser, Scanner *scanner, VM *vm, Compiler *co
                           ClassCompiler *currentClass, bool canAssign, Token name) {
     uint8_t getOp;
     uint8_t setOp;
+    Compiler *enclosing = (Compiler *)compiler->enclosing;
     intmax_t arg = resolveLocal(parser, compiler, &name);
 
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+    } else if (compiler->directCaptures &&
+               (arg = resolveLocal(parser, enclosing, &name)) != -1) {
+        getOp = OP_GET_ENCLOSING;
+        setOp = OP_SET_ENCLOSING;
+        compiler->func->usesCallerFrame = true;
     } else if ((arg = resolveUpvalue(compiler, parser, &name)) != -1) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(parser, &name, compiler, vm);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        uint16_t slot = globalSlot(parser, &name, compiler, vm);
+
+        if (canAssign && match(parser, scanner, TOKEN_EQUAL)) {
+            expression(parser, scanner, vm, compiler, currentClass);
+            emitGlobal(parser, OP_SET_GLOBAL, slot, compiler, vm);
+        } else {
+            emitGlobal(parser, OP_GET_GLOBAL, slot, compiler, vm);
+        }
+
+        return;
     }
 
     if (canAssign && match(parser, scanner, TOKEN_EQUAL)) {
@@ -509,6 +628,7 @@ static void super_(Parser *parser, Scanner *scanner, VM *vm, Compiler *compiler,
                       syntheticToken("super"));
         emitBytes(parser, OP_SUPER_INVOKE, name, compiler, vm);
         emitByte(parser, argCount, compiler, vm);
+        emitInvokeCache(parser, compiler, vm);
     } else {
         namedVariable(parser, scanner, vm, compiler, currentClass, false,
                       syntheticToken("super"));
@@ -582,7 +702,7 @@ ParseRule rules[] = {
     [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
     [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
-    [TOKEN_SUPER]         = {NULL,     super_, PREC_NONE},
+    [TOKEN_SUPER]         = {super_,   NULL,   PREC_NONE},
     [TOKEN_THIS]          = {this_,    NULL,   PREC_NONE},
     [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
     [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
@@ -635,8 +755,8 @@ static void block(Parser *parser, Scanner *scanner, VM *vm, Compiler *compiler,
     consume(parser, scanner, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static uint8_t parseVariable(Parser *parser, Scanner *scanner, VM *vm, Compiler *compiler,
-                             const char *errorMsg) {
+static uint16_t parseVariable(Parser *parser, Scanner *scanner, VM *vm,
+                              Compiler *compiler, const char *errorMsg) {
     consume(parser, scanner, TOKEN_IDENTIFIER, errorMsg);
 
     declareVariable(parser, compiler);
@@ -645,7 +765,7 @@ static uint8_t parseVariable(Parser *parser, Scanner *scanner, VM *vm, Compiler
         return 0;
     }
 
-    return identifierConstant(parser, &parser->previous, compiler, vm);
+    return globalSlot(parser, &parser->previous, compiler, vm);
 }
 
 static void markInitialized(Compiler *compiler) {
@@ -656,19 +776,95 @@ static void markInitialized(Compiler *compiler) {
     compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
 }
 
-static void defineVariable(Parser *parser, Compiler *compiler, VM *vm, uint8_t global) {
+static void defineVariable(Parser *parser, Compiler *compiler, VM *vm, uint16_t global) {
     if (compiler->scopeDepth > 0) {
         markInitialized(compiler);
         return;
     }
 
-    emitBytes(parser, OP_DEFINE_GLOBAL, global, compiler, vm);
+    emitGlobal(parser, OP_DEFINE_GLOBAL, global, compiler, vm);
+}
+
+/**
+ * @brief Looks ahead for uses of a local function which let it escape its enclosing
+ * function.
+ *
+ * @details Scans from the parameter list to the end of the block declaring the
+ * function. It does not escape if every use of its name is a call made by the
+ * enclosing function itself, outside the function's own body and any function or
+ * class declared in the block. Such a function only ever runs right above a frame
+ * of its enclosing function, so it can reach the locals it captures in that frame
+ * instead of through upvalues. A shadowing declaration of the name makes the
+ * function escape, which is merely conservative.
+ */
+static bool functionEscapes(Scanner *scanner, Token *name) {
+    Scanner lookahead = *scanner;
+    intmax_t depth = 0;
+    intmax_t nestedDepth = -1; // Depth of the nested body being scanned, if any
+    bool bodyNext = true;      // The next brace opens a function or class body
+    TokenType previous = TOKEN_LEFT_PAREN;
+
+    for (;;) {
+        Token token = scanToken(&lookahead);
+
+        switch (token.type) {
+            case TOKEN_EOF:
+                return false;
+            case TOKEN_LEFT_BRACE:
+                depth += 1;
+
+                if (bodyNext && nestedDepth == -1) {
+                    nestedDepth = depth;
+                }
+
+                bodyNext = false;
+                break;
+            case TOKEN_RIGHT_BRACE:
+                if (depth == nestedDepth) {
+                    nestedDepth = -1;
+                }
+
+                depth -= 1;
+
+                if (depth < 0) {
+                    return false;
+                }
+
+                break;
+            case TOKEN_FUN:
+            case TOKEN_CLASS:
+                bodyNext = true;
+                break;
+            case TOKEN_IDENTIFIER:
+                if (previous == TOKEN_DOT || !identifiersEqual(&token, name)) {
+                    break;
+                }
+
+                if (nestedDepth != -1) {
+                    return true;
+                }
+
+                token = scanToken(&lookahead);
+
+                if (token.type != TOKEN_LEFT_PAREN) {
+                    return true;
+                }
+
+                break;
+            default:
+                break;
+        }
+
+        previous = token.type;
+    }
 }
 
 static void function(Parser *parser, Scanner *scanner, VM *vm, Compiler *compiler,
                      ClassCompiler *currentClass, FunctionType ftype) {
     Compiler localCompiler;
     initCompiler(&localCompiler, compiler, ftype, parser, vm);
+    localCompiler.directCaptures = ftype == TYPE_FUNCTION && compiler->scopeDepth > 0 &&
+                                   !functionEscapes(scanner, &parser->previous);
     beginScope(&localCompiler);
 
     consume(parser, scanner, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -681,9 +877,9 @@ static void function(Parser *parser, Scanner *scanner, VM *vm, Compiler *compile
                 errorAtCurrent(parser, "Can't have more than 254 parameters.");
             }
 
-            uint8_t constant = parseVariable(parser, scanner, vm, &localCompiler,
-                                             "Expect parameter name.");
-            defineVariable(parser, &localCompiler, vm, constant);
+            uint16_t global = parseVariable(parser, scanner, vm, &localCompiler,
+                                            "Expect parameter name.");
+            defineVariable(parser, &localCompiler, vm, global);
         } while (match(parser, scanner, TOKEN_COMMA));
     }
 
@@ -697,8 +893,8 @@ static void function(Parser *parser, Scanner *scanner, VM *vm, Compiler *compile
               compiler, vm);
 
     for (size_t idx = 0; idx < func->upvalueCount; idx++) {
-        emitByte(parser, compiler->upvalues[idx].isLocal ? 1 : 0, compiler, vm);
-        emitByte(parser, compiler->upvalues[idx].index, compiler, vm);
+        emitByte(parser, localCompiler.upvalues[idx].isLocal ? 1 : 0, compiler, vm);
+        emitByte(parser, localCompiler.upvalues[idx].index, compiler, vm);
     }
 }
 
@@ -722,10 +918,16 @@ static void classDeclaration(Parser *parser, Scanner *scanner, VM *vm, Compiler
     consume(parser, scanner, TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser->previous;
     uint8_t nameConstant = identifierConstant(parser, &parser->previous, compiler, vm);
+    uint16_t global = 0;
 
     declareVariable(parser, compiler);
+
+    if (compiler->scopeDepth == 0) {
+        global = globalSlot(parser, &className, compiler, vm);
+    }
+
     emitBytes(parser, OP_CLASS, nameConstant, compiler, vm);
-    defineVariable(parser, compiler, vm, nameConstant);
+    defineVariable(parser, compiler, vm, global);
 
     ClassCompiler classCompiler;
     classCompiler.enclosing = currentClass;
@@ -757,7 +959,7 @@ static void classDeclaration(Parser *parser, Scanner *scanner, VM *vm, Compiler
     }
 
     consume(parser, scanner, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    pop(vm);
+    emitByte(parser, OP_POP, compiler, vm);
 
     if (classCompiler.hasSuperclass) {
         endScope(parser, compiler, vm);
@@ -768,7 +970,7 @@ static void classDeclaration(Parser *parser, Scanner *scanner, VM *vm, Compiler
 
 static void funDeclaration(Parser *parser, Scanner *scanner, VM *vm, Compiler *compiler,
                            ClassCompiler *currentClass) {
-    uint8_t global =
+    uint16_t global =
         parseVariable(parser, scanner, vm, compiler, "Expect function name.");
     markInitialized(compiler);
     function(parser, scanner, vm, compiler, currentClass, TYPE_FUNCTION);
@@ -777,7 +979,7 @@ static void funDeclaration(Parser *parser, Scanner *scanner, VM *vm, Compiler *c
 
 static void varDeclaration(Parser *parser, Scanner *scanner, VM *vm, Compiler *compiler,
                            ClassCompiler *currentClass) {
-    uint8_t global =
+    uint16_t global =
         parseVariable(parser, scanner, vm, compiler, "Expect variable name.");
 
     if (match(parser, scanner, TOKEN_EQUAL)) {
@@ -820,6 +1022,18 @@ static void returnStatement(Parser *parser, Scanner *scanner, VM *vm, Compiler *
 
         expression(parser, scanner, vm, compiler, currentClass);
         consume(parser, scanner, TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // A call ending the expression is in tail position even when a jump of
+        // `and` or `or` lands after it, as the jump lands on the OP_RETURN.
+        Chunk *chunk = currentChunk(compiler);
+
+        if (compiler->lastCall < chunk->count &&
+            compiler->lastCall + instructionLength(chunk, compiler->lastCall) ==
+                chunk->count) {
+            chunk->code[compiler->lastCall] =
+                chunk->code[compiler->lastCall] == OP_CALL ? OP_TAIL_CALL : OP_TAIL_INVOKE;
+        }
+
         emitByte(parser, OP_RETURN, compiler, vm);
     }
 }
@@ -888,6 +1102,7 @@ static void forStatement(Parser *parser, Scanner *scanner, VM *vm, Compiler *com
 
     if (exitJmp != -1) {
         patchJump(parser, (size_t)exitJmp, compiler);
+        emitByte(parser, OP_POP, compiler, vm);
     }
 
     endScope(parser, compiler, vm);
@@ -981,6 +1196,8 @@ void initCompiler(Compiler *compiler, Compiler *enclosing, FunctionType ftype,
     compiler->func = newFunction(vm, compiler);
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastCall = SIZE_MAX;
+    compiler->directCaptures = false;
 
     if (ftype != TYPE_SCRIPT) {
         compiler->func->name =
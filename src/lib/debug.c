@@ -25,12 +25,25 @@ static size_t constantInstruction(const char *name, Chunk *chunk, size_t offset)
 
 static size_t invokeInstruction(const char *name, Chunk *chunk, size_t offset) {
     uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
 
     printf("%-16s (%u args) %4u '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset + 3;
+    printf("' (cache %u)\n", cache);
+    return offset + 5;
+}
+
+static size_t propertyInstruction(const char *name, Chunk *chunk, size_t offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+
+    printf("%-16s %4u '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %u)\n", cache);
+    return offset + 4;
 }
 
 /**
@@ -47,6 +60,41 @@ static size_t byteInstruction(const char *name, Chunk *chunk, size_t offset) {
     return offset + 2;
 }
 
+static size_t twoByteInstruction(const char *name, Chunk *chunk, size_t offset) {
+    uint8_t first = chunk->code[offset + 1];
+    uint8_t second = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 3;
+}
+
+static size_t localConstantInstruction(const char *name, Chunk *chunk, size_t offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4u '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static size_t localPropertyInstruction(const char *name, Chunk *chunk, size_t offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+
+    printf("%-16s %4d %4u '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %u)\n", cache);
+    return offset + 5;
+}
+
+static size_t shortInstruction(const char *name, Chunk *chunk, size_t offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4u\n", name, slot);
+    return offset + 3;
+}
+
 static size_t jumpInstruction(const char *name, int8_t sign, Chunk *chunk,
                               size_t offset) {
     uint16_t jmp = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -56,6 +104,16 @@ static size_t jumpInstruction(const char *name, int8_t sign, Chunk *chunk,
     return offset + 3;
 }
 
+static size_t loopInstruction(const char *name, Chunk *chunk, size_t offset) {
+    uint16_t jmp = (uint16_t)(chunk->code[offset + 1] << 8);
+    jmp |= chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+    printf("%-16s %4zu -> %ld (cache %u)\n", name, offset,
+           ((intmax_t)offset) + 5 - (intmax_t)jmp, cache);
+    return offset + 5;
+}
+
 size_t disassembleInstruction(Chunk *chunk, size_t offset) {
     printf("%04zu ", offset);
 
@@ -81,21 +139,25 @@ size_t disassembleInstruction(Chunk *chunk, size_t offset) {
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return shortInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return byteInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return shortInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return shortInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_ENCLOSING:
+            return byteInstruction("OP_GET_ENCLOSING", chunk, offset);
+        case OP_SET_ENCLOSING:
+            return byteInstruction("OP_SET_ENCLOSING", chunk, offset);
         case OP_GET_PROPERTY:
-            return byteInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return byteInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
@@ -123,11 +185,15 @@ size_t disassembleInstruction(Chunk *chunk, size_t offset) {
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return loopInstruction("OP_LOOP", chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
@@ -159,8 +225,265 @@ size_t disassembleInstruction(Chunk *chunk, size_t offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_GET_LOCAL_CONSTANT:
+            return localConstantInstruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+        case OP_GET_LOCAL_GET_LOCAL:
+            return twoByteInstruction("OP_GET_LOCAL_GET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_SET_GLOBAL_POP:
+            return shortInstruction("OP_SET_GLOBAL_POP", chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_GREATER_NUMBER:
+            return simpleInstruction("OP_GREATER_NUMBER", offset);
+        case OP_GREATER_EQUAL_NUMBER:
+            return simpleInstruction("OP_GREATER_EQUAL_NUMBER", offset);
+        case OP_LESS_NUMBER:
+            return simpleInstruction("OP_LESS_NUMBER", offset);
+        case OP_LESS_EQUAL_NUMBER:
+            return simpleInstruction("OP_LESS_EQUAL_NUMBER", offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_ADD_STRING:
+            return simpleInstruction("OP_ADD_STRING", offset);
+        case OP_SUBTRACT_NUMBER:
+            return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+        case OP_MULTIPLY_NUMBER:
+            return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+        case OP_DIVIDE_NUMBER:
+            return simpleInstruction("OP_DIVIDE_NUMBER", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
+
+void disassembleRegisterCode(RegisterCode *code, Chunk *chunk, const char *name) {
+    printf("== %s (registers: %zu) ==\n", name, code->frameSize);
+
+    for (size_t index = 0; index < code->count;) {
+        index = disassembleRegisterInstruction(code, chunk, index);
+    }
+}
+
+static void printConstant(Chunk *chunk, size_t constant) {
+    printf(" '");
+    printValue(chunk->constants.values[constant]);
+    printf("'");
+}
+
+static size_t registerJumpTarget(RegisterCode *code, size_t index) {
+    return (size_t)((intmax_t)index + 2 + (int32_t)code->code[index + 1]);
+}
+
+size_t disassembleRegisterInstruction(RegisterCode *code, Chunk *chunk, size_t index) {
+    static const char *names[] = {
+        [REG_MOVE] = "REG_MOVE",
+        [REG_LOAD_CONSTANT] = "REG_LOAD_CONSTANT",
+        [REG_NIL] = "REG_NIL",
+        [REG_TRUE] = "REG_TRUE",
+        [REG_FALSE] = "REG_FALSE",
+        [REG_GET_GLOBAL] = "REG_GET_GLOBAL",
+        [REG_DEFINE_GLOBAL] = "REG_DEFINE_GLOBAL",
+        [REG_SET_GLOBAL] = "REG_SET_GLOBAL",
+        [REG_GET_UPVALUE] = "REG_GET_UPVALUE",
+        [REG_SET_UPVALUE] = "REG_SET_UPVALUE",
+        [REG_GET_ENCLOSING] = "REG_GET_ENCLOSING",
+        [REG_SET_ENCLOSING] = "REG_SET_ENCLOSING",
+        [REG_GET_PROPERTY] = "REG_GET_PROPERTY",
+        [REG_SET_PROPERTY] = "REG_SET_PROPERTY",
+        [REG_GET_SUPER] = "REG_GET_SUPER",
+        [REG_EQUAL] = "REG_EQUAL",
+        [REG_NOT_EQUAL] = "REG_NOT_EQUAL",
+        [REG_GREATER] = "REG_GREATER",
+        [REG_GREATER_EQUAL] = "REG_GREATER_EQUAL",
+        [REG_LESS] = "REG_LESS",
+        [REG_LESS_EQUAL] = "REG_LESS_EQUAL",
+        [REG_ADD] = "REG_ADD",
+        [REG_SUBTRACT] = "REG_SUBTRACT",
+        [REG_MULTIPLY] = "REG_MULTIPLY",
+        [REG_DIVIDE] = "REG_DIVIDE",
+        [REG_ADD_CONSTANT] = "REG_ADD_CONSTANT",
+        [REG_SUBTRACT_CONSTANT] = "REG_SUBTRACT_CONSTANT",
+        [REG_MULTIPLY_CONSTANT] = "REG_MULTIPLY_CONSTANT",
+        [REG_DIVIDE_CONSTANT] = "REG_DIVIDE_CONSTANT",
+        [REG_NOT] = "REG_NOT",
+        [REG_NEGATE] = "REG_NEGATE",
+        [REG_PRINT] = "REG_PRINT",
+        [REG_JUMP] = "REG_JUMP",
+        [REG_JUMP_IF_FALSE] = "REG_JUMP_IF_FALSE",
+        [REG_JUMP_UNLESS_EQUAL] = "REG_JUMP_UNLESS_EQUAL",
+        [REG_JUMP_UNLESS_NOT_EQUAL] = "REG_JUMP_UNLESS_NOT_EQUAL",
+        [REG_JUMP_UNLESS_GREATER] = "REG_JUMP_UNLESS_GREATER",
+        [REG_JUMP_UNLESS_GREATER_EQUAL] = "REG_JUMP_UNLESS_GREATER_EQUAL",
+        [REG_JUMP_UNLESS_LESS] = "REG_JUMP_UNLESS_LESS",
+        [REG_JUMP_UNLESS_LESS_EQUAL] = "REG_JUMP_UNLESS_LESS_EQUAL",
+        [REG_JUMP_UNLESS_EQUAL_CONSTANT] = "REG_JUMP_UNLESS_EQUAL_CONSTANT",
+        [REG_JUMP_UNLESS_NOT_EQUAL_CONSTANT] = "REG_JUMP_UNLESS_NOT_EQUAL_CONSTANT",
+        [REG_JUMP_UNLESS_GREATER_CONSTANT] = "REG_JUMP_UNLESS_GREATER_CONSTANT",
+        [REG_JUMP_UNLESS_GREATER_EQUAL_CONSTANT] =
+            "REG_JUMP_UNLESS_GREATER_EQUAL_CONSTANT",
+        [REG_JUMP_UNLESS_LESS_CONSTANT] = "REG_JUMP_UNLESS_LESS_CONSTANT",
+        [REG_JUMP_UNLESS_LESS_EQUAL_CONSTANT] = "REG_JUMP_UNLESS_LESS_EQUAL_CONSTANT",
+        [REG_CALL] = "REG_CALL",
+        [REG_TAIL_CALL] = "REG_TAIL_CALL",
+        [REG_INVOKE] = "REG_INVOKE",
+        [REG_TAIL_INVOKE] = "REG_TAIL_INVOKE",
+        [REG_SUPER_INVOKE] = "REG_SUPER_INVOKE",
+        [REG_CLOSURE] = "REG_CLOSURE",
+        [REG_CLOSE_UPVALUE] = "REG_CLOSE_UPVALUE",
+        [REG_RETURN] = "REG_RETURN",
+        [REG_CLASS] = "REG_CLASS",
+        [REG_INHERIT] = "REG_INHERIT",
+        [REG_METHOD] = "REG_METHOD",
+    };
+
+    RegInstruction ins = code->code[index];
+    RegOpCode op = REG_OP(ins);
+
+    printf("%04zu ", index);
+
+    if (index > 0 && code->lines[index] == code->lines[index - 1]) {
+        printf("   | ");
+    } else {
+        printf("%4zu ", code->lines[index]);
+    }
+
+    printf("%-24s", names[op]);
+
+    switch (op) {
+        case REG_NIL:
+        case REG_TRUE:
+        case REG_FALSE:
+        case REG_PRINT:
+        case REG_CLOSE_UPVALUE:
+        case REG_RETURN:
+        case REG_INHERIT:
+            printf(" r%u\n", REG_A(ins));
+            return index + 1;
+        case REG_MOVE:
+        case REG_NOT:
+        case REG_NEGATE:
+            printf(" r%u r%u\n", REG_A(ins), REG_B(ins));
+            return index + 1;
+        case REG_GET_UPVALUE:
+        case REG_SET_UPVALUE:
+            printf(" r%u u%u\n", REG_A(ins), REG_B(ins));
+            return index + 1;
+        case REG_GET_ENCLOSING:
+        case REG_SET_ENCLOSING:
+            printf(" r%u e%u\n", REG_A(ins), REG_B(ins));
+            return index + 1;
+        case REG_LOAD_CONSTANT:
+            printf(" r%u k%u", REG_A(ins), REG_BX(ins));
+            printConstant(chunk, REG_BX(ins));
+            printf("\n");
+            return index + 1;
+        case REG_GET_GLOBAL:
+        case REG_DEFINE_GLOBAL:
+        case REG_SET_GLOBAL:
+            printf(" r%u g%u\n", REG_A(ins), REG_BX(ins));
+            return index + 1;
+        case REG_GET_PROPERTY:
+            printf(" r%u r%u k%u", REG_A(ins), REG_B(ins), REG_C(ins));
+            printConstant(chunk, REG_C(ins));
+            printf(" (cache %u)\n", code->code[index + 1]);
+            return index + 2;
+        case REG_SET_PROPERTY: {
+            RegInstruction data = code->code[index + 1];
+            printf(" r%u r%u r%u k%u", REG_A(ins), REG_B(ins), REG_C(ins), data >> 16);
+            printConstant(chunk, data >> 16);
+            printf(" (cache %u)\n", data & 0xffff);
+            return index + 2;
+        }
+        case REG_GET_SUPER:
+        case REG_CLASS:
+        case REG_METHOD:
+            printf(" r%u k%u", REG_A(ins), REG_B(ins));
+            printConstant(chunk, REG_B(ins));
+            printf("\n");
+            return index + 1;
+        case REG_EQUAL:
+        case REG_NOT_EQUAL:
+        case REG_GREATER:
+        case REG_GREATER_EQUAL:
+        case REG_LESS:
+        case REG_LESS_EQUAL:
+        case REG_ADD:
+        case REG_SUBTRACT:
+        case REG_MULTIPLY:
+        case REG_DIVIDE:
+            printf(" r%u r%u r%u\n", REG_A(ins), REG_B(ins), REG_C(ins));
+            return index + 1;
+        case REG_ADD_CONSTANT:
+        case REG_SUBTRACT_CONSTANT:
+        case REG_MULTIPLY_CONSTANT:
+        case REG_DIVIDE_CONSTANT:
+            printf(" r%u r%u k%u", REG_A(ins), REG_B(ins), REG_C(ins));
+            printConstant(chunk, REG_C(ins));
+            printf("\n");
+            return index + 1;
+        case REG_JUMP:
+            printf(" -> %ld\n", (intmax_t)index + 1 + REG_SBX(ins));
+            return index + 1;
+        case REG_JUMP_IF_FALSE:
+            printf(" r%u -> %ld\n", REG_A(ins), (intmax_t)index + 1 + REG_SBX(ins));
+            return index + 1;
+        case REG_JUMP_UNLESS_EQUAL:
+        case REG_JUMP_UNLESS_NOT_EQUAL:
+        case REG_JUMP_UNLESS_GREATER:
+        case REG_JUMP_UNLESS_GREATER_EQUAL:
+        case REG_JUMP_UNLESS_LESS:
+        case REG_JUMP_UNLESS_LESS_EQUAL:
+            printf(" r%u r%u -> %zu\n", REG_A(ins), REG_B(ins),
+                   registerJumpTarget(code, index));
+            return index + 2;
+        case REG_JUMP_UNLESS_EQUAL_CONSTANT:
+        case REG_JUMP_UNLESS_NOT_EQUAL_CONSTANT:
+        case REG_JUMP_UNLESS_GREATER_CONSTANT:
+        case REG_JUMP_UNLESS_GREATER_EQUAL_CONSTANT:
+        case REG_JUMP_UNLESS_LESS_CONSTANT:
+        case REG_JUMP_UNLESS_LESS_EQUAL_CONSTANT:
+            printf(" r%u k%u", REG_A(ins), REG_B(ins));
+            printConstant(chunk, REG_B(ins));
+            printf(" -> %zu\n", registerJumpTarget(code, index));
+            return index + 2;
+        case REG_CALL:
+        case REG_TAIL_CALL:
+            printf(" r%u (%u args)\n", REG_A(ins), REG_B(ins));
+            return index + 1;
+        case REG_INVOKE:
+        case REG_TAIL_INVOKE:
+        case REG_SUPER_INVOKE:
+            printf(" r%u (%u args) k%u", REG_A(ins), REG_B(ins), REG_C(ins));
+            printConstant(chunk, REG_C(ins));
+            printf(" (cache %u)\n", code->code[index + 1]);
+            return index + 2;
+        case REG_CLOSURE: {
+            ObjFunction *func = AS_FUNCTION(chunk->constants.values[REG_BX(ins)]);
+            printf(" r%u k%u", REG_A(ins), REG_BX(ins));
+            printConstant(chunk, REG_BX(ins));
+            printf("\n");
+
+            for (size_t idx = 0; idx < func->upvalueCount; idx++) {
+                RegInstruction upvalue = code->code[index + 1 + idx];
+                printf("%04zu    |   %s %u\n", index + 1 + idx,
+                       (upvalue & 0xff) ? "local" : "upvalue", upvalue >> 8);
+            }
+
+            return index + 1 + func->upvalueCount;
+        }
+    }
+
+    printf("Unknown opcode %d\n", op);
+    return index + 1;
+}
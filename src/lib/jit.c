@@ -0,0 +1,1696 @@
+// mmap's MAP_ANONYMOUS is not part of C99
+#define _DEFAULT_SOURCE
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "trace.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef CLOX_JIT
+
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/**
+ * @brief x86-64 general purpose registers
+ */
+typedef enum {
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+} Register;
+
+// Registers holding interpreter state for the whole function. All of them are
+// callee saved so they survive calls into the slow paths.
+#define VM_REG    RBX
+#define QNAN_REG  RBP
+#define SLOTS_REG R13
+#define TOP_REG   R14
+#define FRAME_REG R15
+
+/**
+ * @brief Condition codes used with Jcc and SETcc
+ */
+typedef enum {
+    CC_O = 0x0,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_S = 0x8,
+    CC_P = 0xa,
+    CC_L = 0xc,
+    CC_GE = 0xd,
+    CC_LE = 0xe,
+    CC_G = 0xf,
+} Condition;
+
+/**
+ * @brief Jump target which does not correspond to a bytecode offset
+ */
+#define ERROR_TARGET SIZE_MAX
+
+/**
+ * @brief A rel32 jump operand waiting for the native offset of its target
+ */
+typedef struct {
+    size_t at;
+    size_t target;
+} Fixup;
+
+/**
+ * @brief Machine code buffer for a function being compiled
+ */
+typedef struct {
+    VM *vm;
+    Chunk *chunk;
+
+    size_t count;
+    size_t capacity;
+    uint8_t *code;
+
+    // Native offset of each bytecode offset
+    size_t *offsets;
+
+    size_t fixupCount;
+    size_t fixupCapacity;
+    Fixup *fixups;
+} Assembler;
+
+static void emit(Assembler *as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        size_t oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(as->vm, NULL, uint8_t, as->code, oldCapacity, as->capacity);
+    }
+
+    as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value) {
+    for (size_t idx = 0; idx < 4; idx++) {
+        emit(as, (value >> (8 * idx)) & 0xff);
+    }
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+    for (size_t idx = 0; idx < 8; idx++) {
+        emit(as, (value >> (8 * idx)) & 0xff);
+    }
+}
+
+static void emitRex(Assembler *as, Register reg, Register base) {
+    emit(as, (uint8_t)(0x48 | ((reg >> 3) << 2) | (base >> 3)));
+}
+
+static void emitModRM(Assembler *as, uint8_t mod, uint8_t reg, uint8_t rm) {
+    emit(as, (uint8_t)((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+}
+
+/**
+ * @brief Emits `reg` and a [base + disp32] memory operand
+ */
+static void emitMemory(Assembler *as, Register reg, Register base, int32_t disp) {
+    emitModRM(as, 2, reg, base);
+
+    if ((base & 7) == RSP) {
+        emit(as, 0x24); // SIB byte for a plain base register
+    }
+
+    emit32(as, (uint32_t)disp);
+}
+
+// mov dst, [base + disp]
+static void emitLoad(Assembler *as, Register dst, Register base, int32_t disp) {
+    emitRex(as, dst, base);
+    emit(as, 0x8b);
+    emitMemory(as, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void emitStore(Assembler *as, Register base, int32_t disp, Register src) {
+    emitRex(as, src, base);
+    emit(as, 0x89);
+    emitMemory(as, src, base, disp);
+}
+
+// mov reg, imm64
+static void emitMovImm(Assembler *as, Register reg, uint64_t imm) {
+    emitRex(as, 0, reg);
+    emit(as, (uint8_t)(0xb8 + (reg & 7)));
+    emit64(as, imm);
+}
+
+/**
+ * @brief Emits a 64-bit `op dst, src` for the ALU opcodes taking r/m64, r64
+ */
+static void emitAlu(Assembler *as, uint8_t opcode, Register dst, Register src) {
+    emitRex(as, src, dst);
+    emit(as, opcode);
+    emitModRM(as, 3, src, dst);
+}
+
+#define ALU_ADD  0x01
+#define ALU_OR   0x09
+#define ALU_AND  0x21
+#define ALU_SUB  0x29
+#define ALU_XOR  0x31
+#define ALU_CMP  0x39
+#define ALU_TEST 0x85
+#define ALU_MOV  0x89
+
+/**
+ * @brief Same as `emitAlu` on the low 32 bits, which zeroes the upper half of `dst`
+ */
+static void emitAlu32(Assembler *as, uint8_t opcode, Register dst, Register src) {
+    if (src >= R8 || dst >= R8) {
+        emit(as, (uint8_t)(0x40 | ((src >> 3) << 2) | (dst >> 3)));
+    }
+
+    emit(as, opcode);
+    emitModRM(as, 3, src, dst);
+}
+
+// imul dst32, src32
+static void emitImul32(Assembler *as, Register dst, Register src) {
+    if (src >= R8 || dst >= R8) {
+        emit(as, (uint8_t)(0x40 | ((dst >> 3) << 2) | (src >> 3)));
+    }
+
+    emit(as, 0x0f);
+    emit(as, 0xaf);
+    emitModRM(as, 3, dst, src);
+}
+
+// cmp reg32, imm32
+static void emitCmpImm32(Assembler *as, Register reg, uint32_t imm) {
+    if (reg >= R8) {
+        emit(as, 0x41);
+    }
+
+    emit(as, 0x81);
+    emitModRM(as, 3, 7, reg);
+    emit32(as, imm);
+}
+
+// shr reg, imm8
+static void emitShrImm(Assembler *as, Register reg, uint8_t imm) {
+    emitRex(as, 0, reg);
+    emit(as, 0xc1);
+    emitModRM(as, 3, 5, reg);
+    emit(as, imm);
+}
+
+// add/sub reg, imm32
+static void emitAddImm(Assembler *as, Register reg, int32_t imm) {
+    emitRex(as, 0, reg);
+    emit(as, 0x81);
+    emitModRM(as, 3, imm < 0 ? 5 : 0, reg);
+    emit32(as, (uint32_t)(imm < 0 ? -imm : imm));
+}
+
+static void emitPush(Assembler *as, Register reg) {
+    if (reg >= R8) {
+        emit(as, 0x41);
+    }
+
+    emit(as, (uint8_t)(0x50 + (reg & 7)));
+}
+
+static void emitPop(Assembler *as, Register reg) {
+    if (reg >= R8) {
+        emit(as, 0x41);
+    }
+
+    emit(as, (uint8_t)(0x58 + (reg & 7)));
+}
+
+// movq xmm, reg
+static void emitToXmm(Assembler *as, uint8_t xmm, Register reg) {
+    emit(as, 0x66);
+    emitRex(as, (Register)xmm, reg);
+    emit(as, 0x0f);
+    emit(as, 0x6e);
+    emitModRM(as, 3, xmm, reg);
+}
+
+// movq reg, xmm
+static void emitFromXmm(Assembler *as, Register reg, uint8_t xmm) {
+    emit(as, 0x66);
+    emitRex(as, (Register)xmm, reg);
+    emit(as, 0x0f);
+    emit(as, 0x7e);
+    emitModRM(as, 3, xmm, reg);
+}
+
+// cvtsi2sd xmm, reg32
+static void emitCvtsi2sd(Assembler *as, uint8_t xmm, Register reg) {
+    emit(as, 0xf2);
+
+    if (xmm >= 8 || reg >= R8) {
+        emit(as, (uint8_t)(0x40 | ((xmm >> 3) << 2) | (reg >> 3)));
+    }
+
+    emit(as, 0x0f);
+    emit(as, 0x2a);
+    emitModRM(as, 3, xmm, reg);
+}
+
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+
+// addsd/subsd/mulsd/divsd xmm0, xmm1
+static void emitSse(Assembler *as, uint8_t opcode) {
+    emit(as, 0xf2);
+    emit(as, 0x0f);
+    emit(as, opcode);
+    emitModRM(as, 3, 0, 1);
+}
+
+// ucomisd xmm(a), xmm(b)
+static void emitUcomisd(Assembler *as, uint8_t a, uint8_t b) {
+    emit(as, 0x66);
+
+    if (a >= 8 || b >= 8) {
+        emit(as, (uint8_t)(0x40 | ((a >> 3) << 2) | (b >> 3)));
+    }
+
+    emit(as, 0x0f);
+    emit(as, 0x2e);
+    emitModRM(as, 3, a, b);
+}
+
+#define SSE_MOVAPD 0x28
+#define SSE_XORPD  0x57
+#define SSE_LOAD   0x10
+#define SSE_STORE  0x11
+
+/**
+ * @brief Emits a scalar or packed double `op xmm(reg), xmm(rm)`, `prefix` being
+ * 0xf2 for the scalar and 0x66 for the packed instructions.
+ */
+static void emitSseReg(Assembler *as, uint8_t prefix, uint8_t opcode, uint8_t reg,
+                       uint8_t rm) {
+    emit(as, prefix);
+
+    if (reg >= 8 || rm >= 8) {
+        emit(as, (uint8_t)(0x40 | ((reg >> 3) << 2) | (rm >> 3)));
+    }
+
+    emit(as, 0x0f);
+    emit(as, opcode);
+    emitModRM(as, 3, reg, rm);
+}
+
+// movsd xmm, [base + disp] or movsd [base + disp], xmm
+static void emitSseMem(Assembler *as, uint8_t opcode, uint8_t xmm, Register base,
+                       int32_t disp) {
+    emit(as, 0xf2);
+
+    if (xmm >= 8 || base >= R8) {
+        emit(as, (uint8_t)(0x40 | ((xmm >> 3) << 2) | (base >> 3)));
+    }
+
+    emit(as, 0x0f);
+    emit(as, opcode);
+    emitMemory(as, (Register)xmm, base, disp);
+}
+
+// setcc al; movzx eax, al
+static void emitSetcc(Assembler *as, Condition cc) {
+    emit(as, 0x0f);
+    emit(as, (uint8_t)(0x90 + cc));
+    emitModRM(as, 3, 0, RAX);
+    emit(as, 0x0f);
+    emit(as, 0xb6);
+    emitModRM(as, 3, RAX, RAX);
+}
+
+// test al, al. Only al is defined when a C function returns bool
+static void emitTestBool(Assembler *as) {
+    emit(as, 0x84);
+    emitModRM(as, 3, RAX, RAX);
+}
+
+static void emitCall(Assembler *as, uint64_t target) {
+    emitMovImm(as, RAX, target);
+    emit(as, 0xff);
+    emitModRM(as, 3, 2, RAX);
+}
+
+/**
+ * @brief Emits a jump with an unresolved rel32 operand
+ *
+ * @returns offset of the operand, to be given to `patchJump`
+ */
+static size_t emitJump(Assembler *as) {
+    emit(as, 0xe9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static size_t emitJcc(Assembler *as, Condition cc) {
+    emit(as, 0x0f);
+    emit(as, (uint8_t)(0x80 + cc));
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static void patchJumpTo(Assembler *as, size_t at, size_t target) {
+    uint32_t rel = (uint32_t)((intmax_t)target - (intmax_t)(at + 4));
+    memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+/**
+ * @brief Points a jump emitted earlier in the same template at the current offset
+ */
+static void patchJump(Assembler *as, size_t at) { patchJumpTo(as, at, as->count); }
+
+/**
+ * @brief Records a jump to a bytecode offset, or ERROR_TARGET, to be patched once
+ * the whole chunk has been compiled.
+ */
+static void addFixup(Assembler *as, size_t at, size_t target) {
+    if (as->fixupCapacity < as->fixupCount + 1) {
+        size_t oldCapacity = as->fixupCapacity;
+        as->fixupCapacity = GROW_CAPACITY(oldCapacity);
+        as->fixups =
+            GROW_ARRAY(as->vm, NULL, Fixup, as->fixups, oldCapacity, as->fixupCapacity);
+    }
+
+    as->fixups[as->fixupCount].at = at;
+    as->fixups[as->fixupCount].target = target;
+    as->fixupCount += 1;
+}
+
+// ---- Interpreter state ----
+
+static void emitSyncTop(Assembler *as) {
+    emitStore(as, VM_REG, offsetof(VM, stackTop), TOP_REG);
+}
+
+static void emitReloadTop(Assembler *as) {
+    emitLoad(as, TOP_REG, VM_REG, offsetof(VM, stackTop));
+}
+
+/**
+ * @brief Stores the frame's `ip` as the interpreter would have it after reading the
+ * instruction ending at `next`.
+ */
+static void emitSyncIp(Assembler *as, size_t next) {
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)(as->chunk->code + next));
+    emitStore(as, FRAME_REG, offsetof(CallFrame, ip), RAX);
+}
+
+// Values are kept in the VM stack between instructions, TOP_REG mirrors stackTop
+static void emitPushReg(Assembler *as, Register reg) {
+    emitStore(as, TOP_REG, 0, reg);
+    emitAddImm(as, TOP_REG, sizeof(Value));
+}
+
+static void emitPeek(Assembler *as, Register reg, int32_t distance) {
+    emitLoad(as, reg, TOP_REG, -(int32_t)sizeof(Value) * (distance + 1));
+}
+
+static void emitPoke(Assembler *as, int32_t distance, Register reg) {
+    emitStore(as, TOP_REG, -(int32_t)sizeof(Value) * (distance + 1), reg);
+}
+
+/**
+ * @brief Jumps to the returned jump unless `reg` holds an integer, clobbering
+ * `scratch`
+ */
+static size_t emitIntGuard(Assembler *as, Register reg, Register scratch) {
+    emitAlu(as, ALU_MOV, scratch, reg);
+    emitShrImm(as, scratch, 32);
+    emitCmpImm32(as, scratch, INT_HIGH);
+    return emitJcc(as, CC_NE);
+}
+
+/**
+ * @brief Loads the number in `reg` into xmm(xmm) as a double, converting integers
+ *
+ * @details `qnan` must hold QNAN and `scratch` is clobbered.
+ *
+ * @returns jump taken if `reg` does not hold a number
+ */
+static size_t emitNumberToXmm(Assembler *as, uint8_t xmm, Register reg, Register scratch,
+                              Register qnan) {
+    emitAlu(as, ALU_MOV, scratch, reg);
+    emitAlu(as, ALU_AND, scratch, qnan);
+    emitAlu(as, ALU_CMP, scratch, qnan);
+    size_t isDouble = emitJcc(as, CC_NE);
+    size_t notInt = emitIntGuard(as, reg, scratch);
+    // cvtsi2sd only writes the low half, clearing the register first breaks the
+    // dependency on its previous value
+    emitSseReg(as, 0x66, SSE_XORPD, xmm, xmm);
+    emitCvtsi2sd(as, xmm, reg);
+    size_t done = emitJump(as);
+
+    patchJump(as, isDouble);
+    emitToXmm(as, xmm, reg);
+    patchJump(as, done);
+    return notInt;
+}
+
+/**
+ * @brief Calls a slow path taking only the VM and bails out if it returns false
+ */
+static void emitSlowPath(Assembler *as, uint64_t target, size_t next) {
+    emitSyncIp(as, next);
+    emitSyncTop(as);
+    emitAlu(as, ALU_MOV, RDI, VM_REG);
+    emitCall(as, target);
+    emitReloadTop(as);
+    emitTestBool(as);
+    addFixup(as, emitJcc(as, CC_E), ERROR_TARGET);
+}
+
+#define SLOW_PATH(fn) ((uint64_t)(uintptr_t)(fn))
+
+/**
+ * @brief Boxes the flag in eax into a Lox boolean in rax
+ */
+static void emitBoxBool(Assembler *as) {
+    emitMovImm(as, RCX, FALSE_VAL);
+    emitAlu(as, ALU_OR, RAX, RCX);
+}
+
+/**
+ * @brief Emits the integer form of a number operation on eax and ecx, leaving the
+ * boxed result in rax
+ *
+ * @returns number of jumps stored in `fails`, taken when the result has to be
+ * computed in doubles instead
+ */
+static size_t emitIntOp(Assembler *as, OpCode op, size_t fails[2]) {
+    Condition cc;
+
+    switch (op) {
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY: {
+            size_t count = 0;
+            emitAlu32(as, ALU_MOV, RDX, RAX);
+
+            if (op == OP_MULTIPLY) {
+                emitImul32(as, RDX, RCX);
+            } else {
+                emitAlu32(as, op == OP_ADD ? ALU_ADD : ALU_SUB, RDX, RCX);
+            }
+
+            fails[count++] = emitJcc(as, CC_O);
+
+            // A zero product may have to be negative zero
+            if (op == OP_MULTIPLY) {
+                emitAlu32(as, ALU_TEST, RDX, RDX);
+                fails[count++] = emitJcc(as, CC_E);
+            }
+
+            emitMovImm(as, RAX, QNAN | TAG_INT);
+            emitAlu(as, ALU_OR, RAX, RDX);
+            return count;
+        }
+        case OP_GREATER:
+            cc = CC_G;
+            break;
+        case OP_LESS:
+            cc = CC_L;
+            break;
+        case OP_GREATER_EQUAL:
+            cc = CC_GE;
+            break;
+        default:
+            cc = CC_LE;
+            break;
+    }
+
+    emitAlu32(as, ALU_CMP, RAX, RCX);
+    emitSetcc(as, cc);
+    emitBoxBool(as);
+    return 0;
+}
+
+/**
+ * @brief Emits the double form of a number operation on rax and rcx, converting
+ * integers, leaving the boxed result in rax
+ *
+ * @details The jumps taken when an operand is not a number are stored in `guards`.
+ */
+static void emitDoubleOp(Assembler *as, OpCode op, size_t guards[2]) {
+    guards[0] = emitNumberToXmm(as, 0, RAX, RDX, QNAN_REG);
+    guards[1] = emitNumberToXmm(as, 1, RCX, RDX, QNAN_REG);
+
+    switch (op) {
+        case OP_ADD:
+            emitSse(as, SSE_ADD);
+            emitFromXmm(as, RAX, 0);
+            break;
+        case OP_SUBTRACT:
+            emitSse(as, SSE_SUB);
+            emitFromXmm(as, RAX, 0);
+            break;
+        case OP_MULTIPLY:
+            emitSse(as, SSE_MUL);
+            emitFromXmm(as, RAX, 0);
+            break;
+        case OP_DIVIDE:
+            emitSse(as, SSE_DIV);
+            emitFromXmm(as, RAX, 0);
+            break;
+        case OP_GREATER:
+            emitUcomisd(as, 0, 1);
+            emitSetcc(as, CC_A);
+            emitBoxBool(as);
+            break;
+        case OP_LESS:
+            emitUcomisd(as, 1, 0);
+            emitSetcc(as, CC_A);
+            emitBoxBool(as);
+            break;
+        case OP_GREATER_EQUAL:
+            emitUcomisd(as, 1, 0);
+            emitSetcc(as, CC_BE);
+            emitBoxBool(as);
+            break;
+        case OP_LESS_EQUAL:
+            emitUcomisd(as, 0, 1);
+            emitSetcc(as, CC_BE);
+            emitBoxBool(as);
+            break;
+        default:
+            break; // Unreachable
+    }
+}
+
+/**
+ * @brief Number operation on the two top values with the given slow path
+ *
+ * @details Two integers are added, subtracted, multiplied and compared as integers
+ * on the straight-line path. Results which are not integers are computed again in
+ * doubles out of line, as is everything else, so division always produces a
+ * double.
+ */
+static void emitNumberOp(Assembler *as, OpCode op, uint64_t slow, size_t next) {
+    emitPeek(as, RAX, 1);
+    emitPeek(as, RCX, 0);
+    size_t guards[2] = {0, 0};
+    size_t fails[4];
+    size_t failCount = 0;
+
+    if (op == OP_DIVIDE) {
+        emitDoubleOp(as, op, guards);
+    } else {
+        fails[failCount++] = emitIntGuard(as, RAX, RDX);
+        fails[failCount++] = emitIntGuard(as, RCX, RDX);
+        failCount += emitIntOp(as, op, fails + failCount);
+    }
+
+    size_t store = as->count;
+    emitPoke(as, 1, RAX);
+    emitAddImm(as, TOP_REG, -(int32_t)sizeof(Value));
+    size_t done = emitJump(as);
+
+    if (op != OP_DIVIDE) {
+        for (size_t idx = 0; idx < failCount; idx++) {
+            patchJump(as, fails[idx]);
+        }
+
+        emitDoubleOp(as, op, guards);
+        patchJumpTo(as, emitJump(as), store);
+    }
+
+    patchJump(as, guards[0]);
+    patchJump(as, guards[1]);
+    emitSlowPath(as, slow, next);
+    patchJump(as, done);
+}
+
+/**
+ * @brief Loads the location of upvalue `index` of the running closure into rax
+ */
+static void emitUpvalueLocation(Assembler *as, uint8_t index) {
+    emitLoad(as, RAX, FRAME_REG, offsetof(CallFrame, closure));
+    emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+    emitLoad(as, RAX, RAX, index * (int32_t)sizeof(ObjUpvalue *));
+    emitLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+/**
+ * @brief Loads the slots of the caller's frame into rax
+ */
+static void emitCallerSlots(Assembler *as) {
+    emitLoad(as, RAX, FRAME_REG,
+             (int32_t)offsetof(CallFrame, slots) - (int32_t)sizeof(CallFrame));
+}
+
+static void emitGlobals(Assembler *as, Register reg) {
+    emitLoad(as, reg, VM_REG, offsetof(VM, globalValues) + offsetof(ValueArray, values));
+}
+
+static void emitEpilogue(Assembler *as) {
+    emitPop(as, R15);
+    emitPop(as, R14);
+    emitPop(as, R13);
+    emitPop(as, RBX);
+    emitPop(as, RBP);
+    emit(as, 0xc3); // ret
+}
+
+/**
+ * @brief Compiles one instruction
+ *
+ * @returns offset of the next instruction, or 0 if the instruction is unsupported
+ */
+static size_t compileInstruction(Assembler *as, size_t offset) {
+    uint8_t *code = as->chunk->code;
+    OpCode op = genericOpCode((OpCode)code[offset]);
+
+    switch (op) {
+        case OP_CONSTANT:
+            emitMovImm(as, RAX, as->chunk->constants.values[code[offset + 1]]);
+            emitPushReg(as, RAX);
+            return offset + 2;
+        case OP_NIL:
+            emitMovImm(as, RAX, NIL_VAL);
+            emitPushReg(as, RAX);
+            return offset + 1;
+        case OP_TRUE:
+            emitMovImm(as, RAX, TRUE_VAL);
+            emitPushReg(as, RAX);
+            return offset + 1;
+        case OP_FALSE:
+            emitMovImm(as, RAX, FALSE_VAL);
+            emitPushReg(as, RAX);
+            return offset + 1;
+        case OP_POP:
+            emitAddImm(as, TOP_REG, -(int32_t)sizeof(Value));
+            return offset + 1;
+        case OP_GET_LOCAL:
+            emitLoad(as, RAX, SLOTS_REG, code[offset + 1] * (int32_t)sizeof(Value));
+            emitPushReg(as, RAX);
+            return offset + 2;
+        case OP_GET_LOCAL_CONSTANT:
+            emitLoad(as, RAX, SLOTS_REG, code[offset + 1] * (int32_t)sizeof(Value));
+            emitPushReg(as, RAX);
+            emitMovImm(as, RAX, as->chunk->constants.values[code[offset + 2]]);
+            emitPushReg(as, RAX);
+            return offset + 3;
+        case OP_GET_LOCAL_GET_LOCAL:
+            emitLoad(as, RAX, SLOTS_REG, code[offset + 1] * (int32_t)sizeof(Value));
+            emitPushReg(as, RAX);
+            emitLoad(as, RAX, SLOTS_REG, code[offset + 2] * (int32_t)sizeof(Value));
+            emitPushReg(as, RAX);
+            return offset + 3;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            emitPeek(as, RAX, 0);
+            emitStore(as, SLOTS_REG, code[offset + 1] * (int32_t)sizeof(Value), RAX);
+
+            if (op == OP_SET_LOCAL_POP) {
+                emitAddImm(as, TOP_REG, -(int32_t)sizeof(Value));
+            }
+
+            return offset + 2;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP: {
+            uint16_t slot = (uint16_t)((code[offset + 1] << 8) | code[offset + 2]);
+            int32_t disp = slot * (int32_t)sizeof(Value);
+
+            emitGlobals(as, RCX);
+            emitLoad(as, RDX, RCX, disp);
+            emitMovImm(as, RAX, UNDEFINED_VAL);
+            emitAlu(as, ALU_CMP, RDX, RAX);
+            size_t defined = emitJcc(as, CC_NE);
+
+            emitSyncIp(as, offset + 3);
+            emitAlu(as, ALU_MOV, RDI, VM_REG);
+            emitMovImm(as, RSI, slot);
+            emitCall(as, SLOW_PATH(jitUndefinedVariable));
+            addFixup(as, emitJump(as), ERROR_TARGET);
+
+            patchJump(as, defined);
+
+            if (op == OP_GET_GLOBAL) {
+                emitPushReg(as, RDX);
+            } else {
+                emitPeek(as, RAX, 0);
+                emitStore(as, RCX, disp, RAX);
+            }
+
+            if (op == OP_SET_GLOBAL_POP) {
+                emitAddImm(as, TOP_REG, -(int32_t)sizeof(Value));
+            }
+
+            return offset + 3;
+        }
+        case OP_DEFINE_GLOBAL: {
+            uint16_t slot = (uint16_t)((code[offset + 1] << 8) | code[offset + 2]);
+
+            emitGlobals(as, RCX);
+            emitPeek(as, RAX, 0);
+            emitStore(as, RCX, slot * (int32_t)sizeof(Value), RAX);
+            emitAddImm(as, TOP_REG, -(int32_t)sizeof(Value));
+            return offset + 3;
+        }
+        case OP_GET_UPVALUE:
+            emitUpvalueLocation(as, code[offset + 1]);
+            emitLoad(as, RAX, RAX, 0);
+            emitPushReg(as, RAX);
+            return offset + 2;
+        case OP_SET_UPVALUE:
+            emitUpvalueLocation(as, code[offset + 1]);
+            emitPeek(as, RCX, 0);
+            emitStore(as, RAX, 0, RCX);
+            return offset + 2;
+        case OP_GET_ENCLOSING:
+            emitCallerSlots(as);
+            emitLoad(as, RAX, RAX, code[offset + 1] * (int32_t)sizeof(Value));
+            emitPushReg(as, RAX);
+            return offset + 2;
+        case OP_SET_ENCLOSING:
+            emitCallerSlots(as);
+            emitPeek(as, RCX, 0);
+            emitStore(as, RAX, code[offset + 1] * (int32_t)sizeof(Value), RCX);
+            return offset + 2;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            // Comparing ropes flattens them, which allocates
+            emitSyncTop(as);
+            emitAlu(as, ALU_MOV, RDI, VM_REG);
+            emitCall(as, SLOW_PATH(jitEqual));
+            emitReloadTop(as);
+            emitTestBool(as);
+            emitSetcc(as, op == OP_EQUAL ? CC_NE : CC_E);
+            emitBoxBool(as);
+            emitPoke(as, 1, RAX);
+            emitAddImm(as, TOP_REG, -(int32_t)sizeof(Value));
+            return offset + 1;
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            emitNumberOp(as, op, SLOW_PATH(jitOperandsError), offset + 1);
+            return offset + 1;
+        case OP_ADD:
+            emitNumberOp(as, op, SLOW_PATH(jitAdd), offset + 1);
+            return offset + 1;
+        case OP_NOT:
+            emitPeek(as, RDX, 0);
+            emitMovImm(as, RCX, NIL_VAL);
+            emitAlu(as, ALU_CMP, RDX, RCX);
+            emitSetcc(as, CC_E);
+            emitAlu(as, ALU_MOV, RSI, RAX);
+            emitMovImm(as, RCX, FALSE_VAL);
+            emitAlu(as, ALU_CMP, RDX, RCX);
+            emitSetcc(as, CC_E);
+            emitAlu(as, ALU_OR, RAX, RSI);
+            emitBoxBool(as);
+            emitPoke(as, 0, RAX);
+            return offset + 1;
+        case OP_NEGATE: {
+            // Integers are negated as doubles, which covers negative zero
+            emitPeek(as, RAX, 0);
+            size_t guard = emitNumberToXmm(as, 0, RAX, RDX, QNAN_REG);
+            emitFromXmm(as, RAX, 0);
+            emitMovImm(as, RCX, SIGN_BIT);
+            emitAlu(as, ALU_XOR, RAX, RCX);
+            emitPoke(as, 0, RAX);
+            size_t done = emitJump(as);
+
+            patchJump(as, guard);
+            emitSlowPath(as, SLOW_PATH(jitOperandError), offset + 1);
+            patchJump(as, done);
+            return offset + 1;
+        }
+        case OP_PRINT:
+            emitSyncTop(as);
+            emitAlu(as, ALU_MOV, RDI, VM_REG);
+            emitCall(as, SLOW_PATH(jitPrint));
+            emitReloadTop(as);
+            return offset + 1;
+        case OP_JUMP: {
+            uint16_t jump = (uint16_t)((code[offset + 1] << 8) | code[offset + 2]);
+            addFixup(as, emitJump(as), offset + 3 + jump);
+            return offset + 3;
+        }
+        case OP_LOOP: {
+            // Compiled functions don't need the loop cache, the whole loop is native
+            uint16_t jump = (uint16_t)((code[offset + 1] << 8) | code[offset + 2]);
+            addFixup(as, emitJump(as), offset + 5 - jump);
+            return offset + 5;
+        }
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE: {
+            uint16_t jump = (uint16_t)((code[offset + 1] << 8) | code[offset + 2]);
+            emitPeek(as, RAX, 0);
+
+            if (op == OP_POP_JUMP_IF_FALSE) {
+                emitAddImm(as, TOP_REG, -(int32_t)sizeof(Value));
+            }
+
+            emitMovImm(as, RCX, NIL_VAL);
+            emitAlu(as, ALU_CMP, RAX, RCX);
+            addFixup(as, emitJcc(as, CC_E), offset + 3 + jump);
+            emitMovImm(as, RCX, FALSE_VAL);
+            emitAlu(as, ALU_CMP, RAX, RCX);
+            addFixup(as, emitJcc(as, CC_E), offset + 3 + jump);
+            return offset + 3;
+        }
+        case OP_CALL:
+            emitSyncIp(as, offset + 2);
+            emitSyncTop(as);
+            emitAlu(as, ALU_MOV, RDI, VM_REG);
+            emitMovImm(as, RSI, code[offset + 1]);
+            emitCall(as, SLOW_PATH(jitCall));
+            emitAlu(as, ALU_TEST, RAX, RAX);
+            addFixup(as, emitJcc(as, CC_E), ERROR_TARGET);
+            // The call may have moved both stacks
+            emitAlu(as, ALU_MOV, FRAME_REG, RAX);
+            emitLoad(as, SLOTS_REG, FRAME_REG, offsetof(CallFrame, slots));
+            emitReloadTop(as);
+            return offset + 2;
+        case OP_CLOSE_UPVALUE:
+            emitSyncTop(as);
+            emitAlu(as, ALU_MOV, RDI, VM_REG);
+            emitCall(as, SLOW_PATH(jitCloseUpvalue));
+            emitReloadTop(as);
+            return offset + 1;
+        case OP_RETURN:
+            emitSyncTop(as);
+            emitAlu(as, ALU_XOR, RAX, RAX);
+            emitEpilogue(as);
+            return offset + 1;
+        default:
+            // Including OP_TAIL_CALL, compiled code would need a native frame per
+            // call where the interpreter reuses its frame
+            return 0; // Left to the interpreter
+    }
+}
+
+bool jitCompile(VM *vm, ObjFunction *func) {
+    clock_t start = clock();
+
+    Assembler as;
+    as.vm = vm;
+    as.chunk = &func->chunk;
+    as.count = 0;
+    as.capacity = 0;
+    as.code = NULL;
+    as.fixupCount = 0;
+    as.fixupCapacity = 0;
+    as.fixups = NULL;
+    as.offsets = ALLOCATE(vm, NULL, size_t, func->chunk.count + 1);
+
+    // Prologue: save callee saved registers, 5 pushes keep the stack 16 byte aligned
+    emitPush(&as, RBP);
+    emitPush(&as, RBX);
+    emitPush(&as, R13);
+    emitPush(&as, R14);
+    emitPush(&as, R15);
+    emitAlu(&as, ALU_MOV, VM_REG, RDI);
+    emitAlu(&as, ALU_MOV, FRAME_REG, RSI);
+    emitLoad(&as, SLOTS_REG, FRAME_REG, offsetof(CallFrame, slots));
+    emitReloadTop(&as);
+    emitMovImm(&as, QNAN_REG, QNAN);
+
+    bool supported = true;
+
+    for (size_t offset = 0; offset < func->chunk.count;) {
+        as.offsets[offset] = as.count;
+        offset = compileInstruction(&as, offset);
+
+        if (offset == 0) {
+            supported = false;
+            break;
+        }
+    }
+
+    size_t errorStub = as.count;
+    emitMovImm(&as, RAX, INTERPRETER_RUNTIME_ERR);
+    emitEpilogue(&as);
+
+    void *memory = MAP_FAILED;
+
+    if (supported) {
+        for (size_t idx = 0; idx < as.fixupCount; idx++) {
+            Fixup *fixup = &as.fixups[idx];
+            size_t target =
+                fixup->target == ERROR_TARGET ? errorStub : as.offsets[fixup->target];
+            patchJumpTo(&as, fixup->at, target);
+        }
+
+        memory = mmap(NULL, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    }
+
+    if (memory != MAP_FAILED) {
+        memcpy(memory, as.code, as.count);
+
+        if (mprotect(memory, as.count, PROT_READ | PROT_EXEC) == 0) {
+            func->jitCode = memory;
+            func->jitSize = as.count;
+        } else {
+            munmap(memory, as.count);
+        }
+    }
+
+    FREE_ARRAY(vm, NULL, uint8_t, as.code, as.capacity);
+    FREE_ARRAY(vm, NULL, Fixup, as.fixups, as.fixupCapacity);
+    FREE_ARRAY(vm, NULL, size_t, as.offsets, func->chunk.count + 1);
+
+    if (func->jitCode != NULL) {
+        vm->jitStats.functionsCompiled += 1;
+    } else {
+        vm->jitStats.functionsRejected += 1;
+    }
+
+    vm->jitStats.compileTime += (double)(clock() - start) / CLOCKS_PER_SEC;
+    return func->jitCode != NULL;
+}
+
+InterpreterResult jitEnter(VM *vm, CallFrame *frame) {
+    JitFunction code;
+    void *memory = frame->closure->func->jitCode;
+
+    // ISO C has no conversion from object to function pointers
+    memcpy(&code, &memory, sizeof(code));
+    return code(vm, frame);
+}
+
+void jitFree(ObjFunction *func) {
+    if (func->jitCode != NULL) {
+        munmap(func->jitCode, func->jitSize);
+        func->jitCode = NULL;
+        func->jitSize = 0;
+    }
+}
+
+// ---- Traces ----
+
+// Traces never call out so they keep the interpreter state in argument registers
+#define TRACE_VM      RDI
+#define TRACE_FRAME   RSI
+#define TRACE_SLOTS   RDX
+#define TRACE_GLOBALS RCX
+
+// Doubles live in xmm registers and integers in general purpose ones, numbered
+// within their class. The k-th variable of a class keeps the class's register
+// k from the top for the whole trace, the last register is kept for scratch and the
+// rest are handed out to constants and temporaries.
+#define TRACE_SCRATCH     15
+#define TRACE_INT_SCRATCH 8
+#define VAR_REG(k)        ((uint8_t)(TRACE_SCRATCH - 1 - (k)))
+#define INT_VAR_REG(k)    ((uint8_t)(TRACE_INT_SCRATCH - 1 - (k)))
+#define NO_REG            UINT8_MAX
+
+/**
+ * @brief General purpose registers for integers, the callee saved ones are saved
+ * when the trace is entered
+ */
+static const Register traceIntRegs[] = {R10, R11, RBX, RBP, R12, R13, R14, R15, RAX};
+
+#define INT_REG(reg) traceIntRegs[reg]
+
+/**
+ * @brief Register assignment of a trace being compiled
+ */
+typedef struct {
+    Trace *trace;
+    size_t lastUse[TRACE_MAX_IR];
+    uint8_t reg[TRACE_MAX_IR];
+    uint8_t varReg[TRACE_MAX_VARS];
+
+    // Registers free for temporaries, indexed by class and register up to the
+    // first variable register of the class
+    bool used[2][16];
+    uint8_t regCount[2];
+} TraceRegisters;
+
+static bool producesNumber(IrOp op) {
+    switch (op) {
+        case IR_VAR:
+        case IR_KNUM:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_NEG:
+        case IR_CONV:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void use(TraceRegisters *regs, IrRef ref, size_t at) {
+    if (regs->lastUse[ref] == SIZE_MAX || regs->lastUse[ref] < at) {
+        regs->lastUse[ref] = at;
+    }
+}
+
+static void useSnapshot(TraceRegisters *regs, Snapshot *snap, size_t at) {
+    for (size_t slot = 0; slot < snap->stackCount; slot++) {
+        use(regs, snap->stack[slot], at);
+    }
+
+    for (size_t var = 0; var < snap->varCount; var++) {
+        use(regs, snap->vars[var], at);
+    }
+}
+
+/**
+ * @brief Finds the last instruction needing each value. Guards and integer
+ * arithmetic need everything in their snapshot, the back-edge needs the final
+ * value of every variable.
+ */
+static void computeLastUses(TraceRegisters *regs) {
+    Trace *trace = regs->trace;
+
+    for (size_t idx = 0; idx < trace->irCount; idx++) {
+        regs->lastUse[idx] = SIZE_MAX;
+    }
+
+    for (size_t idx = 0; idx < trace->irCount; idx++) {
+        IrIns *ins = &trace->ir[idx];
+
+        switch (ins->op) {
+            case IR_ADD:
+            case IR_SUB:
+            case IR_MUL:
+            case IR_DIV:
+                use(regs, ins->a, idx);
+                use(regs, ins->b, idx);
+
+                if (ins->integer) {
+                    useSnapshot(regs, &trace->snapshots[ins->index], idx);
+                }
+
+                break;
+            case IR_NEG:
+            case IR_CONV:
+                use(regs, ins->a, idx);
+                break;
+            case IR_GUARD: {
+                IrIns *cond = &trace->ir[ins->a];
+
+                use(regs, cond->a, idx);
+                use(regs, cond->b, idx);
+                useSnapshot(regs, &trace->snapshots[ins->index], idx);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    for (size_t idx = 0; idx < trace->varCount; idx++) {
+        use(regs, trace->vars[idx].current, trace->irCount);
+    }
+}
+
+static bool allocRegister(TraceRegisters *regs, IrRef ref) {
+    bool integer = regs->trace->ir[ref].integer;
+
+    for (uint8_t reg = 0; reg < regs->regCount[integer]; reg++) {
+        if (!regs->used[integer][reg]) {
+            regs->used[integer][reg] = true;
+            regs->reg[ref] = reg;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Gives every live number a register. Variables and constants keep theirs
+ * for the whole trace, temporaries are freed after their last use.
+ *
+ * @returns false if the trace needs more registers than there are
+ */
+static bool allocateRegisters(TraceRegisters *regs) {
+    Trace *trace = regs->trace;
+    bool active[TRACE_MAX_IR] = {false};
+
+    uint8_t varCount[2] = {0, 0};
+
+    for (size_t idx = 0; idx < trace->varCount; idx++) {
+        bool integer = trace->ir[trace->vars[idx].entry].integer;
+        uint8_t k = varCount[integer]++;
+        regs->varReg[idx] = integer ? INT_VAR_REG(k) : VAR_REG(k);
+    }
+
+    memset(regs->used, 0, sizeof(regs->used));
+    regs->regCount[false] = (uint8_t)(TRACE_SCRATCH - varCount[false]);
+    regs->regCount[true] = (uint8_t)(TRACE_INT_SCRATCH - varCount[true]);
+
+    for (size_t idx = 0; idx < trace->irCount; idx++) {
+        IrIns *ins = &trace->ir[idx];
+        regs->reg[idx] = NO_REG;
+
+        if (ins->op == IR_VAR) {
+            regs->reg[idx] = regs->varReg[ins->index];
+        } else if (ins->op == IR_KNUM && regs->lastUse[idx] != SIZE_MAX) {
+            // Share one register between equal constants
+            for (size_t prev = 0; prev < idx; prev++) {
+                if (trace->ir[prev].op == IR_KNUM && regs->reg[prev] != NO_REG &&
+                    trace->ir[prev].integer == ins->integer &&
+                    memcmp(&trace->ir[prev].number, &ins->number, sizeof(double)) == 0) {
+                    regs->reg[idx] = regs->reg[prev];
+                    break;
+                }
+            }
+
+            if (regs->reg[idx] == NO_REG && !allocRegister(regs, (IrRef)idx)) {
+                return false;
+            }
+        }
+    }
+
+    for (size_t idx = 0; idx < trace->irCount; idx++) {
+        IrIns *ins = &trace->ir[idx];
+
+        if (ins->op == IR_VAR || ins->op == IR_KNUM || !producesNumber(ins->op) ||
+            regs->lastUse[idx] == SIZE_MAX) {
+            continue;
+        }
+
+        for (size_t prev = 0; prev < idx; prev++) {
+            if (active[prev] && regs->lastUse[prev] < idx) {
+                regs->used[trace->ir[prev].integer][regs->reg[prev]] = false;
+                active[prev] = false;
+            }
+        }
+
+        if (!allocRegister(regs, (IrRef)idx)) {
+            return false;
+        }
+
+        active[idx] = true;
+    }
+
+    return true;
+}
+
+static Register varBase(TraceVar *var) {
+    return var->global ? TRACE_GLOBALS : TRACE_SLOTS;
+}
+
+static int32_t varDisp(TraceVar *var) { return var->slot * (int32_t)sizeof(Value); }
+
+static void emitMove(Assembler *as, bool integer, uint8_t dst, uint8_t src) {
+    if (integer) {
+        emitAlu32(as, ALU_MOV, INT_REG(dst), INT_REG(src));
+    } else {
+        emitSseReg(as, 0x66, SSE_MOVAPD, dst, src);
+    }
+}
+
+/**
+ * @brief Copies the final value of every written variable of one register class
+ * into the variable's own register, ordering the moves so none overwrites a value
+ * still to be read.
+ */
+static void emitBackEdgeMoves(Assembler *as, TraceRegisters *regs, bool integer) {
+    Trace *trace = regs->trace;
+    uint8_t scratch = integer ? TRACE_INT_SCRATCH : TRACE_SCRATCH;
+    uint8_t *dst = regs->varReg;
+    uint8_t src[TRACE_MAX_VARS];
+    bool pending[TRACE_MAX_VARS];
+    size_t pendingCount = 0;
+
+    for (size_t idx = 0; idx < trace->varCount; idx++) {
+        src[idx] = regs->reg[trace->vars[idx].current];
+        pending[idx] = trace->ir[trace->vars[idx].entry].integer == integer &&
+                       src[idx] != dst[idx];
+        pendingCount += pending[idx];
+    }
+
+    while (pendingCount > 0) {
+        bool progress = false;
+
+        for (size_t idx = 0; idx < trace->varCount; idx++) {
+            if (!pending[idx]) {
+                continue;
+            }
+
+            bool blocked = false;
+
+            for (size_t other = 0; other < trace->varCount; other++) {
+                if (pending[other] && other != idx && src[other] == dst[idx]) {
+                    blocked = true;
+                }
+            }
+
+            if (!blocked) {
+                emitMove(as, integer, dst[idx], src[idx]);
+                pending[idx] = false;
+                pendingCount -= 1;
+                progress = true;
+            }
+        }
+
+        if (!progress) {
+            // Every remaining move is part of a cycle, park one value in scratch
+            for (size_t idx = 0; idx < trace->varCount; idx++) {
+                if (pending[idx]) {
+                    emitMove(as, integer, scratch, dst[idx]);
+
+                    for (size_t other = 0; other < trace->varCount; other++) {
+                        if (pending[other] && src[other] == dst[idx]) {
+                            src[other] = scratch;
+                        }
+                    }
+
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Stores the value of `ref` boxed, clobbering RAX
+ */
+static void emitStoreRef(Assembler *as, TraceRegisters *regs, IrRef ref, Register base,
+                         int32_t disp) {
+    if (regs->trace->ir[ref].integer) {
+        // Integer registers always have their upper half cleared
+        emitMovImm(as, RAX, QNAN | TAG_INT);
+        emitAlu(as, ALU_OR, RAX, INT_REG(regs->reg[ref]));
+        emitStore(as, base, disp, RAX);
+    } else {
+        emitSseMem(as, SSE_STORE, regs->reg[ref], base, disp);
+    }
+}
+
+static const Register traceSaved[] = {RBX, RBP, R12, R13, R14, R15};
+
+static void emitTraceReturn(Assembler *as) {
+    for (size_t idx = sizeof(traceSaved) / sizeof(traceSaved[0]); idx > 0; idx--) {
+        emitPop(as, traceSaved[idx - 1]);
+    }
+
+    emit(as, 0xc3); // ret
+}
+
+/**
+ * @brief Writes a snapshot back to the interpreter and returns its index
+ */
+static void emitExit(Assembler *as, TraceRegisters *regs, uint16_t index) {
+    Trace *trace = regs->trace;
+    Snapshot *snap = &trace->snapshots[index];
+
+    for (size_t idx = 0; idx < trace->varCount; idx++) {
+        TraceVar *var = &trace->vars[idx];
+
+        if (var->written) {
+            IrRef ref = idx < snap->varCount ? snap->vars[idx] : var->entry;
+            emitStoreRef(as, regs, ref, varBase(var), varDisp(var));
+        }
+    }
+
+    for (size_t idx = 0; idx < snap->stackCount; idx++) {
+        IrIns *ins = &trace->ir[snap->stack[idx]];
+        int32_t disp = (int32_t)((trace->entryDepth + idx) * sizeof(Value));
+
+        if (ins->op == IR_KBOOL) {
+            emitMovImm(as, RAX, BOOL_VAL(ins->flag));
+            emitStore(as, TRACE_SLOTS, disp, RAX);
+        } else {
+            emitStoreRef(as, regs, snap->stack[idx], TRACE_SLOTS, disp);
+        }
+    }
+
+    // lea rax, [slots + disp]
+    emitRex(as, RAX, TRACE_SLOTS);
+    emit(as, 0x8d);
+    emitMemory(as, RAX, TRACE_SLOTS,
+               (int32_t)((trace->entryDepth + snap->stackCount) * sizeof(Value)));
+    emitStore(as, TRACE_VM, offsetof(VM, stackTop), RAX);
+
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)snap->ip);
+    emitStore(as, TRACE_FRAME, offsetof(CallFrame, ip), RAX);
+
+    emitMovImm(as, RAX, index);
+    emitTraceReturn(as);
+}
+
+/**
+ * @brief Emits a guard's comparison and the jumps taken when it fails
+ */
+static void emitGuard(Assembler *as, TraceRegisters *regs, IrIns *guard,
+                      size_t exits[], size_t *exitCount) {
+    IrIns *cond = &regs->trace->ir[guard->a];
+    uint8_t a = regs->reg[cond->a];
+    uint8_t b = regs->reg[cond->b];
+    bool want = guard->flag != cond->flag;
+
+    if (regs->trace->ir[cond->a].integer) {
+        Condition holds = cond->op == IR_EQ ? CC_E : cond->op == IR_LT ? CC_L : CC_G;
+
+        // Flipping the lowest bit negates a condition code
+        emitAlu32(as, ALU_CMP, INT_REG(a), INT_REG(b));
+        exits[(*exitCount)++] = emitJcc(as, want ? (Condition)(holds ^ 1) : holds);
+        return;
+    }
+
+    if (cond->op == IR_EQ) {
+        emitUcomisd(as, a, b);
+
+        if (want) {
+            exits[(*exitCount)++] = emitJcc(as, CC_NE);
+            exits[(*exitCount)++] = emitJcc(as, CC_P);
+        } else {
+            // Unordered compares are never equal
+            size_t unordered = emitJcc(as, CC_P);
+            exits[(*exitCount)++] = emitJcc(as, CC_E);
+            patchJump(as, unordered);
+        }
+
+        return;
+    }
+
+    // a < b is b > a, "above" is false for unordered operands as Lox wants
+    if (cond->op == IR_LT) {
+        emitUcomisd(as, b, a);
+    } else {
+        emitUcomisd(as, a, b);
+    }
+
+    exits[(*exitCount)++] = emitJcc(as, want ? CC_BE : CC_A);
+}
+
+/**
+ * @brief Emits integer arithmetic into register `dst` and the jumps taken when
+ * its result would not be an integer: one on overflow and for multiplication a
+ * second one when a zero product should be negative zero.
+ */
+static void emitIntArithmetic(Assembler *as, TraceRegisters *regs, IrIns *ins,
+                              uint8_t dst, size_t exits[]) {
+    Register out = INT_REG(dst);
+    Register a = INT_REG(regs->reg[ins->a]);
+    Register b = INT_REG(regs->reg[ins->b]);
+
+    emitAlu32(as, ALU_MOV, out, a);
+
+    if (ins->op == IR_MUL) {
+        emitImul32(as, out, b);
+    } else {
+        emitAlu32(as, ins->op == IR_ADD ? ALU_ADD : ALU_SUB, out, b);
+    }
+
+    exits[0] = emitJcc(as, CC_O);
+
+    if (ins->op == IR_MUL) {
+        emitAlu32(as, ALU_TEST, out, out);
+        size_t nonZero = emitJcc(as, CC_NE);
+        emitAlu32(as, ALU_MOV, RAX, a);
+        emitAlu32(as, ALU_OR, RAX, b);
+        exits[1] = emitJcc(as, CC_S);
+        patchJump(as, nonZero);
+    }
+}
+
+bool jitCompileTrace(VM *vm, Trace *trace) {
+    TraceRegisters regs;
+    regs.trace = trace;
+    computeLastUses(&regs);
+
+    if (!allocateRegisters(&regs)) {
+        return false;
+    }
+
+    Assembler as;
+    as.vm = vm;
+    as.chunk = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.code = NULL;
+    as.offsets = NULL;
+    as.fixupCount = 0;
+    as.fixupCapacity = 0;
+    as.fixups = NULL;
+
+    for (size_t idx = 0; idx < sizeof(traceSaved) / sizeof(traceSaved[0]); idx++) {
+        emitPush(&as, traceSaved[idx]);
+    }
+
+    // Entry: load and type check every variable, bailing out before anything has
+    // been written if one does not hold a number of the recorded kind
+    emitLoad(&as, TRACE_SLOTS, TRACE_FRAME, offsetof(CallFrame, slots));
+    emitLoad(&as, TRACE_GLOBALS, TRACE_VM,
+             offsetof(VM, globalValues) + offsetof(ValueArray, values));
+    emitMovImm(&as, R8, QNAN);
+
+    size_t entryFails[TRACE_MAX_VARS];
+
+    for (size_t idx = 0; idx < trace->varCount; idx++) {
+        TraceVar *var = &trace->vars[idx];
+
+        emitLoad(&as, RAX, varBase(var), varDisp(var));
+
+        if (trace->ir[var->entry].integer) {
+            entryFails[idx] = emitIntGuard(&as, RAX, R9);
+            emitAlu32(&as, ALU_MOV, INT_REG(regs.varReg[idx]), RAX);
+        } else {
+            entryFails[idx] = emitNumberToXmm(&as, regs.varReg[idx], RAX, R9, R8);
+        }
+    }
+
+    for (size_t idx = 0; idx < trace->irCount; idx++) {
+        IrIns *ins = &trace->ir[idx];
+
+        if (ins->op == IR_KNUM && regs.reg[idx] != NO_REG && ins->integer) {
+            emitMovImm(&as, INT_REG(regs.reg[idx]), (uint32_t)(int32_t)ins->number);
+        } else if (ins->op == IR_KNUM && regs.reg[idx] != NO_REG) {
+            uint64_t bits;
+            memcpy(&bits, &ins->number, sizeof(bits));
+            emitMovImm(&as, RAX, bits);
+            emitToXmm(&as, regs.reg[idx], RAX);
+        }
+    }
+
+    // Loop body
+    size_t loop = as.count;
+    size_t exits[2 * TRACE_MAX_SNAPSHOTS];
+    uint16_t exitSnapshots[2 * TRACE_MAX_SNAPSHOTS];
+    size_t exitCount = 0;
+
+    for (size_t idx = 0; idx < trace->irCount; idx++) {
+        IrIns *ins = &trace->ir[idx];
+        uint8_t dst = regs.reg[idx];
+
+        switch (ins->op) {
+            case IR_ADD:
+            case IR_SUB:
+            case IR_MUL:
+            case IR_DIV: {
+                if (dst == NO_REG) {
+                    break; // Never used
+                }
+
+                if (ins->integer) {
+                    emitIntArithmetic(&as, &regs, ins, dst, &exits[exitCount]);
+                    exitSnapshots[exitCount++] = ins->index;
+
+                    if (ins->op == IR_MUL) {
+                        exitSnapshots[exitCount++] = ins->index;
+                    }
+
+                    break;
+                }
+
+                uint8_t opcode = ins->op == IR_ADD   ? SSE_ADD
+                                 : ins->op == IR_SUB ? SSE_SUB
+                                 : ins->op == IR_MUL ? SSE_MUL
+                                                     : SSE_DIV;
+                emitSseReg(&as, 0x66, SSE_MOVAPD, dst, regs.reg[ins->a]);
+                emitSseReg(&as, 0xf2, opcode, dst, regs.reg[ins->b]);
+                break;
+            }
+            case IR_NEG:
+                if (dst == NO_REG) {
+                    break;
+                }
+
+                emitMovImm(&as, RAX, SIGN_BIT);
+                emitToXmm(&as, TRACE_SCRATCH, RAX);
+                emitSseReg(&as, 0x66, SSE_MOVAPD, dst, regs.reg[ins->a]);
+                emitSseReg(&as, 0x66, SSE_XORPD, dst, TRACE_SCRATCH);
+                break;
+            case IR_CONV:
+                if (dst == NO_REG) {
+                    break;
+                }
+
+                emitSseReg(&as, 0x66, SSE_XORPD, dst, dst);
+                emitCvtsi2sd(&as, dst, INT_REG(regs.reg[ins->a]));
+                break;
+            case IR_GUARD: {
+                size_t first = exitCount;
+                emitGuard(&as, &regs, ins, exits, &exitCount);
+
+                for (size_t exit = first; exit < exitCount; exit++) {
+                    exitSnapshots[exit] = ins->index;
+                }
+
+                break;
+            }
+            default:
+                break; // Comparisons are emitted by their guard
+        }
+    }
+
+    emitBackEdgeMoves(&as, &regs, false);
+    emitBackEdgeMoves(&as, &regs, true);
+    patchJumpTo(&as, emitJump(&as), loop);
+
+    // Side exits
+    size_t stubs[TRACE_MAX_SNAPSHOTS];
+
+    for (uint16_t idx = 0; idx < trace->snapshotCount; idx++) {
+        stubs[idx] = as.count;
+        emitExit(&as, &regs, idx);
+    }
+
+    for (size_t idx = 0; idx < exitCount; idx++) {
+        patchJumpTo(&as, exits[idx], stubs[exitSnapshots[idx]]);
+    }
+
+    for (size_t idx = 0; idx < trace->varCount; idx++) {
+        patchJump(&as, entryFails[idx]);
+    }
+
+    emitMovImm(&as, RAX, (uint64_t)-1);
+    emitTraceReturn(&as);
+
+    void *memory =
+        mmap(NULL, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (memory != MAP_FAILED) {
+        memcpy(memory, as.code, as.count);
+
+        if (mprotect(memory, as.count, PROT_READ | PROT_EXEC) == 0) {
+            trace->code = memory;
+            trace->codeSize = as.count;
+        } else {
+            munmap(memory, as.count);
+        }
+    }
+
+    FREE_ARRAY(vm, NULL, uint8_t, as.code, as.capacity);
+    return trace->code != NULL;
+}
+
+int jitEnterTrace(VM *vm, CallFrame *frame, Trace *trace) {
+    TraceFunction code;
+    clock_t start = vm->jitStats.enabled ? clock() : 0;
+
+    memcpy(&code, &trace->code, sizeof(code));
+    int exit = code(vm, frame);
+
+    if (vm->jitStats.enabled) {
+        vm->jitStats.traceTime += (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+
+    vm->jitStats.traceEntries += 1;
+
+    if (exit < 0) {
+        vm->jitStats.traceEntryFailures += 1;
+    } else {
+        vm->jitStats.traceExits += 1;
+    }
+
+    return exit;
+}
+
+void jitFreeTrace(Trace *trace) {
+    if (trace->code != NULL) {
+        munmap(trace->code, trace->codeSize);
+        trace->code = NULL;
+        trace->codeSize = 0;
+    }
+}
+
+#else
+
+bool jitCompile(VM *vm, ObjFunction *func) {
+    (void)vm;
+    (void)func;
+    return false;
+}
+
+InterpreterResult jitEnter(VM *vm, CallFrame *frame) {
+    (void)vm;
+    (void)frame;
+    return INTERPRETER_RUNTIME_ERR; // Unreachable, nothing is ever compiled
+}
+
+void jitFree(ObjFunction *func) { (void)func; }
+
+bool jitCompileTrace(VM *vm, Trace *trace) {
+    (void)vm;
+    (void)trace;
+    return false;
+}
+
+int jitEnterTrace(VM *vm, CallFrame *frame, Trace *trace) {
+    (void)vm;
+    (void)frame;
+    (void)trace;
+    return -1; // Unreachable, nothing is ever compiled
+}
+
+void jitFreeTrace(Trace *trace) { (void)trace; }
+
+#endif // CLOX_JIT
+
+void jitPrintStats(VM *vm) {
+    JitStats *stats = &vm->jitStats;
+
+    fprintf(stderr, "JIT statistics:\n");
+    fprintf(stderr, "  functions compiled:  %zu\n", stats->functionsCompiled);
+    fprintf(stderr, "  functions rejected:  %zu\n", stats->functionsRejected);
+    fprintf(stderr, "  traces compiled:     %zu\n", stats->tracesCompiled);
+    fprintf(stderr, "  traces aborted:      %zu\n", stats->tracesAborted);
+    fprintf(stderr, "  trace entries:       %zu (%zu failed type checks)\n",
+            stats->traceEntries, stats->traceEntryFailures);
+    fprintf(stderr, "  trace exits:         %" PRIu64 "\n", stats->traceExits);
+    fprintf(stderr, "  compile time:        %.3f ms\n", stats->compileTime * 1000);
+    fprintf(stderr, "  time in traces:      %.3f ms\n", stats->traceTime * 1000);
+}
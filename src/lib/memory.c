@@ -1,15 +1,20 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "chunk.h"
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "regvm.h"
 #include "table.h"
+#include "trace.h"
 #include "value.h"
 
 #ifdef DEBUG_LOG_GC
 #include "debug.h"
-#include <stdio.h>
 #endif // DEBUG_LOG_GC
 
 #define GC_HEAP_GROW_FACTOR 2
@@ -36,6 +41,7 @@ void *reallocate(VM *vm, Compiler *compiler, void *pointer, size_t oldSize,
     void *result = realloc(pointer, newSize);
 
     if (result == NULL) {
+        fprintf(stderr, "Out of memory.\n");
         exit(1);
     }
 
@@ -100,7 +106,8 @@ static void blackenObject(VM *vm, Obj *object) {
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *)object;
             markObject(vm, (Obj *)klass->name);
-            markTable(vm, &klass->methods);
+            markMethodTable(vm, &klass->methods);
+            markObject(vm, (Obj *)klass->initializer);
             break;
         }
         case OBJ_CLOSURE: {
@@ -116,20 +123,46 @@ static void blackenObject(VM *vm, Obj *object) {
         case OBJ_FUNCTION: {
             ObjFunction *func = (ObjFunction *)object;
             markObject(vm, (Obj *)func->name);
+            markObject(vm, (Obj *)func->closure);
             markArray(vm, &func->chunk.constants);
+
+            // Cached classes are kept alive so a new class allocated at the same
+            // address can never be mistaken for a cache hit.
+            for (size_t idx = 0; idx < func->chunk.invokeCacheCount; idx++) {
+                markObject(vm, (Obj *)func->chunk.invokeCaches[idx].klass);
+                markObject(vm, (Obj *)func->chunk.invokeCaches[idx].method);
+            }
+
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
             markObject(vm, (Obj *)instance->klass);
-            markTable(vm, &instance->fields);
+            markObject(vm, (Obj *)instance->shape);
+
+            for (size_t idx = 0; idx < instance->shape->slotCount; idx++) {
+                markValue(vm, instance->fields[idx]);
+            }
+
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            markObject(vm, (Obj *)shape->parent);
+            markObject(vm, (Obj *)shape->name);
+            markTable(vm, &shape->transitions);
             break;
         }
         case OBJ_UPVALUE:
             markValue(vm, ((ObjUpvalue *)object)->closed);
             break;
+        case OBJ_STRING: {
+            ObjString *string = (ObjString *)object;
+            markObject(vm, (Obj *)string->left);
+            markObject(vm, (Obj *)string->right);
+            break;
+        }
         case OBJ_NATIVE:
-        case OBJ_STRING:
             break;
     }
 }
@@ -146,7 +179,7 @@ static void freeObject(VM *vm, Compiler *compiler, Obj *object) {
             break;
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *)object;
-            freeTable(vm, compiler, &klass->methods);
+            freeMethodTable(vm, compiler, &klass->methods);
             FREE(vm, compiler, ObjClass, object);
             break;
         }
@@ -159,14 +192,33 @@ static void freeObject(VM *vm, Compiler *compiler, Obj *object) {
         }
         case OBJ_FUNCTION: {
             ObjFunction *func = (ObjFunction *)object;
+            jitFree(func);
+            freeRegisterCode(vm, compiler, func->registerCode);
+
+            for (size_t idx = 0; idx < func->chunk.loopCacheCount; idx++) {
+                traceFree(vm, compiler, func->chunk.loopCaches[idx].trace);
+            }
+
             freeChunk(vm, compiler, &func->chunk);
             FREE(vm, compiler, ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
-            freeTable(vm, compiler, &instance->fields);
-            FREE(vm, compiler, ObjInstance, object);
+
+            if (instance->fields != instance->inlineFields) {
+                FREE_ARRAY(vm, compiler, Value, instance->fields,
+                           instance->fieldCapacity);
+            }
+
+            reallocate(vm, compiler, object,
+                       sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity, 0);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *)object;
+            freeTable(vm, compiler, &shape->transitions);
+            FREE(vm, compiler, ObjShape, object);
             break;
         }
         case OBJ_NATIVE: {
@@ -175,8 +227,8 @@ static void freeObject(VM *vm, Compiler *compiler, Obj *object) {
         }
         case OBJ_STRING: {
             ObjString *string = (ObjString *)object;
-            FREE_ARRAY(vm, compiler, char, string->chars, string->length + 1);
-            FREE(vm, compiler, ObjString, object);
+            size_t charCount = string->left == NULL ? string->length + 1 : 0;
+            reallocate(vm, compiler, object, sizeof(ObjString) + charCount, 0);
             break;
         }
         case OBJ_UPVALUE: {
@@ -191,6 +243,11 @@ static void markRoots(VM *vm, Compiler *compiler) {
         markValue(vm, *slot);
     }
 
+    // Dead registers may be scanned again once a frame grows over them
+    for (Value *slot = vm->stackTop; slot < vm->stackHigh; slot++) {
+        *slot = NIL_VAL;
+    }
+
     for (size_t idx = 0; idx < vm->frameCount; idx++) {
         markObject(vm, (Obj *)vm->frames[idx].closure);
     }
@@ -200,9 +257,11 @@ static void markRoots(VM *vm, Compiler *compiler) {
         markObject(vm, (Obj *)upvalue);
     }
 
-    markTable(vm, &vm->globals);
+    markTable(vm, &vm->globalNames);
+    markArray(vm, &vm->globalValues);
     markCompilerRoots(vm, compiler);
     markObject(vm, (Obj *)vm->initString);
+    markObject(vm, (Obj *)vm->emptyShape);
 }
 
 static void traceReferences(VM *vm) {
@@ -242,11 +301,33 @@ void collectGarbage(VM *vm, Compiler *compiler) {
     size_t before = vm->bytesAllocated;
 #endif // DEBUG_LOG_GC
 
+    GcStats *stats = &vm->gcStats;
+    size_t live = vm->bytesAllocated;
+    clock_t start = stats->enabled ? clock() : 0;
+
     markRoots(vm, compiler);
     traceReferences(vm);
-    tableRemoveWhite(&vm->strings);
+
+    clock_t marked = stats->enabled ? clock() : 0;
+
+    stringSetRemoveWhite(&vm->strings);
+    if (vm->methodCache != NULL) {
+        memset(vm->methodCache, 0, sizeof(MethodCacheEntry) * METHOD_CACHE_SIZE);
+    }
     sweep(vm, compiler);
 
+    if (stats->enabled) {
+        stats->markTime += (double)(marked - start) / CLOCKS_PER_SEC;
+        stats->sweepTime += (double)(clock() - marked) / CLOCKS_PER_SEC;
+    }
+
+    stats->collections += 1;
+    stats->bytesFreed += live - vm->bytesAllocated;
+
+    if (live > stats->peakBytes) {
+        stats->peakBytes = live;
+    }
+
     vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
@@ -256,6 +337,18 @@ void collectGarbage(VM *vm, Compiler *compiler) {
 #endif // DEBUG_LOG_GC
 }
 
+void printGcStats(VM *vm) {
+    GcStats *stats = &vm->gcStats;
+
+    fprintf(stderr, "GC statistics:\n");
+    fprintf(stderr, "  value size:          %zu bytes\n", sizeof(Value));
+    fprintf(stderr, "  collections:         %zu\n", stats->collections);
+    fprintf(stderr, "  bytes freed:         %zu\n", stats->bytesFreed);
+    fprintf(stderr, "  peak heap:           %zu bytes\n", stats->peakBytes);
+    fprintf(stderr, "  mark time:           %.3f ms\n", stats->markTime * 1000);
+    fprintf(stderr, "  sweep time:          %.3f ms\n", stats->sweepTime * 1000);
+}
+
 void freeObjects(VM *vm, Compiler *compiler) {
     Obj *object = vm->objects;
 
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
@@ -9,6 +10,11 @@
 #include "value.h"
 #include "vm.h"
 
+/**
+ * @brief Most fields new instances of a class are given room for up front
+ */
+#define MAX_PRESIZED_FIELDS 64
+
 #define ALLOCATE_OBJ(vm, compiler, type, objectType)                                     \
     (type *)allocateObject(vm, compiler, sizeof(type), objectType)
 
@@ -27,32 +33,141 @@ static void *allocateObject(VM *vm, Compiler *compiler, size_t size, ObjType typ
     return object;
 }
 
-static ObjString *allocateString(VM *vm, Compiler *compiler, size_t length, char *chars,
-                                 uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(vm, compiler, ObjString, OBJ_STRING);
+/**
+ * @brief Allocates a string with room for `length` characters, which the caller
+ * fills in before interning it
+ */
+static ObjString *allocateString(VM *vm, Compiler *compiler, size_t length) {
+    ObjString *string = (ObjString *)allocateObject(
+        vm, compiler, sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    string->hash = 0;
+    string->selector = 0;
+    string->left = NULL;
+    string->right = NULL;
+    string->offset = 0;
+    string->interned = false;
+    string->chars[length] = '\0';
+    return string;
+}
+
+static void internString(VM *vm, Compiler *compiler, ObjString *string, uint32_t hash) {
     string->hash = hash;
+    string->interned = true;
 
     // Push-pop of value is done so that value is reachable
     // by VM and thus isn't swept if the GC is triggered by
-    // `tableSet'.
+    // `stringSetAdd'.
     push(vm, OBJ_VAL(string));
-    tableSet(vm, compiler, &vm->strings, string, NIL_VAL);
+    stringSetAdd(vm, compiler, &vm->strings, string);
     pop(vm);
+}
 
-    return string;
+/**
+ * @brief Multiplies two 64-bit words into 128 bits, returning the low half in `a`
+ * and the high half in `b`
+ */
+static inline void hashMultiply(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __extension__ unsigned __int128 product = (unsigned __int128)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    uint64_t aHigh = *a >> 32;
+    uint64_t aLow = (uint32_t)*a;
+    uint64_t bHigh = *b >> 32;
+    uint64_t bLow = (uint32_t)*b;
+    uint64_t high = aHigh * bHigh;
+    uint64_t middle1 = aHigh * bLow;
+    uint64_t middle2 = aLow * bHigh;
+    uint64_t low = aLow * bLow;
+    uint64_t carry = ((low >> 32) + (uint32_t)middle1 + (uint32_t)middle2) >> 32;
+
+    *a = low + (middle1 << 32) + (middle2 << 32);
+    *b = high + (middle1 >> 32) + (middle2 >> 32) + carry;
+#endif
 }
 
-static uint32_t hashString(const char *key, size_t length) {
-    uint32_t hash = 2166136261U;
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+    hashMultiply(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t hashRead64(const char *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
 
-    for (size_t i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[0];
-        hash *= 16777619;
+static inline uint64_t hashRead32(const char *p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+/**
+ * @brief Hashes strings a word at a time after wyhash.
+ *
+ * @details Every input word is multiplied by a secret into 128 bits and the halves
+ * folded together, which mixes each byte into every bit of the result. Strings of
+ * up to 16 bytes, which covers most identifiers, are read as at most four
+ * overlapping loads without a loop. Longer strings are consumed 48 bytes at a
+ * time in three independent lanes so the multiplies overlap.
+ */
+static uint32_t hashString(const char *key, size_t length) {
+    static const uint64_t secret[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+                                       0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+    const char *p = key;
+    uint64_t seed = hashMix(secret[0], secret[1]);
+    uint64_t a = 0;
+    uint64_t b = 0;
+
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t middle = (length >> 3) << 2;
+            a = (hashRead32(p) << 32) | hashRead32(p + middle);
+            b = (hashRead32(p + length - 4) << 32) | hashRead32(p + length - 4 - middle);
+        } else if (length > 0) {
+            const uint8_t *bytes = (const uint8_t *)p;
+            a = ((uint64_t)bytes[0] << 16) | ((uint64_t)bytes[length >> 1] << 8) |
+                bytes[length - 1];
+        }
+    } else {
+        size_t left = length;
+
+        if (left > 48) {
+            uint64_t lane1 = seed;
+            uint64_t lane2 = seed;
+
+            do {
+                seed = hashMix(hashRead64(p) ^ secret[1], hashRead64(p + 8) ^ seed);
+                lane1 =
+                    hashMix(hashRead64(p + 16) ^ secret[2], hashRead64(p + 24) ^ lane1);
+                lane2 =
+                    hashMix(hashRead64(p + 32) ^ secret[3], hashRead64(p + 40) ^ lane2);
+                p += 48;
+                left -= 48;
+            } while (left > 48);
+
+            seed ^= lane1 ^ lane2;
+        }
+
+        while (left > 16) {
+            seed = hashMix(hashRead64(p) ^ secret[1], hashRead64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+
+        // The last 16 bytes, overlapping the ones already read
+        a = hashRead64(p + left - 16);
+        b = hashRead64(p + left - 8);
     }
 
-    return hash;
+    a ^= secret[1];
+    b ^= seed;
+    hashMultiply(&a, &b);
+
+    return (uint32_t)hashMix(a ^ secret[0] ^ length, b ^ secret[1]);
 }
 
 ObjBoundMethod *newBoundMethod(VM *vm, Compiler *compiler, Value receiver,
@@ -69,22 +184,99 @@ ObjFunction *newFunction(VM *vm, Compiler *compiler) {
     func->arity = 0;
     func->upvalueCount = 0;
     func->name = NULL;
+    func->calls = 0;
+    func->jitCode = NULL;
+    func->jitSize = 0;
+    func->registerCode = NULL;
+    func->closure = NULL;
+    func->usesCallerFrame = false;
     initChunk(&func->chunk);
 
     return func;
 }
 
 ObjInstance *newInstance(VM *vm, Compiler *compiler, ObjClass *klass) {
-    ObjInstance *instance = ALLOCATE_OBJ(vm, compiler, ObjInstance, OBJ_INSTANCE);
+    uint32_t capacity = klass->fieldCount;
+    ObjInstance *instance = (ObjInstance *)allocateObject(
+        vm, compiler, sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = vm->emptyShape;
+    instance->fieldCapacity = capacity;
+    instance->fields = instance->inlineFields;
+    instance->inlineCapacity = capacity;
     return instance;
 }
 
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value) {
+    uint32_t slot;
+
+    if (!shapeFindSlot(instance->shape, name, &slot)) {
+        return false;
+    }
+
+    *value = instance->fields[slot];
+    return true;
+}
+
+void instanceEnsureSlot(VM *vm, Compiler *compiler, ObjInstance *instance,
+                        uint32_t slot) {
+    if (slot < instance->fieldCapacity) {
+        return;
+    }
+
+    uint32_t oldCapacity = instance->fieldCapacity;
+    uint32_t capacity = GROW_CAPACITY(oldCapacity);
+
+    while (capacity <= slot) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+
+    if (instance->fields == instance->inlineFields) {
+        Value *fields = ALLOCATE(vm, compiler, Value, capacity);
+        memcpy(fields, instance->inlineFields, sizeof(Value) * oldCapacity);
+        instance->fields = fields;
+    } else {
+        instance->fields =
+            GROW_ARRAY(vm, compiler, Value, instance->fields, oldCapacity, capacity);
+    }
+
+    instance->fieldCapacity = capacity;
+
+    // Later instances of the class start out with room for this many fields
+    ObjClass *klass = instance->klass;
+
+    if (slot >= klass->fieldCount && slot < MAX_PRESIZED_FIELDS) {
+        klass->fieldCount = slot + 1;
+    }
+}
+
+void instanceSetField(VM *vm, Compiler *compiler, ObjInstance *instance,
+                      ObjString *name, Value value) {
+    uint32_t slot;
+
+    if (shapeFindSlot(instance->shape, name, &slot)) {
+        instance->fields[slot] = value;
+        return;
+    }
+
+    // Value is pushed so it stays reachable if growing the instance or creating
+    // the new shape triggers the GC.
+    push(vm, value);
+    ObjShape *shape = shapeTransition(vm, compiler, instance->shape, name);
+    instanceEnsureSlot(vm, compiler, instance, shape->slotCount - 1);
+    instance->fields[shape->slotCount - 1] = value;
+    instance->shape = shape;
+    pop(vm);
+}
+
 ObjClass *newClass(VM *vm, Compiler *compiler, ObjString *name) {
     ObjClass *klass = ALLOCATE_OBJ(vm, compiler, ObjClass, OBJ_CLASS);
     klass->name = name;
-    initTable(&klass->methods);
+    klass->version = 0;
+    initMethodTable(&klass->methods);
+    klass->initializer = NULL;
+    klass->initArity = 0;
+    klass->fieldCount = 0;
     return klass;
 }
 
@@ -103,6 +295,47 @@ ObjClosure *newClosure(VM *vm, Compiler *compiler, ObjFunction *func) {
     return closure;
 }
 
+ObjShape *newShape(VM *vm, Compiler *compiler, ObjShape *parent, ObjString *name) {
+    ObjShape *shape = ALLOCATE_OBJ(vm, compiler, ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->slotCount = parent != NULL ? parent->slotCount + 1 : 0;
+    initTable(&shape->transitions);
+    return shape;
+}
+
+ObjShape *shapeTransition(VM *vm, Compiler *compiler, ObjShape *shape, ObjString *name) {
+    Value next;
+
+    if (tableGet(&shape->transitions, name, &next)) {
+        return AS_SHAPE(next);
+    }
+
+    ObjShape *child = newShape(vm, compiler, shape, name);
+
+    // Push-pop of value is done so that value is reachable
+    // by VM and thus isn't swept if the GC is triggered by
+    // `tableSet'.
+    push(vm, OBJ_VAL(child));
+    tableSet(vm, compiler, &shape->transitions, name, OBJ_VAL(child));
+    pop(vm);
+
+    return child;
+}
+
+bool shapeFindSlot(ObjShape *shape, ObjString *name, uint32_t *slot) {
+    // Instances rarely have more than a handful of fields so walking the chain is
+    // cheap, and it is only done when an inline cache misses.
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->name == name) {
+            *slot = shape->slotCount - 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 ObjNative *newNative(VM *vm, Compiler *compiler, NativeFn func, uint8_t arity) {
     ObjNative *native = ALLOCATE_OBJ(vm, compiler, ObjNative, OBJ_NATIVE);
     native->arity = arity;
@@ -110,32 +343,185 @@ ObjNative *newNative(VM *vm, Compiler *compiler, NativeFn func, uint8_t arity) {
     return native;
 }
 
-ObjString *takeString(VM *vm, Compiler *compiler, size_t length, char *chars) {
+ObjString *copyString(VM *vm, Compiler *compiler, size_t length, const char *chars) {
     uint32_t hash = hashString(chars, length);
 
-    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+    ObjString *interned = stringSetFind(&vm->strings, chars, length, hash);
 
     if (interned != NULL) {
-        FREE_ARRAY(vm, compiler, char, chars, length + 1);
         return interned;
     }
 
-    return allocateString(vm, compiler, length, chars, hash);
+    ObjString *string = allocateString(vm, compiler, length);
+    memcpy(string->chars, chars, length);
+    internString(vm, compiler, string, hash);
+    return string;
 }
 
-ObjString *copyString(VM *vm, Compiler *compiler, size_t length, const char *chars) {
-    uint32_t hash = hashString(chars, length);
+ObjString *concatenateStrings(VM *vm, Compiler *compiler, ObjString *a, ObjString *b) {
+    size_t length = a->length + b->length;
+
+    // Short operands are never ropes, so they are copied right away. Longer ones
+    // are only joined once something needs the characters, which keeps building a
+    // string piece by piece linear.
+    if (length < ROPE_MIN_LENGTH) {
+        ObjString *string = allocateString(vm, compiler, length);
+        memcpy(string->chars, stringChars(a), a->length);
+        memcpy(string->chars + a->length, stringChars(b), b->length);
+        return string;
+    }
+
+    ObjString *rope = ALLOCATE_OBJ(vm, compiler, ObjString, OBJ_STRING);
+    rope->length = length;
+    rope->hash = 0;
+    rope->selector = 0;
+    rope->left = a;
+    rope->right = b;
+    rope->offset = 0;
+    rope->interned = false;
+    return rope;
+}
+
+ObjString *newStringView(VM *vm, Compiler *compiler, ObjString *string, size_t start,
+                         size_t length) {
+    if (start == 0 && length == string->length) {
+        return string;
+    }
+
+    // Views of views refer to the string which has the characters
+    if (string->left != NULL) {
+        start += string->offset;
+        string = string->left;
+    }
+
+    ObjString *view = ALLOCATE_OBJ(vm, compiler, ObjString, OBJ_STRING);
+    view->length = length;
+    view->hash = 0;
+    view->selector = 0;
+    view->left = string;
+    view->right = NULL;
+    view->offset = start;
+    view->interned = false;
+    return view;
+}
+
+ObjString *flattenString(VM *vm, Compiler *compiler, ObjString *string) {
+    if (string->right == NULL) {
+        return string;
+    }
+
+    ObjString *flat = allocateString(vm, compiler, string->length);
+
+    // Growing the pending stack may run the GC, which has to keep the copy alive
+    push(vm, OBJ_VAL(flat));
+
+    // Halves are copied from the end backwards. Ropes built by appending in a loop
+    // lean left, so keeping left halves pending keeps the stack short for them.
+    ObjString *inlinePending[32];
+    ObjString **pending = inlinePending;
+    size_t pendingCapacity = sizeof(inlinePending) / sizeof(inlinePending[0]);
+    size_t pendingCount = 0;
+    size_t end = string->length;
+    ObjString *piece = string;
+
+    for (;;) {
+        if (piece->right != NULL) {
+            if (pendingCount == pendingCapacity) {
+                size_t capacity = GROW_CAPACITY(pendingCapacity);
+
+                if (pending == inlinePending) {
+                    pending = ALLOCATE(vm, compiler, ObjString *, capacity);
+                    memcpy((void *)pending, inlinePending, sizeof(inlinePending));
+                } else {
+                    pending = GROW_ARRAY(vm, compiler, ObjString *, pending,
+                                         pendingCapacity, capacity);
+                }
+
+                pendingCapacity = capacity;
+            }
+
+            pending[pendingCount++] = piece->left;
+            piece = piece->right;
+            continue;
+        }
+
+        end -= piece->length;
+        memcpy(flat->chars + end, stringChars(piece), piece->length);
+
+        if (pendingCount == 0) {
+            break;
+        }
+
+        piece = pending[--pendingCount];
+    }
+
+    if (pending != inlinePending) {
+        FREE_ARRAY(vm, compiler, ObjString *, pending, pendingCapacity);
+    }
+
+    pop(vm);
+    string->left = flat;
+    string->right = NULL;
+    return flat;
+}
 
-    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+ObjString *internRuntimeString(VM *vm, Compiler *compiler, ObjString *string) {
+    if (string->interned) {
+        return string;
+    }
+
+    const char *chars = stringChars(string);
+
+    if (string->hash == 0) {
+        string->hash = hashString(chars, string->length);
+    }
+
+    ObjString *interned =
+        stringSetFind(&vm->strings, chars, string->length, string->hash);
 
     if (interned != NULL) {
         return interned;
     }
 
-    char *heapChars = ALLOCATE(vm, compiler, char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(vm, compiler, length, heapChars, hash);
+    // The set compares its keys' own characters, so views can't be added to it
+    if (string->left == NULL) {
+        internString(vm, compiler, string, string->hash);
+    }
+
+    return string;
+}
+
+bool stringsEqual(ObjString *a, ObjString *b) {
+    if (a->right != NULL || b->right != NULL || a->length != b->length ||
+        (a->interned && b->interned)) {
+        return false;
+    }
+
+    const char *aChars = stringChars(a);
+    const char *bChars = stringChars(b);
+
+    // Views of the same characters, such as a joined rope and its joined string
+    if (aChars == bChars) {
+        return true;
+    }
+
+    if (a->hash == 0) {
+        a->hash = hashString(aChars, a->length);
+    }
+
+    if (b->hash == 0) {
+        b->hash = hashString(bChars, b->length);
+    }
+
+    return a->hash == b->hash && memcmp(aChars, bChars, a->length) == 0;
+}
+
+uint32_t stringSelector(VM *vm, ObjString *name) {
+    if (name->selector == 0) {
+        name->selector = ++vm->selectorCount;
+    }
+
+    return name->selector;
 }
 
 ObjUpvalue *newUpvalue(VM *vm, Compiler *compiler, Value *slot) {
@@ -143,6 +529,7 @@ ObjUpvalue *newUpvalue(VM *vm, Compiler *compiler, Value *slot) {
     upvalue->location = slot;
     upvalue->closed = NIL_VAL;
     upvalue->next = NULL;
+    upvalue->prev = NULL;
     return upvalue;
 }
 
@@ -155,6 +542,19 @@ static void printFunction(ObjFunction *func) {
     printf("<fn %s>", func->name->chars);
 }
 
+/**
+ * @brief Prints the characters of a string. The VM flattens the ropes it prints,
+ * others only show up in debug output.
+ */
+static void printString(ObjString *string) {
+    if (string->right != NULL) {
+        printString(string->left);
+        printString(string->right);
+    } else {
+        fwrite(stringChars(string), sizeof(char), string->length, stdout);
+    }
+}
+
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
@@ -175,8 +575,11 @@ void printObject(Value value) {
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            printString(AS_STRING(value));
             break;
         case OBJ_UPVALUE:
             printf("upvalue");
@@ -0,0 +1,727 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+#include "value.h"
+#include "vm.h"
+
+/**
+ * @brief Passes are repeated until nothing changes, or this many times
+ */
+#define MAX_ROUNDS 8
+
+/**
+ * @brief Longest jump chain followed when threading jumps
+ */
+#define MAX_THREAD_HOPS 16
+
+/**
+ * @brief Longest instruction kept in `bytes`, only OP_CLOSURE is ever longer
+ */
+#define MAX_INLINE_LENGTH 5
+
+/**
+ * @brief Decoded instruction.
+ *
+ * @details Jumps refer to their target by instruction index. A jump to a removed
+ * instruction goes to the next instruction still in the chunk, so removing a
+ * sequence which has no effect keeps jumps to its start working.
+ */
+typedef struct {
+    size_t offset; //< Offset in the original code
+    size_t length;
+    size_t line;
+    uint8_t bytes[MAX_INLINE_LENGTH];
+
+    size_t target;
+    bool isTarget;
+    bool removed;
+} Instruction;
+
+typedef struct {
+    VM *vm;
+    Compiler *compiler;
+    Chunk *chunk;
+
+    size_t count;
+    Instruction *code;
+    bool changed;
+} Optimizer;
+
+static bool isJump(OpCode op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_FALSE ||
+           op == OP_LOOP;
+}
+
+static OpCode opAt(Optimizer *opt, size_t idx) {
+    return (OpCode)opt->code[idx].bytes[0];
+}
+
+static uint16_t shortAt(Optimizer *opt, size_t idx) {
+    return (uint16_t)((opt->code[idx].bytes[1] << 8) | opt->code[idx].bytes[2]);
+}
+
+/**
+ * @brief Index of the first instruction from `idx` on which has not been removed
+ */
+static size_t live(Optimizer *opt, size_t idx) {
+    while (idx < opt->count && opt->code[idx].removed) {
+        idx++;
+    }
+
+    return idx;
+}
+
+static size_t next(Optimizer *opt, size_t idx) { return live(opt, idx + 1); }
+
+static void removeInstruction(Optimizer *opt, size_t idx) {
+    opt->code[idx].removed = true;
+    opt->changed = true;
+}
+
+/**
+ * @brief Turns an instruction into a different one, keeping its line
+ */
+static void rewrite(Optimizer *opt, size_t idx, OpCode op, uint8_t operand) {
+    Instruction *ins = &opt->code[idx];
+    ins->bytes[0] = op;
+    ins->bytes[1] = operand;
+    ins->length = op == OP_CONSTANT ? 2 : 1;
+    opt->changed = true;
+}
+
+static void decode(Optimizer *opt) {
+    Chunk *chunk = opt->chunk;
+    size_t *indices = ALLOCATE(opt->vm, opt->compiler, size_t, chunk->count + 1);
+
+    opt->count = 0;
+
+    for (size_t offset = 0; offset < chunk->count; opt->count++) {
+        indices[offset] = opt->count;
+        offset += instructionLength(chunk, offset);
+    }
+
+    opt->code = ALLOCATE(opt->vm, opt->compiler, Instruction, opt->count);
+
+    for (size_t idx = 0, offset = 0; idx < opt->count; idx++) {
+        Instruction *ins = &opt->code[idx];
+        ins->offset = offset;
+        ins->length = instructionLength(chunk, offset);
+        ins->line = chunk->lines[offset];
+        ins->target = 0;
+        ins->isTarget = false;
+        ins->removed = false;
+
+        size_t copied = ins->length < MAX_INLINE_LENGTH ? ins->length : MAX_INLINE_LENGTH;
+        memset(ins->bytes, 0, sizeof(ins->bytes));
+        memcpy(ins->bytes, chunk->code + offset, copied);
+
+        if (isJump(opAt(opt, idx))) {
+            uint16_t jump = shortAt(opt, idx);
+            ins->target = opAt(opt, idx) == OP_LOOP ? indices[offset + 5 - jump]
+                                                     : indices[offset + 3 + jump];
+        }
+
+        offset += ins->length;
+    }
+
+    FREE_ARRAY(opt->vm, opt->compiler, size_t, indices, chunk->count + 1);
+}
+
+static void findTargets(Optimizer *opt) {
+    for (size_t idx = 0; idx < opt->count; idx++) {
+        opt->code[idx].isTarget = false;
+    }
+
+    for (size_t idx = live(opt, 0); idx < opt->count; idx = next(opt, idx)) {
+        if (isJump(opAt(opt, idx))) {
+            size_t target = live(opt, opt->code[idx].target);
+
+            if (target < opt->count) {
+                opt->code[target].isTarget = true;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Index of a number constant in the chunk, adding it if needed
+ *
+ * @returns false if the constant doesn't fit in OP_CONSTANT's operand
+ */
+static bool numberConstant(Optimizer *opt, Value value, uint8_t *index) {
+    ValueArray *constants = &opt->chunk->constants;
+
+    for (size_t idx = 0; idx < constants->count && idx <= UINT8_MAX; idx++) {
+        Value other = constants->values[idx];
+
+        // Compared bitwise, NaN and -0 must stay what they are and integers must not
+        // become doubles
+        if (IS_NUMBER(other) && memcmp(&other, &value, sizeof(Value)) == 0) {
+            *index = (uint8_t)idx;
+            return true;
+        }
+    }
+
+    if (constants->count > UINT8_MAX) {
+        return false;
+    }
+
+    *index = (uint8_t)addConstant(opt->vm, opt->compiler, opt->chunk, value);
+    return true;
+}
+
+static bool isNumberConstant(Optimizer *opt, size_t idx) {
+    return idx < opt->count && opAt(opt, idx) == OP_CONSTANT &&
+           IS_NUMBER(opt->chunk->constants.values[opt->code[idx].bytes[1]]);
+}
+
+static Value numberAt(Optimizer *opt, size_t idx) {
+    return opt->chunk->constants.values[opt->code[idx].bytes[1]];
+}
+
+/**
+ * @brief Matches constants whose truthiness is known, numbers are always truthy
+ */
+static bool isKnownTruth(Optimizer *opt, size_t idx) {
+    OpCode op = opAt(opt, idx);
+    return op == OP_TRUE || op == OP_FALSE || op == OP_NIL || isNumberConstant(opt, idx);
+}
+
+/**
+ * @brief Replaces an instruction with a number constant
+ *
+ * @returns false if the constant table is full
+ */
+static bool foldNumber(Optimizer *opt, size_t idx, Value number) {
+    uint8_t constant;
+
+    if (!numberConstant(opt, number, &constant)) {
+        return false;
+    }
+
+    rewrite(opt, idx, OP_CONSTANT, constant);
+    return true;
+}
+
+static bool foldBool(Optimizer *opt, size_t idx, bool flag) {
+    rewrite(opt, idx, flag ? OP_TRUE : OP_FALSE, 0);
+    return true;
+}
+
+/**
+ * @brief Evaluates operators applied to constants at compile time
+ */
+static void foldConstants(Optimizer *opt) {
+    for (size_t idx = live(opt, 0); idx < opt->count; idx = next(opt, idx)) {
+        size_t second = next(opt, idx);
+
+        if (second == opt->count || opt->code[second].isTarget) {
+            continue;
+        }
+
+        OpCode op = opAt(opt, idx);
+        OpCode secondOp = opAt(opt, second);
+
+        // Unary operators
+        if (secondOp == OP_NOT && isKnownTruth(opt, idx)) {
+            foldBool(opt, idx, op == OP_FALSE || op == OP_NIL);
+            removeInstruction(opt, second);
+            continue;
+        }
+
+        // Branches on constants, a falsey constant always jumps
+        if (secondOp == OP_JUMP_IF_FALSE && isKnownTruth(opt, idx)) {
+            if (op == OP_FALSE || op == OP_NIL) {
+                opt->code[second].bytes[0] = OP_JUMP;
+                opt->changed = true;
+            } else {
+                removeInstruction(opt, second);
+            }
+
+            continue;
+        }
+
+        if (secondOp == OP_NEGATE && isNumberConstant(opt, idx)) {
+            Value value = numberAt(opt, idx);
+            Value negated = IS_INT(value) ? intNegate(AS_INT(value))
+                                          : NUMBER_VAL(-AS_NUMBER(value));
+
+            if (foldNumber(opt, idx, negated)) {
+                removeInstruction(opt, second);
+            }
+
+            continue;
+        }
+
+        // Binary operators on numbers
+        size_t third = next(opt, second);
+
+        if (third == opt->count || opt->code[third].isTarget ||
+            !isNumberConstant(opt, idx) || !isNumberConstant(opt, second)) {
+            continue;
+        }
+
+        Value left = numberAt(opt, idx);
+        Value right = numberAt(opt, second);
+        bool ints = IS_INT(left) && IS_INT(right);
+        double a = AS_NUMBER(left);
+        double b = AS_NUMBER(right);
+        bool folded;
+
+        // Integer operands fold the way the VM computes them
+        switch (opAt(opt, third)) {
+            case OP_ADD:
+                folded = foldNumber(opt, idx,
+                                    ints ? intAdd(AS_INT(left), AS_INT(right))
+                                         : NUMBER_VAL(a + b));
+                break;
+            case OP_SUBTRACT:
+                folded = foldNumber(opt, idx,
+                                    ints ? intSubtract(AS_INT(left), AS_INT(right))
+                                         : NUMBER_VAL(a - b));
+                break;
+            case OP_MULTIPLY:
+                folded = foldNumber(opt, idx,
+                                    ints ? intMultiply(AS_INT(left), AS_INT(right))
+                                         : NUMBER_VAL(a * b));
+                break;
+            case OP_DIVIDE:
+                folded = foldNumber(opt, idx,
+                                    ints ? intDivide(AS_INT(left), AS_INT(right))
+                                         : NUMBER_VAL(a / b));
+                break;
+            case OP_EQUAL:
+                folded = foldBool(opt, idx, a == b);
+                break;
+            case OP_NOT_EQUAL:
+                folded = foldBool(opt, idx, !(a == b));
+                break;
+            case OP_GREATER:
+                folded = foldBool(opt, idx, a > b);
+                break;
+            case OP_GREATER_EQUAL:
+                folded = foldBool(opt, idx, !(a < b));
+                break;
+            case OP_LESS:
+                folded = foldBool(opt, idx, a < b);
+                break;
+            case OP_LESS_EQUAL:
+                folded = foldBool(opt, idx, !(a > b));
+                break;
+            default:
+                folded = false;
+                break;
+        }
+
+        if (folded) {
+            removeInstruction(opt, second);
+            removeInstruction(opt, third);
+        }
+    }
+}
+
+/**
+ * @brief Fuses comparisons followed by OP_NOT into the negated comparison
+ */
+static void fuseComparisons(Optimizer *opt) {
+    for (size_t idx = live(opt, 0); idx < opt->count; idx = next(opt, idx)) {
+        size_t second = next(opt, idx);
+
+        if (second == opt->count || opt->code[second].isTarget ||
+            opAt(opt, second) != OP_NOT) {
+            continue;
+        }
+
+        switch (opAt(opt, idx)) {
+            case OP_EQUAL:
+                rewrite(opt, idx, OP_NOT_EQUAL, 0);
+                break;
+            case OP_GREATER:
+                rewrite(opt, idx, OP_LESS_EQUAL, 0);
+                break;
+            case OP_LESS:
+                rewrite(opt, idx, OP_GREATER_EQUAL, 0);
+                break;
+            default:
+                continue;
+        }
+
+        removeInstruction(opt, second);
+    }
+}
+
+/**
+ * @brief Instructions which only push a value and can't fail
+ */
+static bool isPurePush(OpCode op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_ENCLOSING:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Matches a store followed by a load of the same variable
+ */
+static bool isReload(Optimizer *opt, size_t store, size_t load) {
+    OpCode loadOp;
+
+    switch (opAt(opt, store)) {
+        case OP_SET_LOCAL:
+            loadOp = OP_GET_LOCAL;
+            break;
+        case OP_SET_UPVALUE:
+            loadOp = OP_GET_UPVALUE;
+            break;
+        case OP_SET_ENCLOSING:
+            loadOp = OP_GET_ENCLOSING;
+            break;
+        case OP_SET_GLOBAL:
+            loadOp = OP_GET_GLOBAL;
+            break;
+        default:
+            return false;
+    }
+
+    Instruction *a = &opt->code[store];
+    Instruction *b = &opt->code[load];
+    return opAt(opt, load) == loadOp &&
+           memcmp(a->bytes + 1, b->bytes + 1, a->length - 1) == 0;
+}
+
+/**
+ * @brief Removes values pushed only to be popped, reloads of a variable just
+ * stored, which is still on the stack, and jumps to the next instruction.
+ */
+static void removeRedundant(Optimizer *opt) {
+    for (size_t idx = live(opt, 0); idx < opt->count; idx = next(opt, idx)) {
+        size_t second = next(opt, idx);
+
+        if (opAt(opt, idx) == OP_JUMP && live(opt, opt->code[idx].target) == second) {
+            removeInstruction(opt, idx);
+            continue;
+        }
+
+        if (second == opt->count || opt->code[second].isTarget ||
+            opAt(opt, second) != OP_POP) {
+            continue;
+        }
+
+        if (isPurePush(opAt(opt, idx))) {
+            removeInstruction(opt, idx);
+            removeInstruction(opt, second);
+            continue;
+        }
+
+        size_t third = next(opt, second);
+
+        if (third < opt->count && !opt->code[third].isTarget &&
+            isReload(opt, idx, third)) {
+            removeInstruction(opt, second);
+            removeInstruction(opt, third);
+        }
+    }
+}
+
+/**
+ * @brief Points jumps landing on another jump at that jump's destination
+ */
+static void threadJumps(Optimizer *opt) {
+    for (size_t idx = live(opt, 0); idx < opt->count; idx = next(opt, idx)) {
+        OpCode op = opAt(opt, idx);
+
+        if (op != OP_JUMP && op != OP_JUMP_IF_FALSE) {
+            continue;
+        }
+
+        Instruction *jump = &opt->code[idx];
+
+        for (size_t hop = 0; hop < MAX_THREAD_HOPS; hop++) {
+            size_t target = live(opt, jump->target);
+
+            if (target == opt->count || target == idx) {
+                break;
+            }
+
+            OpCode targetOp = opAt(opt, target);
+
+            // A falsey value jumped on stays on the stack, so a conditional jump
+            // landing on another jumps again
+            if (targetOp != OP_JUMP && (op != OP_JUMP_IF_FALSE || targetOp != op)) {
+                break;
+            }
+
+            if (opt->code[target].target == jump->target) {
+                break;
+            }
+
+            jump->target = opt->code[target].target;
+            opt->changed = true;
+        }
+    }
+}
+
+/**
+ * @brief Removes instructions no path from the start of the chunk reaches
+ */
+static void removeUnreachable(Optimizer *opt) {
+    bool *reached = ALLOCATE(opt->vm, opt->compiler, bool, opt->count);
+    size_t *worklist = ALLOCATE(opt->vm, opt->compiler, size_t, opt->count);
+    size_t pending = 0;
+
+    for (size_t idx = 0; idx < opt->count; idx++) {
+        reached[idx] = false;
+    }
+
+    size_t start = live(opt, 0);
+
+    if (start < opt->count) {
+        reached[start] = true;
+        worklist[pending++] = start;
+    }
+
+    while (pending > 0) {
+        size_t idx = worklist[--pending];
+        OpCode op = opAt(opt, idx);
+        size_t successors[2];
+        size_t successorCount = 0;
+
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN) {
+            successors[successorCount++] = next(opt, idx);
+        }
+
+        if (isJump(op)) {
+            successors[successorCount++] = live(opt, opt->code[idx].target);
+        }
+
+        for (size_t succ = 0; succ < successorCount; succ++) {
+            size_t target = successors[succ];
+
+            if (target < opt->count && !reached[target]) {
+                reached[target] = true;
+                worklist[pending++] = target;
+            }
+        }
+    }
+
+    for (size_t idx = live(opt, 0); idx < opt->count; idx = next(opt, idx)) {
+        if (!reached[idx]) {
+            removeInstruction(opt, idx);
+        }
+    }
+
+    FREE_ARRAY(opt->vm, opt->compiler, bool, reached, opt->count);
+    FREE_ARRAY(opt->vm, opt->compiler, size_t, worklist, opt->count);
+}
+
+/**
+ * @brief Merges an instruction with the one after it into superinstruction `op`,
+ * whose operands are those of the first followed by those of the second.
+ */
+static void fuse(Optimizer *opt, size_t first, size_t second, OpCode op) {
+    Instruction *a = &opt->code[first];
+    Instruction *b = &opt->code[second];
+
+    a->bytes[0] = op;
+    memcpy(a->bytes + a->length, b->bytes + 1, b->length - 1);
+    a->length += b->length - 1;
+    removeInstruction(opt, second);
+}
+
+/**
+ * @brief Superinstruction for a pair of instructions, or OP_RETURN if none
+ *
+ * @details The pairs are the most frequent ones in the benchmarks, each executed
+ * as one dispatch instead of two.
+ */
+static OpCode superinstruction(OpCode first, OpCode second) {
+    switch (first) {
+        case OP_GET_LOCAL:
+            switch (second) {
+                case OP_CONSTANT:
+                    return OP_GET_LOCAL_CONSTANT;
+                case OP_GET_LOCAL:
+                    return OP_GET_LOCAL_GET_LOCAL;
+                case OP_GET_PROPERTY:
+                    return OP_GET_LOCAL_PROPERTY;
+                default:
+                    return OP_RETURN;
+            }
+        case OP_SET_LOCAL:
+            return second == OP_POP ? OP_SET_LOCAL_POP : OP_RETURN;
+        case OP_SET_GLOBAL:
+            return second == OP_POP ? OP_SET_GLOBAL_POP : OP_RETURN;
+        default:
+            return OP_RETURN;
+    }
+}
+
+/**
+ * @brief Fuses frequent instruction pairs into superinstructions.
+ *
+ * @details A conditional jump is followed by OP_POP on the path falling through and
+ * usually lands on one as well. Both pops are folded into OP_POP_JUMP_IF_FALSE,
+ * which then jumps past the one it landed on.
+ */
+static void fuseInstructions(Optimizer *opt) {
+    for (size_t idx = live(opt, 0); idx < opt->count; idx = next(opt, idx)) {
+        size_t second = next(opt, idx);
+
+        if (second == opt->count || opt->code[second].isTarget) {
+            continue;
+        }
+
+        OpCode op = opAt(opt, idx);
+
+        if (op == OP_JUMP_IF_FALSE) {
+            size_t target = live(opt, opt->code[idx].target);
+
+            if (opAt(opt, second) == OP_POP && target < opt->count &&
+                opAt(opt, target) == OP_POP) {
+                opt->code[idx].target = next(opt, target);
+                fuse(opt, idx, second, OP_POP_JUMP_IF_FALSE);
+
+                if (opt->code[idx].target < opt->count) {
+                    opt->code[opt->code[idx].target].isTarget = true;
+                }
+            }
+
+            continue;
+        }
+
+        OpCode fused = superinstruction(op, opAt(opt, second));
+        size_t third = next(opt, second);
+
+        // Two local loads are the least frequent pair, leave the second one to be
+        // fused with what follows it instead
+        if (fused == OP_GET_LOCAL_GET_LOCAL && third < opt->count &&
+            !opt->code[third].isTarget &&
+            superinstruction(opAt(opt, second), opAt(opt, third)) != OP_RETURN) {
+            continue;
+        }
+
+        if (fused != OP_RETURN) {
+            fuse(opt, idx, second, fused);
+        }
+    }
+}
+
+/**
+ * @brief Writes the remaining instructions back into the chunk
+ *
+ * @returns false, leaving the chunk untouched, if a jump no longer fits its operand
+ */
+static bool encode(Optimizer *opt) {
+    Chunk *chunk = opt->chunk;
+    size_t *offsets = ALLOCATE(opt->vm, opt->compiler, size_t, opt->count + 1);
+    size_t count = 0;
+
+    for (size_t idx = 0; idx < opt->count; idx++) {
+        offsets[idx] = count;
+        count += opt->code[idx].removed ? 0 : opt->code[idx].length;
+    }
+
+    offsets[opt->count] = count;
+
+    bool fits = true;
+
+    for (size_t idx = live(opt, 0); idx < opt->count; idx = next(opt, idx)) {
+        Instruction *ins = &opt->code[idx];
+
+        if (!isJump(opAt(opt, idx))) {
+            continue;
+        }
+
+        // Removed instructions share the offset of the next one still there
+        size_t target = offsets[ins->target];
+        intmax_t jump = opAt(opt, idx) == OP_LOOP
+                            ? (intmax_t)(offsets[idx] + 5) - (intmax_t)target
+                            : (intmax_t)target - (intmax_t)(offsets[idx] + 3);
+
+        if (jump < 0 || jump > UINT16_MAX) {
+            fits = false;
+            break;
+        }
+
+        ins->bytes[1] = (uint8_t)((jump >> 8) & 0xff);
+        ins->bytes[2] = (uint8_t)(jump & 0xff);
+    }
+
+    if (fits) {
+        // Instructions only ever move towards the start, so the chunk can be
+        // rewritten in place
+        for (size_t idx = live(opt, 0); idx < opt->count; idx = next(opt, idx)) {
+            Instruction *ins = &opt->code[idx];
+            size_t offset = offsets[idx];
+
+            if (ins->length > MAX_INLINE_LENGTH) {
+                memmove(chunk->code + offset, chunk->code + ins->offset, ins->length);
+            } else {
+                memcpy(chunk->code + offset, ins->bytes, ins->length);
+            }
+
+            for (size_t byte = 0; byte < ins->length; byte++) {
+                chunk->lines[offset + byte] = ins->line;
+            }
+        }
+
+        chunk->count = count;
+    }
+
+    FREE_ARRAY(opt->vm, opt->compiler, size_t, offsets, opt->count + 1);
+    return fits;
+}
+
+void optimizeChunk(VM *vm, Compiler *compiler, Chunk *chunk, uint8_t level) {
+    if (level == 0 || chunk->count == 0) {
+        return;
+    }
+
+    Optimizer opt;
+    opt.vm = vm;
+    opt.compiler = compiler;
+    opt.chunk = chunk;
+    decode(&opt);
+
+    for (size_t round = 0; round < MAX_ROUNDS; round++) {
+        opt.changed = false;
+
+        findTargets(&opt);
+        foldConstants(&opt);
+        findTargets(&opt);
+        fuseComparisons(&opt);
+        findTargets(&opt);
+        removeRedundant(&opt);
+
+        if (level >= 2) {
+            threadJumps(&opt);
+            removeUnreachable(&opt);
+        }
+
+        if (!opt.changed) {
+            break;
+        }
+    }
+
+    if (level >= 2) {
+        findTargets(&opt);
+        fuseInstructions(&opt);
+        removeUnreachable(&opt);
+    }
+
+    encode(&opt);
+    FREE_ARRAY(vm, compiler, Instruction, opt.code, opt.count);
+}
@@ -0,0 +1,677 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "regvm.h"
+#include "value.h"
+#include "vm.h"
+
+/**
+ * @brief Marks stack code offsets which are not the start of an instruction reached
+ * so far, and the absence of a pending write
+ */
+#define NONE SIZE_MAX
+
+/**
+ * @brief Where the value of a stack slot is while translating.
+ *
+ * @details Copies of locals and constants are only made once something needs them
+ * in the slot itself, eg. a call or a jump. Until then instructions read the local
+ * or constant directly. A pending copy always refers to a register which already
+ * holds its own value.
+ */
+typedef enum {
+    OPERAND_REGISTER, //< In the slot's own register
+    OPERAND_LOCAL,    //< Same as register `index`, not copied yet
+    OPERAND_CONSTANT, //< Constant `index`, not loaded yet
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    uint8_t index;
+} Operand;
+
+/**
+ * @brief Jump to a stack code offset which has not been translated yet
+ */
+typedef struct {
+    size_t word;
+    size_t target;
+    bool isData; //< The offset is the whole word rather than its sBx operand
+} Fixup;
+
+typedef struct {
+    VM *vm;
+    Compiler *compiler;
+    ObjFunction *func;
+    Chunk *chunk;
+
+    RegisterCode *result;
+    size_t capacity;
+    size_t line;
+    bool failed;
+
+    size_t depth;
+    Operand stack[REG_MAX_REGISTERS];
+
+    size_t *labels;  //< Register code index of each stack code offset
+    size_t *depths;  //< Stack depth on arrival at each jump target
+    bool *isTarget;
+    Fixup *fixups;
+    size_t fixupCount;
+
+    size_t lastWrite; //< Last instruction if it wrote the top of the stack
+} Translator;
+
+static size_t emit(Translator *t, RegInstruction ins) {
+    RegisterCode *result = t->result;
+
+    if (t->capacity < result->count + 1) {
+        size_t oldCapacity = t->capacity;
+        t->capacity = GROW_CAPACITY(oldCapacity);
+        result->code = GROW_ARRAY(t->vm, t->compiler, RegInstruction, result->code,
+                                  oldCapacity, t->capacity);
+        result->lines = GROW_ARRAY(t->vm, t->compiler, size_t, result->lines,
+                                   oldCapacity, t->capacity);
+    }
+
+    result->code[result->count] = ins;
+    result->lines[result->count] = t->line;
+    t->lastWrite = NONE;
+    return result->count++;
+}
+
+static void pushOperand(Translator *t, OperandKind kind, uint8_t index) {
+    if (t->depth == REG_MAX_REGISTERS) {
+        t->failed = true;
+        return;
+    }
+
+    t->stack[t->depth].kind = kind;
+    t->stack[t->depth].index = index;
+    t->depth += 1;
+
+    if (t->depth > t->result->frameSize) {
+        t->result->frameSize = t->depth;
+    }
+}
+
+/**
+ * @brief Pushes the value written to the top slot by instruction `ins`
+ */
+static void pushResult(Translator *t, size_t ins) {
+    pushOperand(t, OPERAND_REGISTER, (uint8_t)t->depth);
+    t->lastWrite = ins;
+}
+
+/**
+ * @brief Makes the copy of the local or constant in slot `slot`
+ */
+static void materialize(Translator *t, size_t slot) {
+    Operand *operand = &t->stack[slot];
+
+    if (operand->kind == OPERAND_LOCAL) {
+        emit(t, REG_ENCODE(REG_MOVE, slot, operand->index, 0));
+    } else if (operand->kind == OPERAND_CONSTANT) {
+        emit(t, REG_ENCODE_BX(REG_LOAD_CONSTANT, slot, operand->index));
+    }
+
+    operand->kind = OPERAND_REGISTER;
+    operand->index = (uint8_t)slot;
+}
+
+/**
+ * @brief Materializes every slot, as calls and jumps expect
+ */
+static void materializeAll(Translator *t) {
+    for (size_t slot = 0; slot < t->depth; slot++) {
+        materialize(t, slot);
+    }
+}
+
+/**
+ * @brief Materializes pending copies of `reg` before it is overwritten
+ */
+static void materializeCopies(Translator *t, uint8_t reg) {
+    for (size_t slot = 0; slot < t->depth; slot++) {
+        if (t->stack[slot].kind == OPERAND_LOCAL && t->stack[slot].index == reg) {
+            materialize(t, slot);
+        }
+    }
+}
+
+/**
+ * @brief Register holding the value of `slot`, loading it first if it is a constant
+ */
+static uint8_t registerOf(Translator *t, size_t slot) {
+    if (t->stack[slot].kind == OPERAND_CONSTANT) {
+        materialize(t, slot);
+    }
+
+    return t->stack[slot].index;
+}
+
+static uint8_t popRegister(Translator *t) {
+    uint8_t reg = registerOf(t, t->depth - 1);
+    t->depth -= 1;
+    return reg;
+}
+
+/**
+ * @brief Offset from the word after `word` to the translation of `target`, which
+ * must already exist
+ */
+static intmax_t jumpOffset(Translator *t, size_t word, size_t target) {
+    return (intmax_t)t->labels[target] - (intmax_t)(word + 1);
+}
+
+/**
+ * @brief Points the jump in `word` at stack code offset `target`, or records it to
+ * be patched once the target has been translated
+ */
+static void setJumpTarget(Translator *t, size_t word, size_t target, bool isData) {
+    if (t->labels[target] == NONE) {
+        t->depths[target] = t->depth;
+        t->fixups[t->fixupCount].word = word;
+        t->fixups[t->fixupCount].target = target;
+        t->fixups[t->fixupCount].isData = isData;
+        t->fixupCount += 1;
+        return;
+    }
+
+    intmax_t jump = jumpOffset(t, word, target);
+
+    if (isData) {
+        t->result->code[word] = (RegInstruction)(int32_t)jump;
+    } else if (jump < -REG_SBX_BIAS || jump > UINT16_MAX - REG_SBX_BIAS) {
+        t->failed = true;
+    } else {
+        t->result->code[word] |= (RegInstruction)(jump + REG_SBX_BIAS) << 16;
+    }
+}
+
+static void emitJump(Translator *t, RegOpCode op, uint8_t reg, size_t target) {
+    materializeAll(t);
+    setJumpTarget(t, emit(t, REG_ENCODE(op, reg, 0, 0)), target, false);
+}
+
+static void getLocal(Translator *t, uint8_t slot) {
+    Operand operand = t->stack[slot];
+
+    if (operand.kind == OPERAND_REGISTER) {
+        pushOperand(t, OPERAND_LOCAL, slot);
+    } else {
+        pushOperand(t, operand.kind, operand.index);
+    }
+}
+
+/**
+ * @brief Stores the top of the stack in local `slot`, popping it unless `keep`
+ */
+static void setLocal(Translator *t, uint8_t slot, bool keep) {
+    Operand *top = &t->stack[t->depth - 1];
+
+    if (top->kind == OPERAND_LOCAL && top->index == slot) {
+        t->depth -= keep ? 0 : 1;
+        return;
+    }
+
+    size_t lastWrite = t->lastWrite;
+    materializeCopies(t, slot);
+
+    if (top->kind == OPERAND_CONSTANT) {
+        emit(t, REG_ENCODE_BX(REG_LOAD_CONSTANT, slot, top->index));
+    } else if (top->kind == OPERAND_LOCAL) {
+        emit(t, REG_ENCODE(REG_MOVE, slot, top->index, 0));
+    } else if (lastWrite != NONE && lastWrite == t->lastWrite &&
+               REG_A(t->result->code[lastWrite]) == t->depth - 1) {
+        // The value was just computed into the top slot, compute it into the local
+        // instead
+        RegInstruction *ins = &t->result->code[lastWrite];
+        *ins = (*ins & ~(RegInstruction)0xff00) | (RegInstruction)slot << 8;
+        top->kind = OPERAND_LOCAL;
+        top->index = slot;
+    } else {
+        emit(t, REG_ENCODE(REG_MOVE, slot, t->depth - 1, 0));
+    }
+
+    t->stack[slot].kind = OPERAND_REGISTER;
+    t->stack[slot].index = slot;
+    t->depth -= keep ? 0 : 1;
+}
+
+/**
+ * @brief Emits an instruction writing `R(A) = R(B) op C` with the two operands on top
+ * of the stack. A constant second operand is used directly if `constantOp` is given.
+ */
+static void binary(Translator *t, RegOpCode op, RegOpCode constantOp) {
+    Operand second = t->stack[t->depth - 1];
+    uint8_t c;
+
+    if (second.kind == OPERAND_CONSTANT && constantOp != op) {
+        op = constantOp;
+        c = second.index;
+    } else {
+        c = registerOf(t, t->depth - 1);
+    }
+
+    uint8_t b = registerOf(t, t->depth - 2);
+    t->depth -= 2;
+    pushResult(t, emit(t, REG_ENCODE(op, t->depth, b, c)));
+}
+
+static void unary(Translator *t, RegOpCode op) {
+    uint8_t b = popRegister(t);
+    pushResult(t, emit(t, REG_ENCODE(op, t->depth, b, 0)));
+}
+
+/**
+ * @brief Compare-and-branch with the operands swapped, for a constant first operand
+ */
+static RegOpCode swapComparison(RegOpCode op) {
+    switch (op) {
+        case REG_JUMP_UNLESS_GREATER:
+            return REG_JUMP_UNLESS_LESS;
+        case REG_JUMP_UNLESS_GREATER_EQUAL:
+            return REG_JUMP_UNLESS_LESS_EQUAL;
+        case REG_JUMP_UNLESS_LESS:
+            return REG_JUMP_UNLESS_GREATER;
+        case REG_JUMP_UNLESS_LESS_EQUAL:
+            return REG_JUMP_UNLESS_GREATER_EQUAL;
+        default:
+            return op; // Symmetric
+    }
+}
+
+/**
+ * @brief Translates a comparison. When OP_POP_JUMP_IF_FALSE consumes the result
+ * straight away the pair becomes a single compare-and-branch.
+ *
+ * @returns offset of the next stack instruction to translate
+ */
+static size_t comparison(Translator *t, size_t offset, RegOpCode op, RegOpCode jumpOp) {
+    Chunk *chunk = t->chunk;
+    size_t next = offset + 1;
+
+    if (next >= chunk->count || chunk->code[next] != OP_POP_JUMP_IF_FALSE ||
+        t->isTarget[next]) {
+        binary(t, op, op);
+        return next;
+    }
+
+    uint16_t jump = (uint16_t)((chunk->code[next + 1] << 8) | chunk->code[next + 2]);
+    size_t target = next + 3 + jump;
+
+    Operand first = t->stack[t->depth - 2];
+    Operand second = t->stack[t->depth - 1];
+    int constant = REG_JUMP_UNLESS_EQUAL_CONSTANT - REG_JUMP_UNLESS_EQUAL;
+    uint8_t a;
+    uint8_t b;
+
+    if (second.kind == OPERAND_CONSTANT) {
+        a = registerOf(t, t->depth - 2);
+        b = second.index;
+        jumpOp = (RegOpCode)((int)jumpOp + constant);
+    } else if (first.kind == OPERAND_CONSTANT) {
+        a = registerOf(t, t->depth - 1);
+        b = first.index;
+        jumpOp = (RegOpCode)((int)swapComparison(jumpOp) + constant);
+    } else {
+        a = registerOf(t, t->depth - 2);
+        b = registerOf(t, t->depth - 1);
+    }
+
+    t->depth -= 2;
+    materializeAll(t);
+    emit(t, REG_ENCODE(jumpOp, a, b, 0));
+    setJumpTarget(t, emit(t, 0), target, true);
+    return next + 3;
+}
+
+static void findTargets(Translator *t) {
+    Chunk *chunk = t->chunk;
+
+    for (size_t offset = 0; offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_FALSE ||
+            op == OP_LOOP) {
+            uint16_t jump =
+                (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            t->isTarget[op == OP_LOOP ? offset + 5 - jump : offset + 3 + jump] = true;
+        }
+
+        offset += instructionLength(chunk, offset);
+    }
+}
+
+/**
+ * @brief Translates the instruction at `offset`
+ *
+ * @returns offset of the next instruction
+ */
+static size_t translateInstruction(Translator *t, size_t offset) {
+    uint8_t *code = t->chunk->code + offset;
+    size_t depth = t->depth;
+
+    switch ((OpCode)code[0]) {
+        case OP_CONSTANT:
+            pushOperand(t, OPERAND_CONSTANT, code[1]);
+            return offset + 2;
+        case OP_NIL:
+            pushResult(t, emit(t, REG_ENCODE(REG_NIL, depth, 0, 0)));
+            return offset + 1;
+        case OP_TRUE:
+            pushResult(t, emit(t, REG_ENCODE(REG_TRUE, depth, 0, 0)));
+            return offset + 1;
+        case OP_FALSE:
+            pushResult(t, emit(t, REG_ENCODE(REG_FALSE, depth, 0, 0)));
+            return offset + 1;
+        case OP_POP:
+            t->depth -= 1;
+            return offset + 1;
+        case OP_GET_LOCAL:
+            getLocal(t, code[1]);
+            return offset + 2;
+        case OP_GET_LOCAL_CONSTANT:
+            getLocal(t, code[1]);
+            pushOperand(t, OPERAND_CONSTANT, code[2]);
+            return offset + 3;
+        case OP_GET_LOCAL_GET_LOCAL:
+            getLocal(t, code[1]);
+            getLocal(t, code[2]);
+            return offset + 3;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            setLocal(t, code[1], code[0] == OP_SET_LOCAL);
+            return offset + 2;
+        case OP_GET_GLOBAL: {
+            uint16_t slot = (uint16_t)((code[1] << 8) | code[2]);
+            pushResult(t, emit(t, REG_ENCODE_BX(REG_GET_GLOBAL, depth, slot)));
+            return offset + 3;
+        }
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP: {
+            uint16_t slot = (uint16_t)((code[1] << 8) | code[2]);
+            RegOpCode op =
+                code[0] == OP_DEFINE_GLOBAL ? REG_DEFINE_GLOBAL : REG_SET_GLOBAL;
+            emit(t, REG_ENCODE_BX(op, registerOf(t, depth - 1), slot));
+            t->depth -= code[0] == OP_SET_GLOBAL ? 0 : 1;
+            return offset + 3;
+        }
+        case OP_GET_UPVALUE:
+            pushResult(t, emit(t, REG_ENCODE(REG_GET_UPVALUE, depth, code[1], 0)));
+            return offset + 2;
+        case OP_SET_UPVALUE:
+            emit(t, REG_ENCODE(REG_SET_UPVALUE, registerOf(t, depth - 1), code[1], 0));
+            return offset + 2;
+        case OP_GET_ENCLOSING:
+            pushResult(t, emit(t, REG_ENCODE(REG_GET_ENCLOSING, depth, code[1], 0)));
+            return offset + 2;
+        case OP_SET_ENCLOSING:
+            emit(t,
+                 REG_ENCODE(REG_SET_ENCLOSING, registerOf(t, depth - 1), code[1], 0));
+            return offset + 2;
+        case OP_GET_LOCAL_PROPERTY:
+            getLocal(t, code[1]);
+            offset += 1;
+            code += 1;
+            // Falls through
+        case OP_GET_PROPERTY: {
+            uint16_t cache = (uint16_t)((code[2] << 8) | code[3]);
+            uint8_t instance = popRegister(t);
+            size_t ins =
+                emit(t, REG_ENCODE(REG_GET_PROPERTY, t->depth, instance, code[1]));
+            emit(t, cache);
+            pushResult(t, ins);
+            return offset + 4;
+        }
+        case OP_SET_PROPERTY: {
+            uint16_t cache = (uint16_t)((code[2] << 8) | code[3]);
+            uint8_t value = registerOf(t, depth - 1);
+            uint8_t instance = registerOf(t, depth - 2);
+            t->depth -= 2;
+            emit(t, REG_ENCODE(REG_SET_PROPERTY, instance, value, t->depth));
+            emit(t, (RegInstruction)cache | (RegInstruction)code[1] << 16);
+            pushOperand(t, OPERAND_REGISTER, (uint8_t)t->depth);
+            return offset + 4;
+        }
+        case OP_GET_SUPER:
+            materializeAll(t);
+            t->depth -= 2;
+            emit(t, REG_ENCODE(REG_GET_SUPER, t->depth, code[1], 0));
+            pushOperand(t, OPERAND_REGISTER, (uint8_t)t->depth);
+            return offset + 2;
+        case OP_EQUAL:
+            return comparison(t, offset, REG_EQUAL, REG_JUMP_UNLESS_EQUAL);
+        case OP_NOT_EQUAL:
+            return comparison(t, offset, REG_NOT_EQUAL, REG_JUMP_UNLESS_NOT_EQUAL);
+        case OP_GREATER:
+            return comparison(t, offset, REG_GREATER, REG_JUMP_UNLESS_GREATER);
+        case OP_GREATER_EQUAL:
+            return comparison(t, offset, REG_GREATER_EQUAL,
+                              REG_JUMP_UNLESS_GREATER_EQUAL);
+        case OP_LESS:
+            return comparison(t, offset, REG_LESS, REG_JUMP_UNLESS_LESS);
+        case OP_LESS_EQUAL:
+            return comparison(t, offset, REG_LESS_EQUAL, REG_JUMP_UNLESS_LESS_EQUAL);
+        case OP_ADD:
+            binary(t, REG_ADD, REG_ADD_CONSTANT);
+            return offset + 1;
+        case OP_SUBTRACT:
+            binary(t, REG_SUBTRACT, REG_SUBTRACT_CONSTANT);
+            return offset + 1;
+        case OP_MULTIPLY:
+            binary(t, REG_MULTIPLY, REG_MULTIPLY_CONSTANT);
+            return offset + 1;
+        case OP_DIVIDE:
+            binary(t, REG_DIVIDE, REG_DIVIDE_CONSTANT);
+            return offset + 1;
+        case OP_NOT:
+            unary(t, REG_NOT);
+            return offset + 1;
+        case OP_NEGATE:
+            unary(t, REG_NEGATE);
+            return offset + 1;
+        case OP_PRINT:
+            emit(t, REG_ENCODE(REG_PRINT, popRegister(t), 0, 0));
+            return offset + 1;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE: {
+            uint16_t jump = (uint16_t)((code[1] << 8) | code[2]);
+            RegOpCode op = code[0] == OP_JUMP ? REG_JUMP : REG_JUMP_IF_FALSE;
+            uint8_t condition = 0;
+
+            if (code[0] == OP_JUMP_IF_FALSE) {
+                materialize(t, depth - 1);
+                condition = (uint8_t)(depth - 1);
+            } else if (code[0] == OP_POP_JUMP_IF_FALSE) {
+                condition = popRegister(t);
+            }
+
+            emitJump(t, op, condition, offset + 3 + jump);
+            return offset + 3;
+        }
+        case OP_LOOP: {
+            uint16_t jump = (uint16_t)((code[1] << 8) | code[2]);
+            emitJump(t, REG_JUMP, 0, offset + 5 - jump);
+            return offset + 5;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL: {
+            RegOpCode op = code[0] == OP_CALL ? REG_CALL : REG_TAIL_CALL;
+            // The callee may change locals through upvalues, so nothing is left
+            // pending across a call
+            materializeAll(t);
+            t->depth -= code[1] + 1u;
+            emit(t, REG_ENCODE(op, t->depth, code[1], 0));
+            pushOperand(t, OPERAND_REGISTER, (uint8_t)t->depth);
+            return offset + 2;
+        }
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_SUPER_INVOKE: {
+            bool super = code[0] == OP_SUPER_INVOKE;
+            RegOpCode op = super                       ? REG_SUPER_INVOKE
+                           : code[0] == OP_TAIL_INVOKE ? REG_TAIL_INVOKE
+                                                       : REG_INVOKE;
+            materializeAll(t);
+            t->depth -= code[2] + (super ? 2u : 1u);
+            emit(t, REG_ENCODE(op, t->depth, code[2], code[1]));
+            emit(t, (RegInstruction)((code[3] << 8) | code[4]));
+            pushOperand(t, OPERAND_REGISTER, (uint8_t)t->depth);
+            return offset + 5;
+        }
+        case OP_CLOSURE: {
+            ObjFunction *func = AS_FUNCTION(t->chunk->constants.values[code[1]]);
+            materializeAll(t);
+            emit(t, REG_ENCODE_BX(REG_CLOSURE, depth, code[1]));
+
+            for (size_t idx = 0; idx < func->upvalueCount; idx++) {
+                uint8_t isLocal = code[2 + 2 * idx];
+                uint8_t index = code[3 + 2 * idx];
+                emit(t, (RegInstruction)isLocal | (RegInstruction)index << 8);
+            }
+
+            pushOperand(t, OPERAND_REGISTER, (uint8_t)depth);
+            return offset + 2 + 2 * func->upvalueCount;
+        }
+        case OP_CLOSE_UPVALUE:
+            t->depth -= 1;
+            emit(t, REG_ENCODE(REG_CLOSE_UPVALUE, t->depth, 0, 0));
+            return offset + 1;
+        case OP_RETURN:
+            emit(t, REG_ENCODE(REG_RETURN, popRegister(t), 0, 0));
+            return offset + 1;
+        case OP_CLASS:
+            pushResult(t, emit(t, REG_ENCODE(REG_CLASS, depth, code[1], 0)));
+            return offset + 2;
+        case OP_INHERIT:
+            materializeAll(t);
+            t->depth -= 1;
+            emit(t, REG_ENCODE(REG_INHERIT, depth - 2, 0, 0));
+            return offset + 1;
+        case OP_METHOD:
+            materializeAll(t);
+            t->depth -= 1;
+            emit(t, REG_ENCODE(REG_METHOD, depth - 2, code[1], 0));
+            return offset + 2;
+        default:
+            // Quickened instructions only appear once the stack code has run
+            t->failed = true;
+            return t->chunk->count;
+    }
+}
+
+/**
+ * @brief Patches forward jumps now that every target has been translated
+ */
+static void patchFixups(Translator *t) {
+    for (size_t idx = 0; idx < t->fixupCount; idx++) {
+        Fixup *fixup = &t->fixups[idx];
+        setJumpTarget(t, fixup->word, fixup->target, fixup->isData);
+    }
+}
+
+RegisterCode *translateFunction(VM *vm, Compiler *compiler, ObjFunction *func) {
+    Chunk *chunk = &func->chunk;
+
+    Translator t;
+    t.vm = vm;
+    t.compiler = compiler;
+    t.func = func;
+    t.chunk = chunk;
+    t.capacity = 0;
+    t.line = 0;
+    t.failed = false;
+    t.depth = 0;
+    t.fixupCount = 0;
+    t.lastWrite = NONE;
+
+    t.result = ALLOCATE(vm, compiler, RegisterCode, 1);
+    t.result->count = 0;
+    t.result->code = NULL;
+    t.result->lines = NULL;
+    t.result->frameSize = 0;
+
+    t.labels = ALLOCATE(vm, compiler, size_t, chunk->count + 1);
+    t.depths = ALLOCATE(vm, compiler, size_t, chunk->count + 1);
+    t.isTarget = ALLOCATE(vm, compiler, bool, chunk->count + 1);
+    t.fixups = ALLOCATE(vm, compiler, Fixup, chunk->count);
+
+    for (size_t offset = 0; offset <= chunk->count; offset++) {
+        t.labels[offset] = NONE;
+        t.depths[offset] = NONE;
+        t.isTarget[offset] = false;
+    }
+
+    // The callee and its arguments
+    for (size_t slot = 0; slot <= func->arity; slot++) {
+        pushOperand(&t, OPERAND_REGISTER, (uint8_t)slot);
+    }
+
+    findTargets(&t);
+
+    for (size_t offset = 0; offset < chunk->count && !t.failed;) {
+        t.line = chunk->lines[offset];
+
+        if (t.isTarget[offset]) {
+            // Every jump here materialized the stack, so must the code falling through
+            materializeAll(&t);
+
+            if (t.depths[offset] != NONE) {
+                t.depth = t.depths[offset];
+            }
+
+            for (size_t slot = 0; slot < t.depth; slot++) {
+                t.stack[slot].kind = OPERAND_REGISTER;
+                t.stack[slot].index = (uint8_t)slot;
+            }
+
+            t.lastWrite = NONE;
+        }
+
+        t.labels[offset] = t.result->count;
+        offset = translateInstruction(&t, offset);
+    }
+
+    t.labels[chunk->count] = t.result->count;
+
+    if (!t.failed) {
+        patchFixups(&t);
+    }
+
+    FREE_ARRAY(vm, compiler, size_t, t.labels, chunk->count + 1);
+    FREE_ARRAY(vm, compiler, size_t, t.depths, chunk->count + 1);
+    FREE_ARRAY(vm, compiler, bool, t.isTarget, chunk->count + 1);
+    FREE_ARRAY(vm, compiler, Fixup, t.fixups, chunk->count);
+
+    // Copies of the capacity so the arrays can be freed exactly
+    RegisterCode *result = t.result;
+    result->code = GROW_ARRAY(vm, compiler, RegInstruction, result->code, t.capacity,
+                              result->count);
+    result->lines =
+        GROW_ARRAY(vm, compiler, size_t, result->lines, t.capacity, result->count);
+
+    if (t.failed) {
+        freeRegisterCode(vm, compiler, result);
+        return NULL;
+    }
+
+    return result;
+}
+
+void freeRegisterCode(VM *vm, Compiler *compiler, RegisterCode *code) {
+    if (code == NULL) {
+        return;
+    }
+
+    FREE_ARRAY(vm, compiler, RegInstruction, code->code, code->count);
+    FREE_ARRAY(vm, compiler, size_t, code->lines, code->count);
+    FREE(vm, compiler, RegisterCode, code);
+}
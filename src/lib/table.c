@@ -132,44 +132,251 @@ bool tableDelete(Table *table, ObjString *key) {
     return true;
 }
 
-ObjString *tableFindString(Table *table, const char *chars, size_t length,
-                           uint32_t hash) {
-    if (table->count == 0) {
+void markTable(VM *vm, Table *table) {
+    for (size_t idx = 0; idx < table->capacity; idx++) {
+        Entry *entry = &table->entries[idx];
+        markObject(vm, (Obj *)entry->key);
+        markValue(vm, entry->value);
+    }
+}
+
+void initStringSet(StringSet *set) {
+    set->count = 0;
+    set->capacity = 0;
+    set->hashes = NULL;
+    set->keys = NULL;
+}
+
+void freeStringSet(VM *vm, Compiler *compiler, StringSet *set) {
+    FREE_ARRAY(vm, compiler, uint32_t, set->hashes, set->capacity);
+    FREE_ARRAY(vm, compiler, ObjString *, set->keys, set->capacity);
+    initStringSet(set);
+}
+
+/**
+ * @brief Hash a string is stored under, never zero since that marks empty slots
+ */
+static inline uint32_t storedHash(uint32_t hash) {
+    return hash == 0 ? 1 : hash;
+}
+
+/**
+ * @brief Stores a string in the first empty slot from its hash's home slot on
+ */
+static void stringSetInsert(uint32_t *hashes, ObjString **keys, uint32_t capacity,
+                            uint32_t hash, ObjString *key) {
+    uint32_t index = hash & (capacity - 1);
+
+    while (hashes[index] != 0) {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    hashes[index] = hash;
+    keys[index] = key;
+}
+
+static void adjustStringSetCapacity(VM *vm, Compiler *compiler, StringSet *set,
+                                    uint32_t capacity) {
+    // Both arrays are allocated before the set is read, since either allocation
+    // may run the GC, which removes strings from the set
+    uint32_t *hashes = ALLOCATE(vm, compiler, uint32_t, capacity);
+    ObjString **keys = ALLOCATE(vm, compiler, ObjString *, capacity);
+    memset(hashes, 0, sizeof(uint32_t) * capacity);
+
+    for (size_t idx = 0; idx < set->capacity; idx++) {
+        if (set->hashes[idx] != 0) {
+            stringSetInsert(hashes, keys, capacity, set->hashes[idx], set->keys[idx]);
+        }
+    }
+
+    FREE_ARRAY(vm, compiler, uint32_t, set->hashes, set->capacity);
+    FREE_ARRAY(vm, compiler, ObjString *, set->keys, set->capacity);
+
+    set->hashes = hashes;
+    set->keys = keys;
+    set->capacity = capacity;
+}
+
+void stringSetAdd(VM *vm, Compiler *compiler, StringSet *set, ObjString *string) {
+    if (set->count + 1 > set->capacity * TABLE_MAX_LOAD) {
+        adjustStringSetCapacity(vm, compiler, set, GROW_CAPACITY(set->capacity));
+    }
+
+    stringSetInsert(set->hashes, set->keys, set->capacity, storedHash(string->hash),
+                    string);
+    set->count += 1;
+}
+
+ObjString *stringSetFind(StringSet *set, const char *chars, size_t length,
+                         uint32_t hash) {
+    if (set->count == 0) {
         return NULL;
     }
 
-    uint32_t index = hash & (table->capacity - 1);
+    hash = storedHash(hash);
+    uint32_t index = hash & (set->capacity - 1);
 
     for (;;) {
-        Entry *entry = &table->entries[index];
+        uint32_t entryHash = set->hashes[index];
 
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return NULL;
+        if (entryHash == 0) {
+            return NULL;
+        }
+
+        if (entryHash == hash) {
+            ObjString *key = set->keys[index];
+
+            if (key->length == length && memcmp(key->chars, chars, length) == 0) {
+                return key;
             }
-        } else if (entry->key->length == length && entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
         }
 
-        index = (index + 1) & (table->capacity - 1);
+        index = (index + 1) & (set->capacity - 1);
+    }
+}
+
+void stringSetRemoveWhite(StringSet *set) {
+    uint32_t first = 0;
+
+    // Most collections free no interned strings, so look for one before moving any
+    while (first < set->capacity &&
+           (set->hashes[first] == 0 || set->keys[first]->obj.isMarked)) {
+        first += 1;
+    }
+
+    if (first == set->capacity) {
+        return;
+    }
+
+    uint32_t mask = set->capacity - 1;
+    uint32_t start = first;
+
+    // Start after an empty slot so every run of full slots is visited from its
+    // beginning. The load factor guarantees there is one.
+    while (set->hashes[start] != 0) {
+        start = (start - 1) & mask;
+    }
+
+    // Once a string in a run has been removed, the strings after it are inserted
+    // again, which moves them back into the gap if their probe passed through it
+    bool removed = false;
+
+    for (uint32_t step = 1; step <= set->capacity; step++) {
+        uint32_t index = (start + step) & mask;
+        uint32_t hash = set->hashes[index];
+
+        if (hash == 0) {
+            removed = false;
+        } else if (!set->keys[index]->obj.isMarked) {
+            set->hashes[index] = 0;
+            set->count -= 1;
+            removed = true;
+        } else if (removed) {
+            set->hashes[index] = 0;
+            stringSetInsert(set->hashes, set->keys, set->capacity, hash,
+                            set->keys[index]);
+        }
+    }
+}
+
+void initMethodTable(MethodTable *table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+}
+
+void freeMethodTable(VM *vm, Compiler *compiler, MethodTable *table) {
+    FREE_ARRAY(vm, compiler, MethodEntry, table->entries, table->capacity);
+    initMethodTable(table);
+}
+
+static MethodEntry *findMethodEntry(MethodEntry *entries, uint32_t capacity,
+                                    ObjString *name) {
+    uint32_t index = name->selector & (capacity - 1);
+
+    for (;;) {
+        MethodEntry *entry = &entries[index];
+
+        if (entry->name == name || entry->name == NULL) {
+            return entry;
+        }
+
+        index = (index + 1) & (capacity - 1);
     }
 }
 
-void tableRemoveWhite(Table *table) {
+static void adjustMethodCapacity(VM *vm, Compiler *compiler, MethodTable *table,
+                                 uint32_t capacity) {
+    MethodEntry *entries = ALLOCATE(vm, compiler, MethodEntry, capacity);
+
+    for (size_t idx = 0; idx < capacity; idx++) {
+        entries[idx].name = NULL;
+        entries[idx].method = NULL;
+    }
+
     for (size_t idx = 0; idx < table->capacity; idx++) {
-        Entry *entry = &table->entries[idx];
+        MethodEntry *entry = &table->entries[idx];
 
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+        if (entry->name != NULL) {
+            *findMethodEntry(entries, capacity, entry->name) = *entry;
         }
     }
+
+    FREE_ARRAY(vm, compiler, MethodEntry, table->entries, table->capacity);
+
+    table->entries = entries;
+    table->capacity = capacity;
 }
 
-void markTable(VM *vm, Table *table) {
+void methodTableSet(VM *vm, Compiler *compiler, MethodTable *table, ObjString *name,
+                    ObjClosure *method) {
+    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+        adjustMethodCapacity(vm, compiler, table, GROW_CAPACITY(table->capacity));
+    }
+
+    MethodEntry *entry = findMethodEntry(table->entries, table->capacity, name);
+
+    if (entry->name == NULL) {
+        table->count += 1;
+    }
+
+    entry->name = name;
+    entry->method = method;
+}
+
+void methodTableAddAll(VM *vm, Compiler *compiler, MethodTable *from, MethodTable *to) {
+    if (to->count == 0 && from->count > 0) {
+        MethodEntry *entries = ALLOCATE(vm, compiler, MethodEntry, from->capacity);
+        memcpy(entries, from->entries, sizeof(MethodEntry) * from->capacity);
+
+        FREE_ARRAY(vm, compiler, MethodEntry, to->entries, to->capacity);
+        to->entries = entries;
+        to->capacity = from->capacity;
+        to->count = from->count;
+        return;
+    }
+
+    for (size_t idx = 0; idx < from->capacity; idx++) {
+        MethodEntry *entry = &from->entries[idx];
+
+        if (entry->name != NULL) {
+            methodTableSet(vm, compiler, to, entry->name, entry->method);
+        }
+    }
+}
+
+ObjClosure *methodTableGet(MethodTable *table, ObjString *name) {
+    if (table->count == 0) {
+        return NULL;
+    }
+
+    return findMethodEntry(table->entries, table->capacity, name)->method;
+}
+
+void markMethodTable(VM *vm, MethodTable *table) {
     for (size_t idx = 0; idx < table->capacity; idx++) {
-        Entry *entry = &table->entries[idx];
-        markObject(vm, (Obj *)entry->key);
-        markValue(vm, entry->value);
+        MethodEntry *entry = &table->entries[idx];
+        markObject(vm, (Obj *)entry->name);
+        markObject(vm, (Obj *)entry->method);
     }
 }
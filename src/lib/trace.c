@@ -0,0 +1,710 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "jit.h"
+#include "memory.h"
+#include "trace.h"
+#include "value.h"
+#include "vm.h"
+
+/**
+ * @brief State of a recording in progress.
+ *
+ * @details `stack` mirrors the frame slots above the trace's entry depth with the
+ * trace instruction which produced each value.
+ */
+typedef struct {
+    VM *vm;
+    CallFrame *frame;
+    Trace *trace;
+
+    size_t stackCount;
+    IrRef stack[TRACE_MAX_STACK];
+
+    // Other back-edges taken, `for` loops jump back to their increment clause
+    size_t followedCount;
+    uint16_t followed[TRACE_MAX_FOLLOWED];
+} Recorder;
+
+static bool isNumeric(Trace *trace, IrRef ref) {
+    switch (trace->ir[ref].op) {
+        case IR_VAR:
+        case IR_KNUM:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_NEG:
+        case IR_CONV:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isComparison(Trace *trace, IrRef ref) {
+    IrOp op = trace->ir[ref].op;
+    return op == IR_LT || op == IR_GT || op == IR_EQ;
+}
+
+static bool emitIr(Recorder *rec, IrOp op, IrRef a, IrRef b, IrRef *ref) {
+    Trace *trace = rec->trace;
+
+    if (trace->irCount == TRACE_MAX_IR) {
+        return false;
+    }
+
+    IrIns *ins = &trace->ir[trace->irCount];
+    ins->op = op;
+    ins->a = a;
+    ins->b = b;
+    ins->flag = false;
+    ins->integer = false;
+    ins->index = 0;
+    ins->number = 0;
+
+    *ref = (IrRef)trace->irCount++;
+    return true;
+}
+
+static bool emitNumber(Recorder *rec, Value number, IrRef *ref) {
+    if (!emitIr(rec, IR_KNUM, 0, 0, ref)) {
+        return false;
+    }
+
+    rec->trace->ir[*ref].number = AS_NUMBER(number);
+    rec->trace->ir[*ref].integer = IS_INT(number);
+    return true;
+}
+
+static bool emitBool(Recorder *rec, bool flag, IrRef *ref) {
+    if (!emitIr(rec, IR_KBOOL, 0, 0, ref)) {
+        return false;
+    }
+
+    rec->trace->ir[*ref].flag = flag;
+    return true;
+}
+
+static bool pushRef(Recorder *rec, IrRef ref) {
+    if (rec->stackCount == TRACE_MAX_STACK) {
+        return false;
+    }
+
+    rec->stack[rec->stackCount++] = ref;
+    return true;
+}
+
+static IrRef popRef(Recorder *rec) { return rec->stack[--rec->stackCount]; }
+
+static IrRef peekRef(Recorder *rec, size_t distance) {
+    return rec->stack[rec->stackCount - 1 - distance];
+}
+
+/**
+ * @brief Replaces an integer `ref` by the same number as a double
+ */
+static bool toDouble(Recorder *rec, IrRef *ref) {
+    IrIns *ins = &rec->trace->ir[*ref];
+
+    if (!ins->integer) {
+        return true;
+    }
+
+    if (ins->op == IR_KNUM) {
+        return emitNumber(rec, NUMBER_VAL(ins->number), ref);
+    }
+
+    return emitIr(rec, IR_CONV, *ref, 0, ref);
+}
+
+/**
+ * @brief Arithmetic on two numbers done the way the interpreter does it
+ */
+static Value compute(IrOp op, Value a, Value b) {
+    if (ARE_INTS(a, b)) {
+        switch (op) {
+            case IR_ADD:
+                return intAdd(AS_INT(a), AS_INT(b));
+            case IR_SUB:
+                return intSubtract(AS_INT(a), AS_INT(b));
+            case IR_MUL:
+                return intMultiply(AS_INT(a), AS_INT(b));
+            default:
+                return intDivide(AS_INT(a), AS_INT(b));
+        }
+    }
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    switch (op) {
+        case IR_ADD:
+            return NUMBER_VAL(x + y);
+        case IR_SUB:
+            return NUMBER_VAL(x - y);
+        case IR_MUL:
+            return NUMBER_VAL(x * y);
+        default:
+            return NUMBER_VAL(x / y);
+    }
+}
+
+/**
+ * @brief Finds the variable for a local or global slot, creating it on first use
+ */
+static TraceVar *findVar(Recorder *rec, bool global, uint16_t slot, Value value) {
+    Trace *trace = rec->trace;
+
+    for (size_t idx = 0; idx < trace->varCount; idx++) {
+        TraceVar *var = &trace->vars[idx];
+
+        if (var->global == global && var->slot == slot) {
+            return var;
+        }
+    }
+
+    IrRef entry;
+
+    if (trace->varCount == TRACE_MAX_VARS || !emitIr(rec, IR_VAR, 0, 0, &entry)) {
+        return NULL;
+    }
+
+    trace->ir[entry].index = (uint16_t)trace->varCount;
+    trace->ir[entry].integer = IS_INT(value);
+
+    TraceVar *var = &trace->vars[trace->varCount++];
+    var->global = global;
+    var->slot = slot;
+    var->written = false;
+    var->entry = entry;
+    var->current = entry;
+    return var;
+}
+
+static bool getVar(Recorder *rec, bool global, uint16_t slot, Value value) {
+    TraceVar *var = findVar(rec, global, slot, value);
+    return var != NULL && pushRef(rec, var->current);
+}
+
+/**
+ * @brief Records a store of a number to a variable which already holds one, the
+ * trace keeps its variables unboxed for the whole loop. Integers stored to a double
+ * variable are converted, doubles can't be stored to an integer variable.
+ */
+static bool setVar(Recorder *rec, bool global, uint16_t slot, Value old) {
+    IrRef value = peekRef(rec, 0);
+
+    if (!IS_NUMBER(old) || !isNumeric(rec->trace, value)) {
+        return false;
+    }
+
+    TraceVar *var = findVar(rec, global, slot, old);
+
+    if (var == NULL) {
+        return false;
+    }
+
+    if (!rec->trace->ir[var->entry].integer && !toDouble(rec, &value)) {
+        return false;
+    }
+
+    if (rec->trace->ir[value].integer != rec->trace->ir[var->entry].integer) {
+        return false;
+    }
+
+    var->current = value;
+    var->written = true;
+    return true;
+}
+
+/**
+ * @brief Snapshots the interpreter state just before the instruction at `ip`
+ */
+static bool snapshot(Recorder *rec, uint8_t *ip, uint16_t *index) {
+    Trace *trace = rec->trace;
+
+    if (trace->snapshotCount == TRACE_MAX_SNAPSHOTS) {
+        return false;
+    }
+
+    Snapshot *snap = &trace->snapshots[trace->snapshotCount];
+    snap->ip = ip;
+    snap->stackCount = (uint8_t)rec->stackCount;
+    snap->varCount = (uint8_t)trace->varCount;
+
+    for (size_t idx = 0; idx < rec->stackCount; idx++) {
+        // Only the comparison being guarded can still be waiting for its guard
+        if (isComparison(trace, rec->stack[idx])) {
+            return false;
+        }
+
+        snap->stack[idx] = rec->stack[idx];
+    }
+
+    for (size_t idx = 0; idx < trace->varCount; idx++) {
+        snap->vars[idx] = trace->vars[idx].current;
+    }
+
+    *index = (uint16_t)trace->snapshotCount++;
+    return true;
+}
+
+/**
+ * @brief Records arithmetic or a comparison on the two numbers on top of the stack.
+ *
+ * @details Integer addition, subtraction and multiplication stay integers as long
+ * as they did while recording, exiting before the instruction should the result
+ * ever not fit. Everything else is done in doubles.
+ */
+static bool arithmetic(Recorder *rec, IrOp op, uint8_t *ip) {
+    Trace *trace = rec->trace;
+    IrRef a = peekRef(rec, 1);
+    IrRef b = peekRef(rec, 0);
+
+    if (!isNumeric(trace, a) || !isNumeric(trace, b)) {
+        return false;
+    }
+
+    Value left = rec->vm->stackTop[-2];
+    Value right = rec->vm->stackTop[-1];
+    bool compare = op == IR_LT || op == IR_GT || op == IR_EQ;
+    bool integer = trace->ir[a].integer && trace->ir[b].integer && op != IR_DIV;
+    uint16_t snap = 0;
+    IrRef ref;
+
+    // Constant folding, comparisons are left to the guards
+    if (!compare && trace->ir[a].op == IR_KNUM && trace->ir[b].op == IR_KNUM) {
+        rec->stackCount -= 2;
+        return emitNumber(rec, compute(op, left, right), &ref) && pushRef(rec, ref);
+    }
+
+    if (integer && !compare) {
+        integer = IS_INT(compute(op, left, right));
+
+        if (integer && !snapshot(rec, ip, &snap)) {
+            return false;
+        }
+    }
+
+    rec->stackCount -= 2;
+
+    if (!integer && (!toDouble(rec, &a) || !toDouble(rec, &b))) {
+        return false;
+    }
+
+    if (!emitIr(rec, op, a, b, &ref)) {
+        return false;
+    }
+
+    trace->ir[ref].integer = integer && !compare;
+    trace->ir[ref].index = snap;
+    return pushRef(rec, ref);
+}
+
+/**
+ * @brief Records a conditional jump on the value on top of the stack
+ */
+static bool branch(Recorder *rec, uint8_t *ip, bool truthy) {
+    Trace *trace = rec->trace;
+    IrRef cond = peekRef(rec, 0);
+
+    if (isNumeric(trace, cond) || trace->ir[cond].op == IR_KBOOL) {
+        return true; // Outcome is already known, no guard needed
+    }
+
+    // At the exit the interpreter sees the opposite of the recorded outcome
+    IrRef exitValue;
+    IrRef guard;
+    uint16_t snap;
+
+    if (!emitBool(rec, !truthy, &exitValue)) {
+        return false;
+    }
+
+    rec->stack[rec->stackCount - 1] = exitValue;
+
+    if (!snapshot(rec, ip, &snap) || !emitIr(rec, IR_GUARD, cond, 0, &guard)) {
+        return false;
+    }
+
+    trace->ir[guard].flag = truthy;
+    trace->ir[guard].index = snap;
+
+    // Past the guard the condition is a known constant
+    IrRef known;
+
+    if (!emitBool(rec, truthy, &known)) {
+        return false;
+    }
+
+    rec->stack[rec->stackCount - 1] = known;
+    return true;
+}
+
+static bool recordConstant(Recorder *rec, uint8_t index) {
+    Value constant = rec->frame->closure->func->chunk.constants.values[index];
+    IrRef ref;
+
+    return IS_NUMBER(constant) && emitNumber(rec, constant, &ref) &&
+           pushRef(rec, ref);
+}
+
+/**
+ * @brief Records a local variable read. Slots below the entry depth are trace
+ * variables, those above are temporaries the trace tracks itself.
+ */
+static bool recordGetLocal(Recorder *rec, uint8_t slot) {
+    Trace *trace = rec->trace;
+
+    if (slot >= trace->entryDepth) {
+        return pushRef(rec, rec->stack[slot - trace->entryDepth]);
+    }
+
+    Value value = rec->frame->slots[slot];
+    return IS_NUMBER(value) && getVar(rec, false, slot, value);
+}
+
+static bool recordSetLocal(Recorder *rec, uint8_t slot) {
+    Trace *trace = rec->trace;
+
+    if (slot >= trace->entryDepth) {
+        if (isComparison(trace, peekRef(rec, 0))) {
+            return false;
+        }
+
+        rec->stack[slot - trace->entryDepth] = peekRef(rec, 0);
+        return true;
+    }
+
+    return setVar(rec, false, slot, rec->frame->slots[slot]);
+}
+
+/**
+ * @brief Executes and records one instruction
+ *
+ * @returns false if the instruction can't be recorded, in which case it has not
+ * been executed either
+ */
+static bool recordInstruction(Recorder *rec, bool *closed) {
+    VM *vm = rec->vm;
+    CallFrame *frame = rec->frame;
+    Trace *trace = rec->trace;
+    uint8_t *ip = frame->ip;
+    Value *slots = frame->slots;
+    Value *constants = frame->closure->func->chunk.constants.values;
+    Value *globals = vm->globalValues.values;
+    IrRef ref;
+
+    switch (genericOpCode((OpCode)*ip)) {
+        case OP_CONSTANT:
+            if (!recordConstant(rec, ip[1])) {
+                return false;
+            }
+
+            push(vm, constants[ip[1]]);
+            frame->ip += 2;
+            return true;
+        case OP_POP:
+            if (rec->stackCount == 0) {
+                return false;
+            }
+
+            popRef(rec);
+            pop(vm);
+            frame->ip += 1;
+            return true;
+        case OP_GET_LOCAL:
+            if (!recordGetLocal(rec, ip[1])) {
+                return false;
+            }
+
+            push(vm, slots[ip[1]]);
+            frame->ip += 2;
+            return true;
+        case OP_GET_LOCAL_CONSTANT:
+            if (!recordGetLocal(rec, ip[1]) || !recordConstant(rec, ip[2])) {
+                return false;
+            }
+
+            push(vm, slots[ip[1]]);
+            push(vm, constants[ip[2]]);
+            frame->ip += 3;
+            return true;
+        case OP_GET_LOCAL_GET_LOCAL:
+            if (!recordGetLocal(rec, ip[1]) || !recordGetLocal(rec, ip[2])) {
+                return false;
+            }
+
+            push(vm, slots[ip[1]]);
+            push(vm, slots[ip[2]]);
+            frame->ip += 3;
+            return true;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            if (!recordSetLocal(rec, ip[1])) {
+                return false;
+            }
+
+            slots[ip[1]] = vm->stackTop[-1];
+
+            if (*ip == OP_SET_LOCAL_POP) {
+                popRef(rec);
+                pop(vm);
+            }
+
+            frame->ip += 2;
+            return true;
+        case OP_GET_GLOBAL: {
+            uint16_t slot = (uint16_t)((ip[1] << 8) | ip[2]);
+
+            if (!IS_NUMBER(globals[slot]) || !getVar(rec, true, slot, globals[slot])) {
+                return false;
+            }
+
+            push(vm, globals[slot]);
+            frame->ip += 3;
+            return true;
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP: {
+            uint16_t slot = (uint16_t)((ip[1] << 8) | ip[2]);
+
+            if (!setVar(rec, true, slot, globals[slot])) {
+                return false;
+            }
+
+            globals[slot] = vm->stackTop[-1];
+
+            if (*ip == OP_SET_GLOBAL_POP) {
+                popRef(rec);
+                pop(vm);
+            }
+
+            frame->ip += 3;
+            return true;
+        }
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            if (!IS_NUMBER(vm->stackTop[-1]) || !IS_NUMBER(vm->stackTop[-2])) {
+                return false;
+            }
+
+            OpCode op = genericOpCode((OpCode)*ip);
+            IrOp irOp = op == OP_EQUAL || op == OP_NOT_EQUAL       ? IR_EQ
+                        : op == OP_GREATER || op == OP_LESS_EQUAL  ? IR_GT
+                        : op == OP_LESS || op == OP_GREATER_EQUAL  ? IR_LT
+                        : op == OP_ADD                             ? IR_ADD
+                        : op == OP_SUBTRACT                        ? IR_SUB
+                        : op == OP_MULTIPLY                        ? IR_MUL
+                                                                   : IR_DIV;
+
+            if (!arithmetic(rec, irOp, ip)) {
+                return false;
+            }
+
+            // The negated comparisons are the plain ones with their flag set
+            if (op == OP_NOT_EQUAL || op == OP_GREATER_EQUAL || op == OP_LESS_EQUAL) {
+                trace->ir[peekRef(rec, 0)].flag = true;
+            }
+
+            Value right = pop(vm);
+            Value left = pop(vm);
+            double a = AS_NUMBER(left);
+            double b = AS_NUMBER(right);
+
+            switch (op) {
+                case OP_EQUAL:
+                    push(vm, BOOL_VAL(a == b));
+                    break;
+                case OP_NOT_EQUAL:
+                    push(vm, BOOL_VAL(!(a == b)));
+                    break;
+                case OP_GREATER:
+                    push(vm, BOOL_VAL(a > b));
+                    break;
+                case OP_GREATER_EQUAL:
+                    push(vm, BOOL_VAL(!(a < b)));
+                    break;
+                case OP_LESS:
+                    push(vm, BOOL_VAL(a < b));
+                    break;
+                case OP_LESS_EQUAL:
+                    push(vm, BOOL_VAL(!(a > b)));
+                    break;
+                default:
+                    push(vm, compute(irOp, left, right));
+                    break;
+            }
+
+            frame->ip += 1;
+            return true;
+        }
+        case OP_NOT: {
+            IrRef value = peekRef(rec, 0);
+
+            if (isComparison(trace, value)) {
+                if (!emitIr(rec, trace->ir[value].op, trace->ir[value].a,
+                            trace->ir[value].b, &ref)) {
+                    return false;
+                }
+
+                trace->ir[ref].flag = !trace->ir[value].flag;
+            } else if (trace->ir[value].op == IR_KBOOL) {
+                if (!emitBool(rec, !trace->ir[value].flag, &ref)) {
+                    return false;
+                }
+            } else {
+                return false;
+            }
+
+            rec->stack[rec->stackCount - 1] = ref;
+            vm->stackTop[-1] = BOOL_VAL(IS_NIL(vm->stackTop[-1]) ||
+                                        (IS_BOOL(vm->stackTop[-1]) &&
+                                         !AS_BOOL(vm->stackTop[-1])));
+            frame->ip += 1;
+            return true;
+        }
+        case OP_NEGATE: {
+            Value value = vm->stackTop[-1];
+            ref = peekRef(rec, 0);
+
+            if (!IS_NUMBER(value) || !isNumeric(trace, ref)) {
+                return false;
+            }
+
+            // Negating zero gives a double, so integers are negated as doubles
+            Value negated = IS_INT(value) ? intNegate(AS_INT(value))
+                                          : NUMBER_VAL(-AS_NUMBER(value));
+
+            if (trace->ir[ref].op == IR_KNUM) {
+                if (!emitNumber(rec, negated, &ref)) {
+                    return false;
+                }
+            } else if (!toDouble(rec, &ref) || !emitIr(rec, IR_NEG, ref, 0, &ref)) {
+                return false;
+            }
+
+            rec->stack[rec->stackCount - 1] = ref;
+            vm->stackTop[-1] = negated;
+            frame->ip += 1;
+            return true;
+        }
+        case OP_JUMP: {
+            uint16_t offset = (uint16_t)((ip[1] << 8) | ip[2]);
+            frame->ip += 3 + offset;
+            return true;
+        }
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE: {
+            uint16_t offset = (uint16_t)((ip[1] << 8) | ip[2]);
+            Value cond = vm->stackTop[-1];
+            bool truthy = !(IS_NIL(cond) || (IS_BOOL(cond) && !AS_BOOL(cond)));
+
+            if (!branch(rec, ip, truthy)) {
+                return false;
+            }
+
+            if (*ip == OP_POP_JUMP_IF_FALSE) {
+                popRef(rec);
+                pop(vm);
+            }
+
+            frame->ip += truthy ? 3 : 3 + offset;
+            return true;
+        }
+        case OP_LOOP: {
+            uint16_t offset = (uint16_t)((ip[1] << 8) | ip[2]);
+            uint16_t loop = (uint16_t)((ip[3] << 8) | ip[4]);
+            uint8_t *target = ip + 5 - offset;
+
+            if (target == trace->anchor) {
+                if (rec->stackCount != 0) {
+                    return false;
+                }
+
+                *closed = true;
+            } else {
+                // Taking another back-edge twice means running an inner loop,
+                // which gets a trace of its own
+                for (size_t idx = 0; idx < rec->followedCount; idx++) {
+                    if (rec->followed[idx] == loop) {
+                        return false;
+                    }
+                }
+
+                if (rec->followedCount == TRACE_MAX_FOLLOWED) {
+                    return false;
+                }
+
+                rec->followed[rec->followedCount++] = loop;
+            }
+
+            frame->ip = target;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+void traceRecord(VM *vm, CallFrame *frame, LoopCache *loop) {
+    clock_t start = clock();
+
+    Trace *trace = ALLOCATE(vm, NULL, Trace, 1);
+    trace->anchor = frame->ip;
+    trace->entryDepth = (size_t)(vm->stackTop - frame->slots);
+    trace->irCount = 0;
+    trace->varCount = 0;
+    trace->snapshotCount = 0;
+    trace->code = NULL;
+    trace->codeSize = 0;
+
+    Recorder rec;
+    rec.vm = vm;
+    rec.frame = frame;
+    rec.trace = trace;
+    rec.stackCount = 0;
+    rec.followedCount = 0;
+
+    bool closed = false;
+
+    while (!closed && recordInstruction(&rec, &closed)) {
+    }
+
+    if (closed && jitCompileTrace(vm, trace)) {
+        loop->trace = trace;
+        vm->jitStats.tracesCompiled += 1;
+    } else {
+        traceFree(vm, NULL, trace);
+        vm->jitStats.tracesAborted += 1;
+        loop->aborts += 1;
+
+        // Loops which keep failing are never counted up to the threshold again
+        if (loop->aborts < TRACE_MAX_ABORTS) {
+            loop->hotness = 0;
+        }
+    }
+
+    vm->jitStats.compileTime += (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+void traceFree(VM *vm, Compiler *compiler, Trace *trace) {
+    if (trace == NULL) {
+        return;
+    }
+
+    jitFreeTrace(trace);
+    FREE(vm, compiler, Trace, trace);
+}
@@ -14,7 +14,7 @@ void initValueArray(ValueArray *array) {
 
 void writeValueArray(VM *vm, Compiler *compiler, ValueArray *array, Value value) {
     if (array->capacity < array->count + 1) {
-        uint8_t oldCapacity = array->capacity;
+        size_t oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
         array->values =
             GROW_ARRAY(vm, compiler, Value, array->values, oldCapacity, array->capacity);
@@ -29,13 +29,22 @@ void freeValueArray(VM *vm, Compiler *compiler, ValueArray *array) {
     initValueArray(array);
 }
 
+/**
+ * @brief Checks if two strings are interned, which makes them equal only if they are
+ * the same string
+ */
+static inline bool bothInterned(Value a, Value b) {
+    return AS_STRING(a)->interned && AS_STRING(b)->interned;
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
 
-    return a == b;
+    return a == b || (IS_STRING(a) && IS_STRING(b) && !bothInterned(a, b) &&
+                      stringsEqual(AS_STRING(a), AS_STRING(b)));
 #else
     if (a.type != b.type) {
         return false;
@@ -49,7 +58,11 @@ bool valuesEqual(Value a, Value b) {
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:
-            return AS_OBJ(a) == AS_OBJ(b);
+            return AS_OBJ(a) == AS_OBJ(b) ||
+                   (IS_STRING(a) && IS_STRING(b) && !bothInterned(a, b) &&
+                    stringsEqual(AS_STRING(a), AS_STRING(b)));
+        case VAL_UNDEFINED:
+            return true;
         default:
             return false; // Unreachable
     }
@@ -83,6 +96,9 @@ void printValue(Value value) {
         case VAL_OBJ:
             printObject(value);
             break;
+        case VAL_UNDEFINED:
+            printf("undefined");
+            break;
     }
 #endif // NAN_BOXING
 }
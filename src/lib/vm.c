@@ -1,6 +1,7 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <wchar.h>
@@ -9,14 +10,24 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
+#include "regvm.h"
 #include "table.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
 static void resetStack(VM *vm) {
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL;
+         upvalue = (ObjUpvalue *)upvalue->next) {
+        vm->upvalueSlots[upvalue->location - vm->stack] = NULL;
+    }
+
     vm->stackTop = vm->stack;
+    vm->stackHigh = vm->stack;
     vm->frameCount = 0;
     vm->openUpvalues = NULL;
 }
@@ -31,8 +42,14 @@ static void runtimeError(VM *vm, const char *format, ...) {
     for (intmax_t i = (intmax_t)(vm->frameCount - 1); i >= 0; i--) {
         CallFrame *frame = &vm->frames[i];
         ObjFunction *func = frame->closure->func;
-        size_t instruction = (size_t)(frame->ip - func->chunk.code - 1);
-        size_t line = func->chunk.lines[instruction];
+        size_t line;
+
+        if (frame->pc != NULL) {
+            RegisterCode *code = func->registerCode;
+            line = code->lines[frame->pc - code->code - 1];
+        } else {
+            line = func->chunk.lines[frame->ip - func->chunk.code - 1];
+        }
 
         fprintf(stderr, "[line %zu] in ", line);
 
@@ -56,13 +73,117 @@ static void defineNative(VM *vm, Compiler *compiler, const char *name, NativeFn
 
     push(vm, OBJ_VAL(copyString(vm, compiler, strlen(name), name)));
     push(vm, OBJ_VAL(newNative(vm, compiler, func, arity)));
-    tableSet(vm, compiler, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+    size_t slot = resolveGlobal(vm, compiler, AS_STRING(vm->stack[0]));
+    vm->globalValues.values[slot] = vm->stack[1];
     pop(vm);
     pop(vm);
 }
 
+static ObjString *globalName(VM *vm, size_t slot) {
+    // Only used for error messages so a linear scan is fine.
+    for (size_t idx = 0; idx < vm->globalNames.capacity; idx++) {
+        Entry *entry = &vm->globalNames.entries[idx];
+
+        if (entry->key != NULL && (size_t)AS_NUMBER(entry->value) == slot) {
+            return entry->key;
+        }
+    }
+
+    return NULL; // Unreachable
+}
+
 static Value peek(VM *vm, int distance) { return vm->stackTop[-1 - distance]; }
 
+// Forward declarations
+static void closeUpvalues(VM *vm, Value *last);
+static void closeUpvalue(VM *vm, Value *local);
+static InterpreterResult run(VM *vm, Compiler *compiler, size_t baseFrame);
+
+#ifdef CLOX_JIT
+/**
+ * @brief Runs a compiled function to completion and pops its frame, leaving the
+ * stack as if the interpreter had executed its OP_RETURN.
+ */
+static bool callCompiled(VM *vm, CallFrame *frame) {
+    vm->jitDepth += 1;
+    InterpreterResult result = jitEnter(vm, frame);
+    vm->jitDepth -= 1;
+
+    if (result != INTERPRETER_OK) {
+        return false;
+    }
+
+    // Calls made by the compiled code may have moved the frame stack
+    frame = &vm->frames[vm->frameCount - 1];
+    Value value = pop(vm);
+    closeUpvalues(vm, frame->slots);
+    vm->frameCount -= 1;
+    vm->stackTop = frame->slots;
+    push(vm, value);
+
+    return true;
+}
+#endif // CLOX_JIT
+
+/**
+ * @brief Makes room for at least `count` values above the stack top, unless that
+ * would take the stack past `vm->stackMax`.
+ *
+ * @details The stack is moved to a larger block when it has to grow, and every
+ * pointer into it is rebased: the stack top and high-water mark, the slots of every
+ * frame and the locations of open upvalues.
+ */
+static bool reserveStack(VM *vm, size_t count) {
+    size_t needed = (size_t)(vm->stackTop - vm->stack) + count;
+
+    if (needed <= vm->stackCapacity) {
+        return true;
+    }
+
+    if (needed > vm->stackMax) {
+        return false;
+    }
+
+    size_t capacity = vm->stackCapacity;
+
+    while (capacity < needed) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+
+    capacity = capacity > vm->stackMax ? vm->stackMax : capacity;
+
+    // Either allocation may run the GC, which only reads the old stack
+    Value *stack = ALLOCATE(vm, NULL, Value, capacity);
+    ObjUpvalue **upvalueSlots = GROW_ARRAY(vm, NULL, ObjUpvalue *, vm->upvalueSlots,
+                                           vm->stackCapacity, capacity);
+
+    // The table is indexed by slot number and only needs its new part cleared
+    memset((void *)(upvalueSlots + vm->stackCapacity), 0,
+           sizeof(ObjUpvalue *) * (capacity - vm->stackCapacity));
+    vm->upvalueSlots = upvalueSlots;
+
+    // Dead slots up to the high-water mark still have to be valid values
+    Value *end = vm->stackHigh > vm->stackTop ? vm->stackHigh : vm->stackTop;
+    memcpy(stack, vm->stack, sizeof(Value) * (size_t)(end - vm->stack));
+
+    for (size_t idx = 0; idx < vm->frameCount; idx++) {
+        vm->frames[idx].slots = stack + (vm->frames[idx].slots - vm->stack);
+    }
+
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL;
+         upvalue = (ObjUpvalue *)upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+
+    vm->stackTop = stack + (vm->stackTop - vm->stack);
+    vm->stackHigh = stack + (vm->stackHigh - vm->stack);
+
+    FREE_ARRAY(vm, NULL, Value, vm->stack, vm->stackCapacity);
+    vm->stack = stack;
+    vm->stackCapacity = capacity;
+    return true;
+}
+
 static bool call(VM *vm, ObjClosure *closure, uint8_t argCount) {
     if (argCount != closure->func->arity) {
         runtimeError(vm, "Expected %d arguments but got %d.", closure->func->arity,
@@ -70,14 +191,41 @@ static bool call(VM *vm, ObjClosure *closure, uint8_t argCount) {
         return false;
     }
 
-    if (vm->frameCount == FRAMES_MAX) {
+    if (vm->frameCount == vm->framesMax || !reserveStack(vm, FRAME_SLOTS)) {
         runtimeError(vm, "Stack overflow");
+        return false;
+    }
+
+    if (vm->frameCount == vm->frameCapacity) {
+        size_t capacity = GROW_CAPACITY(vm->frameCapacity);
+        capacity = capacity > vm->framesMax ? vm->framesMax : capacity;
+        vm->frames =
+            GROW_ARRAY(vm, NULL, CallFrame, vm->frames, vm->frameCapacity, capacity);
+        vm->frameCapacity = capacity;
     }
 
     CallFrame *frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
     frame->ip = closure->func->chunk.code;
     frame->slots = vm->stackTop - argCount - 1;
+    frame->pc = NULL;
+
+#ifdef CLOX_JIT
+    if (vm->jitEnabled) {
+        ObjFunction *func = closure->func;
+
+        // Only tried once, functions the JIT can't handle stay interpreted
+        if (func->jitCode == NULL && func->calls++ == vm->jitThreshold) {
+            jitCompile(vm, func);
+        }
+
+        // Past the limit the frame stays pushed for the interpreter to run, which
+        // keeps deep recursion off the C stack
+        if (func->jitCode != NULL && vm->jitDepth < JIT_MAX_DEPTH) {
+            return callCompiled(vm, frame);
+        }
+    }
+#endif // CLOX_JIT
 
     return true;
 }
@@ -92,16 +240,19 @@ static bool callValue(VM *vm, Compiler *compiler, Value callee, uint8_t argCount
             }
             case OBJ_CLASS: {
                 ObjClass *klass = AS_CLASS(callee);
-                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, compiler, klass));
 
-                Value initializer;
-                if (tableGet(&klass->methods, vm->initString, &initializer)) {
-                    return call(vm, AS_CLOSURE(initializer), argCount);
-                } else if (argCount != 0) {
-                    runtimeError(vm, "Expected 0 arguments but got %zu.", argCount);
+                if (argCount != klass->initArity) {
+                    runtimeError(vm, "Expected %d arguments but got %d.",
+                                 klass->initArity, argCount);
                     return false;
                 }
 
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, compiler, klass));
+
+                if (klass->initializer != NULL) {
+                    return call(vm, klass->initializer, argCount);
+                }
+
                 return true;
             }
             case OBJ_CLOSURE:
@@ -115,7 +266,12 @@ static bool callValue(VM *vm, Compiler *compiler, Value callee, uint8_t argCount
                     return false;
                 }
 
-                Value result = native->func(argCount, vm->stackTop - argCount);
+                Value result = NIL_VAL;
+
+                if (!native->func(vm, argCount, vm->stackTop - argCount, &result)) {
+                    return false;
+                }
+
                 vm->stackTop -= argCount + 1;
                 push(vm, result);
                 return true;
@@ -129,18 +285,63 @@ static bool callValue(VM *vm, Compiler *compiler, Value callee, uint8_t argCount
     return false;
 }
 
-static bool invokeFromClass(VM *vm, ObjClass *klass, ObjString *name, uint8_t argCount) {
-    Value method;
+/**
+ * @brief Looks up a method, going through the VM's method cache
+ *
+ * @returns the method, or NULL if the class has none of that name
+ */
+static ObjClosure *findMethod(VM *vm, ObjClass *klass, ObjString *name) {
+    uint32_t index = ((uint32_t)((uintptr_t)klass >> 4) ^ name->selector) &
+                     (METHOD_CACHE_SIZE - 1);
+    MethodCacheEntry *entry = &vm->methodCache[index];
+
+    if (entry->klass == klass && entry->name == name &&
+        entry->version == klass->version) {
+        return entry->method;
+    }
+
+    ObjClosure *method = methodTableGet(&klass->methods, name);
+
+    if (method != NULL) {
+        entry->klass = klass;
+        entry->name = name;
+        entry->method = method;
+        entry->version = klass->version;
+    }
+
+    return method;
+}
+
+/**
+ * @brief Looks up the method invoked at an OP_INVOKE and remembers it in its cache
+ *
+ * @returns the method, or NULL after reporting that the class has none of that name
+ */
+static ObjClosure *cacheMethod(VM *vm, ObjClass *klass, ObjShape *shape,
+                               ObjString *name, InvokeCache *cache) {
+    ObjClosure *method = findMethod(vm, klass, name);
 
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (method == NULL) {
         runtimeError(vm, "Undefined property '%s'.", name->chars);
-        return false;
+        return NULL;
     }
 
-    return call(vm, AS_CLOSURE(method), argCount);
+    cache->klass = klass;
+    cache->shape = shape;
+    cache->method = method;
+    cache->version = klass->version;
+
+    return method;
 }
 
-static bool invoke(VM *vm, Compiler *compiler, ObjString *name, uint8_t argCount) {
+static bool invokeFromClass(VM *vm, ObjClass *klass, ObjShape *shape, ObjString *name,
+                            uint8_t argCount, InvokeCache *cache) {
+    ObjClosure *method = cacheMethod(vm, klass, shape, name, cache);
+    return method != NULL && call(vm, method, argCount);
+}
+
+static bool invoke(VM *vm, Compiler *compiler, ObjString *name, uint8_t argCount,
+                   InvokeCache *cache) {
     Value receiver = peek(vm, argCount);
 
     if (!IS_INSTANCE(receiver)) {
@@ -151,70 +352,261 @@ static bool invoke(VM *vm, Compiler *compiler, ObjString *name, uint8_t argCount
     ObjInstance *instance = AS_INSTANCE(receiver);
     Value value;
 
-    if (tableGet(&instance->fields, name, &value)) {
+    if (instanceGetField(instance, name, &value)) {
         vm->stackTop[-argCount - 1] = value;
         return callValue(vm, compiler, value, argCount);
     }
 
-    return invokeFromClass(vm, instance->klass, name, argCount);
+    return invokeFromClass(vm, instance->klass, instance->shape, name, argCount, cache);
+}
+
+/**
+ * @brief Calls a closure with the arguments on top of the stack in place of the
+ * current frame, see tailCall
+ */
+static bool replaceFrame(VM *vm, ObjClosure *closure, uint8_t argCount) {
+    // Reported while the caller's frame is still there to show up in the trace
+    if (argCount != closure->func->arity || closure->func->usesCallerFrame) {
+        return call(vm, closure, argCount);
+    }
+
+    Value *slots = vm->frames[vm->frameCount - 1].slots;
+    Value *args = vm->stackTop - argCount - 1;
+
+    closeUpvalues(vm, slots);
+    memmove(slots, args, sizeof(Value) * (argCount + 1u));
+    vm->stackTop = slots + argCount + 1;
+    vm->frameCount -= 1;
+
+    return call(vm, closure, argCount);
+}
+
+/**
+ * @brief Calls the callee below the arguments on top of the stack in place of the
+ * current frame. Closures and bound methods take over the frame, after its upvalues
+ * are closed, with their arguments slid down to its slots. Other callees are called
+ * normally and leave the frame to return their result, as do functions reading the
+ * locals of the frame they would replace.
+ */
+static bool tailCall(VM *vm, Compiler *compiler, uint8_t argCount) {
+    Value callee = peek(vm, argCount);
+    ObjClosure *closure;
+
+    if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+    } else if (IS_BOUND_METHOD(callee)) {
+        closure = AS_BOUND_METHOD(callee)->method;
+        vm->stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+    } else {
+        return callValue(vm, compiler, callee, argCount);
+    }
+
+    return replaceFrame(vm, closure, argCount);
+}
+
+/**
+ * @brief Invokes a method in place of the current frame, as tailCall calls a callee.
+ * A field holding a function is called like any other callee.
+ */
+static bool tailInvoke(VM *vm, Compiler *compiler, ObjString *name, uint8_t argCount,
+                       InvokeCache *cache) {
+    Value receiver = peek(vm, argCount);
+
+    if (!IS_INSTANCE(receiver)) {
+        runtimeError(vm, "Only instances have methods.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    ObjClosure *method;
+    Value value;
+
+    if (cache->klass == instance->klass && cache->shape == instance->shape &&
+        cache->version == cache->klass->version) {
+        method = cache->method;
+    } else if (instanceGetField(instance, name, &value)) {
+        vm->stackTop[-argCount - 1] = value;
+        return tailCall(vm, compiler, argCount);
+    } else {
+        method = cacheMethod(vm, instance->klass, instance->shape, name, cache);
+    }
+
+    return method != NULL && replaceFrame(vm, method, argCount);
 }
 
 static bool bindMethod(VM *vm, Compiler *compiler, ObjClass *klass, ObjString *name) {
-    Value method;
+    ObjClosure *method = findMethod(vm, klass, name);
 
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (method == NULL) {
         runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
 
-    ObjBoundMethod *bound = newBoundMethod(vm, compiler, peek(vm, 0), AS_CLOSURE(method));
+    ObjBoundMethod *bound = newBoundMethod(vm, compiler, peek(vm, 0), method);
 
     pop(vm);
     push(vm, OBJ_VAL(bound));
     return true;
 }
 
-static ObjUpvalue *captureUpvalue(VM *vm, Compiler *compiler, Value *local) {
-    ObjUpvalue *prevUpvalue = NULL;
-    ObjUpvalue *upvalue = vm->openUpvalues;
-
-    while (upvalue != NULL && upvalue->location > local) {
-        prevUpvalue = upvalue;
-        upvalue = (ObjUpvalue *)upvalue->next;
+static void updatePropertyCache(PropertyCache *cache, ObjShape *shape,
+                                ObjShape *transition, uint32_t slot) {
+    // Most recently seen shape goes first, the oldest one is evicted.
+    for (size_t idx = PROPERTY_CACHE_SIZE - 1; idx > 0; idx--) {
+        cache->entries[idx] = cache->entries[idx - 1];
     }
 
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
+    cache->entries[0].shape = shape;
+    cache->entries[0].transition = transition;
+    cache->entries[0].slot = slot;
+}
+
+static bool getPropertySlow(VM *vm, Compiler *compiler, ObjInstance *instance,
+                            ObjString *name, PropertyCache *cache) {
+    uint32_t slot;
+
+    if (shapeFindSlot(instance->shape, name, &slot)) {
+        updatePropertyCache(cache, instance->shape, instance->shape, slot);
+        vm->stackTop[-1] = instance->fields[slot];
+        return true;
     }
 
-    ObjUpvalue *createdUpvalue = newUpvalue(vm, compiler, local);
-    createdUpvalue->next = (struct ObjUpvalue *)upvalue;
+    return bindMethod(vm, compiler, instance->klass, name);
+}
+
+static void setPropertySlow(VM *vm, Compiler *compiler, ObjInstance *instance,
+                            ObjString *name, PropertyCache *cache) {
+    ObjShape *shape = instance->shape;
+    uint32_t slot;
 
-    if (prevUpvalue == NULL) {
-        vm->openUpvalues = createdUpvalue;
+    if (shapeFindSlot(shape, name, &slot)) {
+        updatePropertyCache(cache, shape, shape, slot);
     } else {
-        prevUpvalue->next = (struct ObjUpvalue *)createdUpvalue;
+        ObjShape *transition = shapeTransition(vm, compiler, shape, name);
+        updatePropertyCache(cache, shape, transition, shape->slotCount);
+    }
+
+    instanceSetField(vm, compiler, instance, name, peek(vm, 0));
+}
+
+/**
+ * @brief Returns a new closure of `func`, or the closure shared by all evaluations
+ * of `func` if it has no upvalues.
+ */
+static ObjClosure *makeClosure(VM *vm, Compiler *compiler, ObjFunction *func) {
+    if (func->upvalueCount > 0) {
+        return newClosure(vm, compiler, func);
+    }
+
+    if (func->closure == NULL) {
+        func->closure = newClosure(vm, compiler, func);
+    }
+
+    return func->closure;
+}
+
+/**
+ * @brief Returns the open upvalue of a stack slot, creating it if there is none.
+ *
+ * @details Open upvalues are found through `vm->upvalueSlots` and pushed onto the
+ * front of `vm->openUpvalues`. Only the running frame captures, and the upvalues of
+ * frames above it were closed when they returned, so the list always starts with
+ * the open upvalues of the running frame, followed by those of its caller and so on.
+ */
+static ObjUpvalue *captureUpvalue(VM *vm, Compiler *compiler, Value *local) {
+    ObjUpvalue **slot = &vm->upvalueSlots[local - vm->stack];
+
+    if (*slot != NULL) {
+        return *slot;
     }
 
-    return createdUpvalue;
+    ObjUpvalue *upvalue = newUpvalue(vm, compiler, local);
+    upvalue->next = (struct ObjUpvalue *)vm->openUpvalues;
+
+    if (vm->openUpvalues != NULL) {
+        vm->openUpvalues->prev = (struct ObjUpvalue *)upvalue;
+    }
+
+    vm->openUpvalues = upvalue;
+    *slot = upvalue;
+    return upvalue;
 }
 
+/**
+ * @brief Closes the open upvalues of the running frame's slots from `last` up.
+ *
+ * @details These are at the front of `vm->openUpvalues`, so only upvalues that are
+ * actually closed are visited.
+ */
 static void closeUpvalues(VM *vm, Value *last) {
     while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
         ObjUpvalue *upvalue = vm->openUpvalues;
+        vm->upvalueSlots[upvalue->location - vm->stack] = NULL;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
         vm->openUpvalues = (ObjUpvalue *)upvalue->next;
     }
+
+    if (vm->openUpvalues != NULL) {
+        vm->openUpvalues->prev = NULL;
+    }
+}
+
+/**
+ * @brief Closes the open upvalue of a single slot, if any.
+ *
+ * @details Used when a captured local goes out of scope. Upvalues captured after it
+ * may belong to lower slots, so it is unlinked wherever it is in the list.
+ */
+static void closeUpvalue(VM *vm, Value *local) {
+    ObjUpvalue **slot = &vm->upvalueSlots[local - vm->stack];
+    ObjUpvalue *upvalue = *slot;
+
+    if (upvalue == NULL) {
+        return;
+    }
+
+    ObjUpvalue *next = (ObjUpvalue *)upvalue->next;
+    ObjUpvalue *prev = (ObjUpvalue *)upvalue->prev;
+
+    if (prev != NULL) {
+        prev->next = (struct ObjUpvalue *)next;
+    } else {
+        vm->openUpvalues = next;
+    }
+
+    if (next != NULL) {
+        next->prev = (struct ObjUpvalue *)prev;
+    }
+
+    *slot = NULL;
+    upvalue->closed = *local;
+    upvalue->location = &upvalue->closed;
 }
 
 static void defineMethod(VM *vm, Compiler *compiler, ObjString *name) {
     Value method = peek(vm, 0);
-    ObjClass *klass = AS_CLASS(method);
-    tableSet(vm, compiler, &klass->methods, name, method);
+    ObjClass *klass = AS_CLASS(peek(vm, 1));
+    stringSelector(vm, name);
+    methodTableSet(vm, compiler, &klass->methods, name, AS_CLOSURE(method));
+    klass->version += 1;
+
+    if (name == vm->initString) {
+        klass->initializer = AS_CLOSURE(method);
+        klass->initArity = klass->initializer->func->arity;
+    }
+
     pop(vm);
 }
 
+static void inheritMethods(VM *vm, Compiler *compiler, ObjClass *superclass,
+                           ObjClass *subclass) {
+    methodTableAddAll(vm, compiler, &superclass->methods, &subclass->methods);
+    subclass->version += 1;
+    subclass->initializer = superclass->initializer;
+    subclass->initArity = superclass->initArity;
+}
+
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
@@ -225,379 +617,1905 @@ static void concatenate(VM *vm, Compiler *compiler) {
     // isn't swept if the GC is triggered by allocating memory
     // for the destination string.
     ObjString *b = AS_STRING(peek(vm, 0));
-    ObjString *a = AS_STRING(peek(vm, 0));
-
-    size_t length = a->length + b->length;
-    char *chars = ALLOCATE(vm, compiler, char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    ObjString *a = AS_STRING(peek(vm, 1));
+    ObjString *string = concatenateStrings(vm, compiler, a, b);
 
-    ObjString *string = takeString(vm, compiler, length, chars);
     // Popped here once allocation is successful.
     pop(vm);
     pop(vm);
     push(vm, OBJ_VAL(string));
 }
 
-static Value clockNative(size_t argCount, Value *args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+/**
+ * @brief Checks if a value is a rope which hasn't been joined yet
+ */
+static inline bool isRope(Value value) {
+    return IS_STRING(value) && AS_STRING(value)->right != NULL;
 }
 
-void initVM(VM *vm) {
-    resetStack(vm);
-    vm->objects = NULL;
-    vm->bytesAllocated = 0;
-    vm->nextGC = 1024 * 1024;
+/**
+ * @brief Replaces a rope by its joined string where it is stored. The value has to
+ * be reachable by the GC.
+ */
+static void flattenRope(VM *vm, Compiler *compiler, Value *value) {
+    if (isRope(*value)) {
+        *value = OBJ_VAL(flattenString(vm, compiler, AS_STRING(*value)));
+    }
+}
 
-    vm->greyCount = 0;
-    vm->greyCapacity = 0;
-    vm->greyStack = NULL;
+/**
+ * @brief Checks if two values are strings which aren't both interned, which
+ * `valuesEqual()` can't compare by identity
+ */
+static inline bool needsStringsEqual(Value a, Value b) {
+    return IS_STRING(a) && IS_STRING(b) &&
+           !(AS_STRING(a)->interned && AS_STRING(b)->interned);
+}
 
-    initTable(&vm->globals);
-    initTable(&vm->strings);
+/**
+ * @brief Compares two strings reachable by the GC which aren't both interned.
+ *
+ * @details Ropes only compare by their characters once joined, so they are flattened
+ * first. A string compared for the first time, which is when its hash is still 0,
+ * with an interned one is interned as well if it can be, so that comparing it again
+ * only compares identities. Strings equal to one that is already interned keep
+ * comparing by their hashes and characters.
+ */
+static bool runtimeStringsEqual(VM *vm, Compiler *compiler, Value *a, Value *b) {
+    if (isRope(*a) || isRope(*b)) {
+        if (AS_STRING(*a)->length != AS_STRING(*b)->length) {
+            return false;
+        }
 
-    vm->initString = NULL;
-    vm->initString = copyString(vm, NULL, 4, "init");
+        flattenRope(vm, compiler, a);
+        flattenRope(vm, compiler, b);
+    }
 
-    defineNative(vm, NULL, "clock", clockNative, 0);
-}
+    ObjString *aString = AS_STRING(*a);
+    ObjString *bString = AS_STRING(*b);
 
-void freeVM(VM *vm, Compiler *compiler) {
-    freeTable(vm, compiler, &vm->globals);
-    freeTable(vm, compiler, &vm->strings);
+    if (aString->interned && bString->hash == 0) {
+        return internRuntimeString(vm, compiler, bString) == aString;
+    }
 
-    vm->initString = NULL;
+    if (bString->interned && aString->hash == 0) {
+        return internRuntimeString(vm, compiler, aString) == bString;
+    }
 
-    freeObjects(vm, compiler);
+    return aString == bString || stringsEqual(aString, bString);
 }
 
-static InterpreterResult run(VM *vm, Compiler *compiler) {
-    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+static bool clockNative(VM *vm, size_t argCount, Value *args, Value *result) {
+    (void)vm;
+    (void)argCount;
+    (void)args;
 
-#define READ_BYTE() (*frame->ip++)
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
 
-#define READ_CONSTANT() ((frame)->closure->func->chunk.constants.values[READ_BYTE()])
+/**
+ * @brief Checks that a native's argument is a string, joining it if it is a rope.
+ */
+static bool stringArg(VM *vm, Value *arg, const char *native, ObjString **string) {
+    if (!IS_STRING(*arg)) {
+        runtimeError(vm, "Argument to %s() must be a string.", native);
+        return false;
+    }
 
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    flattenRope(vm, NULL, arg);
+    *string = AS_STRING(*arg);
+    return true;
+}
 
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+/**
+ * @brief Checks that a native's argument is a whole number, clamped to lie between
+ * 0 and `max`. Out of range indices are not errors, which lets scripts slice without
+ * checking lengths first.
+ */
+static bool indexArg(VM *vm, Value arg, const char *native, size_t max, size_t *index) {
+    if (!IS_NUMBER(arg)) {
+        runtimeError(vm, "Argument to %s() must be a number.", native);
+        return false;
+    }
 
-#define BINARY_OP(valueType, op)                                                         \
-    do {                                                                                 \
-        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {                        \
-            runtimeError(vm, "Operands must be numbers.");                               \
-            return INTERPRETER_RUNTIME_ERR;                                              \
-        }                                                                                \
-        double b = AS_NUMBER(pop(vm));                                                   \
-        double a = AS_NUMBER(pop(vm));                                                   \
-        push(vm, valueType(a op b));                                                     \
-    } while (false)
+    double number = AS_NUMBER(arg);
 
-    for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
+    // Numbers too large to convert exactly are whole, and clamped anyway
+    bool whole = number <= -0x1p53 || number >= 0x1p53 ||
+                 (number == number && number == (double)(int64_t)number);
 
-        disassembleInstruction(&frame->closure->func->chunk,
-                               (size_t)(frame->ip - frame->closure->func->chunk.code));
-#endif
+    if (!whole) {
+        runtimeError(vm, "Argument to %s() must be a whole number.", native);
+        return false;
+    }
 
-        uint8_t instruction;
-
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(vm, constant);
-                break;
-            }
-            case OP_NIL:
-                push(vm, NIL_VAL);
-                break;
-            case OP_TRUE:
-                push(vm, BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(vm, BOOL_VAL(false));
-                break;
-            case OP_POP:
-                pop(vm);
-                break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(vm, frame->slots[slot]);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-
-                if (!tableGet(&vm->globals, name, &value)) {
-                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
-                    return INTERPRETER_RUNTIME_ERR;
-                }
+    *index = number < 0 ? 0 : number > (double)max ? max : (size_t)number;
+    return true;
+}
 
-                push(vm, value);
-                break;
-            }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(vm, compiler, &vm->globals, name, peek(vm, 0));
-                pop(vm);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(vm, 0);
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
+/**
+ * @brief Finds `needle` in `haystack` from `from` on, returning its start or
+ * `haystack->length` if it doesn't occur.
+ */
+static size_t findString(ObjString *haystack, ObjString *needle, size_t from) {
+    const char *chars = stringChars(haystack);
+    const char *find = stringChars(needle);
 
-                if (tableSet(vm, compiler, &vm->globals, name, peek(vm, 0))) {
-                    tableDelete(&vm->globals, name);
-                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
-                    return INTERPRETER_RUNTIME_ERR;
-                }
+    if (needle->length == 0) {
+        return from;
+    }
 
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(vm, *frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(vm, 0);
-                break;
-            }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(vm, 0))) {
-                    runtimeError(vm, "Only instances have properties.");
-                    return INTERPRETER_RUNTIME_ERR;
-                }
+    for (size_t i = from; i + needle->length <= haystack->length; i++) {
+        const char *start = memchr(chars + i, find[0], haystack->length - i);
 
-                ObjInstance *instance = AS_INSTANCE(peek(vm, 0));
-                ObjString *name = READ_STRING();
+        if (start == NULL) {
+            break;
+        }
 
-                Value value;
+        i = (size_t)(start - chars);
 
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(vm);
-                    push(vm, value);
-                    break;
-                }
+        if (i + needle->length <= haystack->length &&
+            memcmp(start, find, needle->length) == 0) {
+            return i;
+        }
+    }
 
-                if (!bindMethod(vm, compiler, instance->klass, name)) {
-                    return INTERPRETER_RUNTIME_ERR;
-                }
+    return haystack->length;
+}
 
-                break;
-            }
-            case OP_SET_PROPERTY: {
+/**
+ * @brief substr(string, start, length) returns up to `length` characters of a
+ * string from `start` on. The result shares the characters of the string.
+ *
+ * @details `start` and `length` are clamped: a negative one counts as 0, a start
+ * past the end gives an empty string and the length is cut to what is left.
+ */
+static bool substrNative(VM *vm, size_t argCount, Value *args, Value *result) {
+    (void)argCount;
+
+    ObjString *string;
+    size_t start;
+    size_t length;
+
+    if (!stringArg(vm, &args[0], "substr", &string) ||
+        !indexArg(vm, args[1], "substr", string->length, &start) ||
+        !indexArg(vm, args[2], "substr", string->length - start, &length)) {
+        return false;
+    }
 
-                if (!IS_INSTANCE(peek(vm, 1))) {
-                    runtimeError(vm, "Only instances have fields.");
-                    return INTERPRETER_RUNTIME_ERR;
-                }
+    *result = OBJ_VAL(newStringView(vm, NULL, string, start, length));
+    return true;
+}
 
-                ObjInstance *instance = AS_INSTANCE(peek(vm, 1));
-                tableSet(vm, compiler, &instance->fields, READ_STRING(), peek(vm, 0));
+/**
+ * @brief indexOf(string, needle, from) returns where `needle` first occurs in a
+ * string from `from` on, or -1. `from` is clamped to lie within the string.
+ */
+static bool indexOfNative(VM *vm, size_t argCount, Value *args, Value *result) {
+    (void)argCount;
 
-                Value value = pop(vm);
-                pop(vm);
-                push(vm, value);
+    ObjString *string;
+    ObjString *needle;
+    size_t from;
 
-                break;
-            }
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop(vm));
+    if (!stringArg(vm, &args[0], "indexOf", &string) ||
+        !stringArg(vm, &args[1], "indexOf", &needle) ||
+        !indexArg(vm, args[2], "indexOf", string->length, &from)) {
+        return false;
+    }
 
-                if (!bindMethod(vm, compiler, superclass, name)) {
-                    return INTERPRETER_RUNTIME_ERR;
-                }
+    size_t index = findString(string, needle, from);
+    *result = intResult(index + needle->length <= string->length ? (int64_t)index : -1);
+    return true;
+}
 
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = pop(vm);
-                Value a = pop(vm);
-                push(vm, BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            case OP_ADD: {
-                if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
-                    concatenate(vm, compiler);
-                } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
-                    double b = AS_NUMBER(pop(vm));
-                    double a = AS_NUMBER(pop(vm));
-                    push(vm, NUMBER_VAL(a + b));
-                } else {
-                    runtimeError(vm, "Operands must be two numbers or two strings.");
-                    return INTERPRETER_RUNTIME_ERR;
-                }
-                break;
-            }
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_NOT:
-                push(vm, BOOL_VAL(isFalsey(pop(vm))));
-                break;
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(vm, 0))) {
-                    runtimeError(vm, "Operand must be a number.");
-                    return INTERPRETER_RUNTIME_ERR;
-                }
-                push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
-                break;
-            }
-            case OP_PRINT: {
-                printValue(pop(vm));
-                printf("\n");
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
+/**
+ * @brief split(string, separator, index) returns field `index` of a string split
+ * at every occurrence of `separator`, or nil if it has fewer fields. A negative
+ * index counts as 0. The result shares the characters of the string.
+ */
+static bool splitNative(VM *vm, size_t argCount, Value *args, Value *result) {
+    (void)argCount;
+
+    ObjString *string;
+    ObjString *separator;
+    size_t index;
+
+    if (!stringArg(vm, &args[0], "split", &string) ||
+        !stringArg(vm, &args[1], "split", &separator) ||
+        !indexArg(vm, args[2], "split", SIZE_MAX, &index)) {
+        return false;
+    }
 
-                if (isFalsey(peek(vm, 0))) {
-                    frame->ip += offset;
-                }
+    if (separator->length == 0) {
+        runtimeError(vm, "Separator passed to split() can't be empty.");
+        return false;
+    }
 
-                break;
-            }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
-            }
-            case OP_CALL: {
-                uint8_t argCount = READ_BYTE();
+    size_t start = 0;
 
-                if (!callValue(vm, compiler, peek(vm, argCount), argCount)) {
-                    return INTERPRETER_RUNTIME_ERR;
-                }
+    for (; index > 0; index--) {
+        size_t end = findString(string, separator, start);
 
-                frame = &vm->frames[vm->frameCount - 1];
-                break;
-            }
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
-                uint8_t argCount = READ_BYTE();
+        if (end == string->length) {
+            *result = NIL_VAL;
+            return true;
+        }
 
-                if (!invoke(vm, compiler, method, argCount)) {
-                    return INTERPRETER_RUNTIME_ERR;
-                }
+        start = end + separator->length;
+    }
 
-                frame = &vm->frames[vm->frameCount - 1];
-                break;
-            }
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
-                uint8_t argCount = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop(vm));
+    size_t end = findString(string, separator, start);
+    *result = OBJ_VAL(newStringView(vm, NULL, string, start, end - start));
+    return true;
+}
 
-                if (!invokeFromClass(vm, superclass, method, argCount)) {
-                    return INTERPRETER_RUNTIME_ERR;
-                }
+void initVM(VM *vm) {
+    vm->objects = NULL;
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
 
-                frame = &vm->frames[vm->frameCount - 1];
-                break;
-            }
-            case OP_CLOSURE: {
-                ObjFunction *func = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(vm, compiler, func);
-                push(vm, OBJ_VAL(closure));
+    vm->greyCount = 0;
+    vm->greyCapacity = 0;
+    vm->greyStack = NULL;
+    memset(&vm->gcStats, 0, sizeof(vm->gcStats));
 
-                for (size_t idx = 0; idx < closure->upvalueCount; idx++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
+    // The GC may run while the stacks are allocated, so it has to find them empty
+    vm->frames = NULL;
+    vm->frameCapacity = 0;
+    vm->framesMax = FRAMES_MAX;
 
-                    if (isLocal) {
-                        closure->upvalues[idx] =
-                            captureUpvalue(vm, compiler, frame->slots + index);
-                    } else {
-                        closure->upvalues[idx] = frame->closure->upvalues[index];
-                    }
-                }
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    vm->stackMax = STACK_MAX;
+    vm->upvalueSlots = NULL;
+    vm->openUpvalues = NULL;
+    resetStack(vm);
 
-                break;
-            }
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm, vm->stackTop - 1);
-                pop(vm);
-                break;
-            case OP_RETURN: {
-                Value result = pop(vm);
-                closeUpvalues(vm, frame->slots);
-                vm->frameCount -= 1;
+    initTable(&vm->globalNames);
+    initValueArray(&vm->globalValues);
+    initStringSet(&vm->strings);
+    vm->initString = NULL;
+    vm->emptyShape = NULL;
+    vm->methodCache = NULL;
 
-                if (vm->frameCount == 0) {
-                    pop(vm);
+    vm->stack = ALLOCATE(vm, NULL, Value, STACK_INITIAL);
+    vm->upvalueSlots = ALLOCATE(vm, NULL, ObjUpvalue *, STACK_INITIAL);
+    memset((void *)vm->upvalueSlots, 0, sizeof(ObjUpvalue *) * STACK_INITIAL);
+    vm->stackCapacity = STACK_INITIAL;
+    resetStack(vm);
+
+    vm->optimizeLevel = OPTIMIZE_DEFAULT_LEVEL;
+    vm->engine = ENGINE_STACK;
+
+#ifdef CLOX_JIT
+    vm->jitEnabled = true;
+#else
+    vm->jitEnabled = false;
+#endif // CLOX_JIT
+    vm->jitThreshold = JIT_DEFAULT_THRESHOLD;
+    vm->jitDepth = 0;
+    memset(&vm->jitStats, 0, sizeof(vm->jitStats));
+
+    vm->selectorCount = 0;
+    vm->methodCache = ALLOCATE(vm, NULL, MethodCacheEntry, METHOD_CACHE_SIZE);
+    memset(vm->methodCache, 0, sizeof(MethodCacheEntry) * METHOD_CACHE_SIZE);
+
+    vm->initString = copyString(vm, NULL, 4, "init");
+    stringSelector(vm, vm->initString);
+    vm->emptyShape = newShape(vm, NULL, NULL, NULL);
+
+    defineNative(vm, NULL, "clock", clockNative, 0);
+    defineNative(vm, NULL, "substr", substrNative, 3);
+    defineNative(vm, NULL, "indexOf", indexOfNative, 3);
+    defineNative(vm, NULL, "split", splitNative, 3);
+}
+
+void freeVM(VM *vm, Compiler *compiler) {
+    freeTable(vm, compiler, &vm->globalNames);
+    freeValueArray(vm, compiler, &vm->globalValues);
+    freeStringSet(vm, compiler, &vm->strings);
+
+    vm->initString = NULL;
+    vm->emptyShape = NULL;
+
+    freeObjects(vm, compiler);
+
+    FREE_ARRAY(vm, compiler, MethodCacheEntry, vm->methodCache, METHOD_CACHE_SIZE);
+    FREE_ARRAY(vm, compiler, CallFrame, vm->frames, vm->frameCapacity);
+    FREE_ARRAY(vm, compiler, Value, vm->stack, vm->stackCapacity);
+    FREE_ARRAY(vm, compiler, ObjUpvalue *, vm->upvalueSlots, vm->stackCapacity);
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(VM *vm, Value *stackTop, Chunk *chunk, uint8_t *ip) {
+    printf("          ");
+    for (Value *slot = vm->stack; slot < stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+
+    disassembleInstruction(chunk, (size_t)(ip - chunk->code));
+}
+
+#define TRACE_EXECUTION()                                                                \
+    traceExecution(vm, stackTop, &frame->closure->func->chunk, ip)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif // DEBUG_TRACE_EXECUTION
+
+// Labels-as-values is a GNU extension
+#if defined(CLOX_COMPUTED_GOTO) && defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+size_t resolveGlobal(VM *vm, Compiler *compiler, ObjString *name) {
+    Value slot;
+
+    if (tableGet(&vm->globalNames, name, &slot)) {
+        return (size_t)AS_NUMBER(slot);
+    }
+
+    // Push-pop of value is done so that value is reachable
+    // by VM and thus isn't swept if the GC is triggered by
+    // `writeValueArray' or `tableSet'.
+    push(vm, OBJ_VAL(name));
+    writeValueArray(vm, compiler, &vm->globalValues, UNDEFINED_VAL);
+    tableSet(vm, compiler, &vm->globalNames, name,
+             NUMBER_VAL((double)(vm->globalValues.count - 1)));
+    pop(vm);
+
+    return vm->globalValues.count - 1;
+}
+
+/**
+ * @brief Interprets from the current frame until the frame at index `baseFrame`
+ * returns. Nested runs started by compiled code leave the returned value on the
+ * stack, the outermost run pops the script closure.
+ */
+static InterpreterResult run(VM *vm, Compiler *compiler, size_t baseFrame) {
+    // The hot interpreter state is kept in locals so the compiler can hold it in
+    // registers. It is only written back to the current CallFrame and VM before
+    // anything that can observe it, ie. calls, returns, allocations (which may
+    // trigger the GC) and runtime errors.
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *slots;
+    Value *constants;
+    Value *stackTop;
+
+    // Global slots are only reserved while compiling so the array cannot move
+    // while the interpreter runs.
+    Value *globals = vm->globalValues.values;
+
+#define STORE_FRAME()                                                                    \
+    do {                                                                                 \
+        frame->ip = ip;                                                                  \
+        vm->stackTop = stackTop;                                                         \
+    } while (false)
+
+#define LOAD_FRAME()                                                                     \
+    do {                                                                                 \
+        frame = &vm->frames[vm->frameCount - 1];                                         \
+        ip = frame->ip;                                                                  \
+        slots = frame->slots;                                                            \
+        constants = frame->closure->func->chunk.constants.values;                        \
+        stackTop = vm->stackTop;                                                         \
+    } while (false)
+
+#define PUSH(value) (*stackTop++ = (value))
+
+#define POP() (*--stackTop)
+
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+
+#define READ_CONSTANT() (constants[READ_BYTE()])
+
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+
+#define READ_PROPERTY_CACHE() (&frame->closure->func->chunk.propertyCaches[READ_SHORT()])
+
+#define READ_INVOKE_CACHE() (&frame->closure->func->chunk.invokeCaches[READ_SHORT()])
+
+#define RUNTIME_ERROR(...)                                                               \
+    do {                                                                                 \
+        frame->ip = ip;                                                                  \
+        runtimeError(vm, __VA_ARGS__);                                                   \
+        return INTERPRETER_RUNTIME_ERR;                                                  \
+    } while (false)
+
+// Rewrites the instruction currently executing. Only valid for instructions
+// without operands since `ip' has already moved past the opcode.
+#define QUICKEN(opcode) (ip[-1] = (opcode))
+
+// Rewrites a specialized instruction back to its generic form and executes that
+// instead.
+#define DEOPTIMIZE(opcode)                                                               \
+    do {                                                                                 \
+        QUICKEN(opcode);                                                                 \
+        ip -= 1;                                                                         \
+        DISPATCH();                                                                      \
+    } while (false)
+
+// Replaces the two operands on top of the stack by `intResult' if both are integers
+// and by `numberResult' if both are numbers, with `a' and `b' bound to the operands.
+// Otherwise runs `otherwise', which must leave the instruction.
+#define NUMBER_OPERATION(intResult, numberResult, otherwise)                             \
+    do {                                                                                 \
+        Value left = PEEK(1);                                                            \
+        Value right = PEEK(0);                                                           \
+                                                                                         \
+        if (ARE_INTS(left, right)) {                                                     \
+            int32_t a = AS_INT(left);                                                    \
+            int32_t b = AS_INT(right);                                                   \
+            PEEK(1) = (intResult);                                                       \
+        } else if (ARE_DOUBLES(left, right)) {                                           \
+            double a = AS_DOUBLE(left);                                                  \
+            double b = AS_DOUBLE(right);                                                 \
+            PEEK(1) = (numberResult);                                                    \
+        } else if (IS_NUMBER(left) && IS_NUMBER(right)) {                                \
+            double a = AS_NUMBER(left);                                                  \
+            double b = AS_NUMBER(right);                                                 \
+            PEEK(1) = (numberResult);                                                    \
+        } else {                                                                         \
+            otherwise;                                                                   \
+        }                                                                                \
+                                                                                         \
+        stackTop--;                                                                      \
+    } while (false)
+
+#define BINARY_OP(valueType, op, quickened)                                              \
+    do {                                                                                 \
+        QUICKEN(quickened);                                                              \
+        NUMBER_OPERATION(valueType(a op b), valueType(a op b),                           \
+                         RUNTIME_ERROR("Operands must be numbers."));                    \
+    } while (false)
+
+#define NUMBER_OP(valueType, op, generic)                                                \
+    NUMBER_OPERATION(valueType(a op b), valueType(a op b), DEOPTIMIZE(generic))
+
+#define ARITHMETIC_OP(intOp, op, quickened)                                              \
+    do {                                                                                 \
+        QUICKEN(quickened);                                                              \
+        NUMBER_OPERATION(intOp(a, b), NUMBER_VAL(a op b),                                \
+                         RUNTIME_ERROR("Operands must be numbers."));                    \
+    } while (false)
+
+#define NUMBER_ARITHMETIC_OP(intOp, op, generic)                                         \
+    NUMBER_OPERATION(intOp(a, b), NUMBER_VAL(a op b), DEOPTIMIZE(generic))
+
+// Boxes the inverse of a comparison for the negated comparison instructions
+#define NOT_BOOL_VAL(cond) BOOL_VAL(!(cond))
+
+// The GC may run while ropes are flattened, so the operands stay on the stack
+#define EQUALITY_OP(valueType)                                                           \
+    do {                                                                                 \
+        bool equal;                                                                      \
+                                                                                         \
+        if (needsStringsEqual(PEEK(1), PEEK(0))) {                                       \
+            STORE_FRAME();                                                               \
+            equal = runtimeStringsEqual(vm, compiler, &PEEK(1), &PEEK(0));               \
+        } else {                                                                         \
+            equal = valuesEqual(PEEK(1), PEEK(0));                                       \
+        }                                                                                \
+                                                                                         \
+        (void)POP();                                                                     \
+        PEEK(0) = valueType(equal);                                                      \
+    } while (false)
+
+#define GET_PROPERTY()                                                                   \
+    do {                                                                                 \
+        ObjString *name = READ_STRING();                                                 \
+        PropertyCache *cache = READ_PROPERTY_CACHE();                                    \
+                                                                                         \
+        if (!IS_INSTANCE(PEEK(0))) {                                                     \
+            RUNTIME_ERROR("Only instances have properties.");                            \
+        }                                                                                \
+                                                                                         \
+        ObjInstance *instance = AS_INSTANCE(PEEK(0));                                    \
+                                                                                         \
+        for (size_t idx = 0; idx < PROPERTY_CACHE_SIZE; idx++) {                         \
+            if (cache->entries[idx].shape == instance->shape) {                          \
+                PEEK(0) = instance->fields[cache->entries[idx].slot];                    \
+                DISPATCH();                                                              \
+            }                                                                            \
+        }                                                                                \
+                                                                                         \
+        STORE_FRAME();                                                                   \
+                                                                                         \
+        if (!getPropertySlow(vm, compiler, instance, name, cache)) {                     \
+            return INTERPRETER_RUNTIME_ERR;                                              \
+        }                                                                                \
+                                                                                         \
+        stackTop = vm->stackTop;                                                         \
+    } while (false)
+
+#ifdef CLOX_COMPUTED_GOTO
+    static void *dispatchTable[] = {
+        [OP_CONSTANT] = &&label_OP_CONSTANT,
+        [OP_NIL] = &&label_OP_NIL,
+        [OP_TRUE] = &&label_OP_TRUE,
+        [OP_FALSE] = &&label_OP_FALSE,
+        [OP_POP] = &&label_OP_POP,
+        [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+        [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+        [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+        [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+        [OP_GET_ENCLOSING] = &&label_OP_GET_ENCLOSING,
+        [OP_SET_ENCLOSING] = &&label_OP_SET_ENCLOSING,
+        [OP_GET_PROPERTY] = &&label_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&label_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&label_OP_GET_SUPER,
+        [OP_EQUAL] = &&label_OP_EQUAL,
+        [OP_GREATER] = &&label_OP_GREATER,
+        [OP_LESS] = &&label_OP_LESS,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+        [OP_DIVIDE] = &&label_OP_DIVIDE,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_NEGATE] = &&label_OP_NEGATE,
+        [OP_PRINT] = &&label_OP_PRINT,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&label_OP_LOOP,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+        [OP_INVOKE] = &&label_OP_INVOKE,
+        [OP_TAIL_INVOKE] = &&label_OP_TAIL_INVOKE,
+        [OP_SUPER_INVOKE] = &&label_OP_SUPER_INVOKE,
+        [OP_CLOSURE] = &&label_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&label_OP_RETURN,
+        [OP_CLASS] = &&label_OP_CLASS,
+        [OP_INHERIT] = &&label_OP_INHERIT,
+        [OP_METHOD] = &&label_OP_METHOD,
+        [OP_NOT_EQUAL] = &&label_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&label_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&label_OP_LESS_EQUAL,
+        [OP_GET_LOCAL_CONSTANT] = &&label_OP_GET_LOCAL_CONSTANT,
+        [OP_GET_LOCAL_GET_LOCAL] = &&label_OP_GET_LOCAL_GET_LOCAL,
+        [OP_GET_LOCAL_PROPERTY] = &&label_OP_GET_LOCAL_PROPERTY,
+        [OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&label_OP_SET_GLOBAL_POP,
+        [OP_POP_JUMP_IF_FALSE] = &&label_OP_POP_JUMP_IF_FALSE,
+        [OP_GREATER_NUMBER] = &&label_OP_GREATER_NUMBER,
+        [OP_GREATER_EQUAL_NUMBER] = &&label_OP_GREATER_EQUAL_NUMBER,
+        [OP_LESS_NUMBER] = &&label_OP_LESS_NUMBER,
+        [OP_LESS_EQUAL_NUMBER] = &&label_OP_LESS_EQUAL_NUMBER,
+        [OP_ADD_NUMBER] = &&label_OP_ADD_NUMBER,
+        [OP_ADD_STRING] = &&label_OP_ADD_STRING,
+        [OP_SUBTRACT_NUMBER] = &&label_OP_SUBTRACT_NUMBER,
+        [OP_MULTIPLY_NUMBER] = &&label_OP_MULTIPLY_NUMBER,
+        [OP_DIVIDE_NUMBER] = &&label_OP_DIVIDE_NUMBER,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(opcode) label_##opcode
+#define DISPATCH()                                                                       \
+    do {                                                                                 \
+        TRACE_EXECUTION();                                                               \
+        goto *dispatchTable[READ_BYTE()];                                                \
+    } while (false)
+#else
+#define INTERPRET_LOOP                                                                   \
+    loop:                                                                                \
+    TRACE_EXECUTION();                                                                   \
+    switch (READ_BYTE())
+#define CASE(opcode) case opcode
+#define DISPATCH() goto loop
+#endif // CLOX_COMPUTED_GOTO
+
+    LOAD_FRAME();
+
+    INTERPRET_LOOP {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL):
+            PUSH(NIL_VAL);
+            DISPATCH();
+        CASE(OP_TRUE):
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
+        CASE(OP_FALSE):
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
+        CASE(OP_POP):
+            (void)POP();
+            DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_CONSTANT): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            PUSH(READ_CONSTANT());
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_GET_LOCAL): {
+            uint8_t first = READ_BYTE();
+            uint8_t second = READ_BYTE();
+            PUSH(slots[first]);
+            PUSH(slots[second]);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = globals[slot];
 
-                    // Exit interpreter
-                    return INTERPRETER_OK;
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, slot)->chars);
+            }
+
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            globals[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+
+            if (IS_UNDEFINED(globals[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, slot)->chars);
+            }
+
+            globals[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_POP): {
+            uint16_t slot = READ_SHORT();
+
+            if (IS_UNDEFINED(globals[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, slot)->chars);
+            }
+
+            globals[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            *frame->closure->upvalues[slot]->location = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_ENCLOSING): {
+            uint8_t slot = READ_BYTE();
+            PUSH(frame[-1].slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_ENCLOSING): {
+            uint8_t slot = READ_BYTE();
+            frame[-1].slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY):
+            GET_PROPERTY();
+            DISPATCH();
+        CASE(OP_GET_LOCAL_PROPERTY): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            GET_PROPERTY();
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): {
+            ObjString *name = READ_STRING();
+            PropertyCache *cache = READ_PROPERTY_CACHE();
+
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERROR("Only instances have fields.");
+            }
+
+            ObjInstance *instance = AS_INSTANCE(PEEK(1));
+            PropertyCacheEntry *entry = NULL;
+
+            for (size_t idx = 0; idx < PROPERTY_CACHE_SIZE; idx++) {
+                if (cache->entries[idx].shape == instance->shape) {
+                    entry = &cache->entries[idx];
+                    break;
+                }
+            }
+
+            if (entry == NULL) {
+                STORE_FRAME();
+                setPropertySlow(vm, compiler, instance, name, cache);
+            } else {
+                if (entry->slot >= instance->fieldCapacity) {
+                    STORE_FRAME();
+                    instanceEnsureSlot(vm, compiler, instance, entry->slot);
                 }
 
-                vm->stackTop = frame->slots;
-                push(vm, result);
-                frame = &vm->frames[vm->frameCount - 1];
-                break;
+                instance->fields[entry->slot] = PEEK(0);
+                instance->shape = entry->transition;
+            }
+
+            Value value = POP();
+            PEEK(0) = value;
+
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER): {
+            ObjString *name = READ_STRING();
+            ObjClass *superclass = AS_CLASS(POP());
+            STORE_FRAME();
+
+            if (!bindMethod(vm, compiler, superclass, name)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL):
+            EQUALITY_OP(BOOL_VAL);
+            DISPATCH();
+        CASE(OP_GREATER):
+            BINARY_OP(BOOL_VAL, >, OP_GREATER_NUMBER);
+            DISPATCH();
+        CASE(OP_GREATER_NUMBER):
+            NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+            DISPATCH();
+        CASE(OP_LESS):
+            BINARY_OP(BOOL_VAL, <, OP_LESS_NUMBER);
+            DISPATCH();
+        CASE(OP_LESS_NUMBER):
+            NUMBER_OP(BOOL_VAL, <, OP_LESS);
+            DISPATCH();
+        CASE(OP_NOT_EQUAL):
+            EQUALITY_OP(NOT_BOOL_VAL);
+            DISPATCH();
+        CASE(OP_GREATER_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL_NUMBER);
+            DISPATCH();
+        CASE(OP_GREATER_EQUAL_NUMBER):
+            NUMBER_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL);
+            DISPATCH();
+        CASE(OP_LESS_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL_NUMBER);
+            DISPATCH();
+        CASE(OP_LESS_EQUAL_NUMBER):
+            NUMBER_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL);
+            DISPATCH();
+        CASE(OP_ADD): {
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                ARITHMETIC_OP(intAdd, +, OP_ADD_NUMBER);
+            } else if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                QUICKEN(OP_ADD_STRING);
+                STORE_FRAME();
+                concatenate(vm, compiler);
+                stackTop = vm->stackTop;
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUMBER):
+            NUMBER_ARITHMETIC_OP(intAdd, +, OP_ADD);
+            DISPATCH();
+        CASE(OP_ADD_STRING): {
+            if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+                DEOPTIMIZE(OP_ADD);
+            }
+            STORE_FRAME();
+            concatenate(vm, compiler);
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT):
+            ARITHMETIC_OP(intSubtract, -, OP_SUBTRACT_NUMBER);
+            DISPATCH();
+        CASE(OP_SUBTRACT_NUMBER):
+            NUMBER_ARITHMETIC_OP(intSubtract, -, OP_SUBTRACT);
+            DISPATCH();
+        CASE(OP_MULTIPLY):
+            ARITHMETIC_OP(intMultiply, *, OP_MULTIPLY_NUMBER);
+            DISPATCH();
+        CASE(OP_MULTIPLY_NUMBER):
+            NUMBER_ARITHMETIC_OP(intMultiply, *, OP_MULTIPLY);
+            DISPATCH();
+        CASE(OP_DIVIDE):
+            ARITHMETIC_OP(intDivide, /, OP_DIVIDE_NUMBER);
+            DISPATCH();
+        CASE(OP_DIVIDE_NUMBER):
+            NUMBER_ARITHMETIC_OP(intDivide, /, OP_DIVIDE);
+            DISPATCH();
+        CASE(OP_NOT):
+            PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+            DISPATCH();
+        CASE(OP_NEGATE): {
+            if (IS_INT(PEEK(0))) {
+                PEEK(0) = intNegate(AS_INT(PEEK(0)));
+                DISPATCH();
+            }
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        }
+        CASE(OP_PRINT): {
+            if (isRope(PEEK(0))) {
+                STORE_FRAME();
+                flattenRope(vm, compiler, &PEEK(0));
             }
-            case OP_CLASS:
-                push(vm, OBJ_VAL(newClass(vm, compiler, READ_STRING())));
-                break;
-            case OP_INHERIT: {
-                Value superclass = peek(vm, 1);
 
-                if (!IS_CLASS(superclass)) {
-                    runtimeError(vm, "Superclass must be a class.");
+            printValue(POP());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+
+            if (isFalsey(PEEK(0))) {
+                ip += offset;
+            }
+
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+
+            if (isFalsey(POP())) {
+                ip += offset;
+            }
+
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            uint16_t index = READ_SHORT();
+            ip -= offset;
+
+#ifdef CLOX_JIT
+            if (vm->jitEnabled) {
+                LoopCache *loop = &frame->closure->func->chunk.loopCaches[index];
+
+                if (loop->trace != NULL) {
+                    STORE_FRAME();
+
+                    // A variable no longer holds the kind of number it was recorded
+                    // with, such as an integer which has since become a double
+                    if (jitEnterTrace(vm, frame, loop->trace) < 0) {
+                        traceFree(vm, NULL, loop->trace);
+                        loop->trace = NULL;
+
+                        if (++loop->aborts < TRACE_MAX_ABORTS) {
+                            loop->hotness = 0;
+                        }
+                    }
+
+                    ip = frame->ip;
+                    stackTop = vm->stackTop;
+                } else if (++loop->hotness == TRACE_HOT_LOOP) {
+                    STORE_FRAME();
+                    traceRecord(vm, frame, loop);
+                    ip = frame->ip;
+                    stackTop = vm->stackTop;
+                }
+            }
+#else
+            (void)index;
+#endif // CLOX_JIT
+
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            uint8_t argCount = READ_BYTE();
+            STORE_FRAME();
+
+            if (!callValue(vm, compiler, PEEK(argCount), argCount)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
+            uint8_t argCount = READ_BYTE();
+            STORE_FRAME();
+
+            if (!tailCall(vm, compiler, argCount)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            // Compiled code runs the new frame to completion and pops it, which
+            // returns from the frame this loop was started for
+            if (vm->frameCount == baseFrame) {
+                return INTERPRETER_OK;
+            }
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): {
+            ObjString *method = READ_STRING();
+            uint8_t argCount = READ_BYTE();
+            InvokeCache *cache = READ_INVOKE_CACHE();
+            Value receiver = PEEK(argCount);
+            STORE_FRAME();
+
+            if (IS_INSTANCE(receiver) && cache->klass == AS_INSTANCE(receiver)->klass &&
+                cache->shape == AS_INSTANCE(receiver)->shape &&
+                cache->version == cache->klass->version) {
+                if (!call(vm, cache->method, argCount)) {
                     return INTERPRETER_RUNTIME_ERR;
                 }
+            } else if (!invoke(vm, compiler, method, argCount, cache)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_INVOKE): {
+            ObjString *method = READ_STRING();
+            uint8_t argCount = READ_BYTE();
+            InvokeCache *cache = READ_INVOKE_CACHE();
+            STORE_FRAME();
+
+            if (!tailInvoke(vm, compiler, method, argCount, cache)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            // See OP_TAIL_CALL
+            if (vm->frameCount == baseFrame) {
+                return INTERPRETER_OK;
+            }
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE): {
+            ObjString *method = READ_STRING();
+            uint8_t argCount = READ_BYTE();
+            InvokeCache *cache = READ_INVOKE_CACHE();
+            ObjClass *superclass = AS_CLASS(POP());
+            STORE_FRAME();
+
+            if (cache->klass == superclass && cache->version == superclass->version) {
+                if (!call(vm, cache->method, argCount)) {
+                    return INTERPRETER_RUNTIME_ERR;
+                }
+            } else if (!invokeFromClass(vm, superclass, NULL, method, argCount, cache)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): {
+            ObjFunction *func = AS_FUNCTION(READ_CONSTANT());
+            STORE_FRAME();
+            ObjClosure *closure = makeClosure(vm, compiler, func);
+            PUSH(OBJ_VAL(closure));
+            vm->stackTop = stackTop;
+
+            for (size_t idx = 0; idx < closure->upvalueCount; idx++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+
+                if (isLocal) {
+                    closure->upvalues[idx] = captureUpvalue(vm, compiler, slots + index);
+                } else {
+                    closure->upvalues[idx] = frame->closure->upvalues[index];
+                }
+            }
+
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE):
+            closeUpvalue(vm, stackTop - 1);
+            (void)POP();
+            DISPATCH();
+        CASE(OP_RETURN): {
+            Value result = POP();
+            closeUpvalues(vm, slots);
+            vm->frameCount -= 1;
+
+            if (vm->frameCount == baseFrame) {
+                vm->stackTop = slots;
+
+                if (baseFrame > 0) {
+                    push(vm, result);
+                }
+
+                return INTERPRETER_OK;
+            }
 
-                ObjClass *subclass = AS_CLASS(peek(vm, 0));
-                tableAddAll(vm, compiler, &AS_CLASS(superclass)->methods,
-                            &subclass->methods);
+            stackTop = slots;
+            PUSH(result);
+            vm->stackTop = stackTop;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLASS): {
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            PUSH(OBJ_VAL(newClass(vm, compiler, name)));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            Value superclass = PEEK(1);
 
-                pop(vm); // Pop subclass
-                break;
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
             }
-            case OP_METHOD:
-                defineMethod(vm, compiler, READ_STRING());
-                break;
+
+            STORE_FRAME();
+            inheritMethods(vm, compiler, AS_CLASS(superclass), AS_CLASS(PEEK(0)));
+
+            (void)POP(); // Pop subclass
+            DISPATCH();
+        }
+        CASE(OP_METHOD): {
+            ObjString *name = READ_STRING();
+            STORE_FRAME();
+            defineMethod(vm, compiler, name);
+            stackTop = vm->stackTop;
+            DISPATCH();
         }
     }
+
+    return INTERPRETER_RUNTIME_ERR; // Unreachable
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef READ_PROPERTY_CACHE
+#undef READ_INVOKE_CACHE
+#undef RUNTIME_ERROR
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef NUMBER_OPERATION
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef ARITHMETIC_OP
+#undef NUMBER_ARITHMETIC_OP
+#undef NOT_BOOL_VAL
+#undef EQUALITY_OP
+#undef GET_PROPERTY
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+/**
+ * @brief Prepares a frame pushed by `call()` to run register code.
+ *
+ * @details Registers are read by the GC before the function first writes them, so
+ * they must never hold objects which have been freed. The collector clears slots
+ * between the stack top and `vm->stackHigh`, which leaves only slots above the
+ * high-water mark to be cleared here.
+ */
+static void enterRegisterFrame(VM *vm, CallFrame *frame) {
+    ObjFunction *func = frame->closure->func;
+    Value *top = frame->slots + func->registerCode->frameSize;
+
+    if (top > vm->stackHigh) {
+        Value *slot = frame->slots + func->arity + 1;
+
+        for (slot = slot > vm->stackHigh ? slot : vm->stackHigh; slot < top; slot++) {
+            *slot = NIL_VAL;
+        }
+
+        vm->stackHigh = top;
+    }
+
+    frame->pc = func->registerCode->code;
+    vm->stackTop = top;
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceRegisters(CallFrame *frame, Value *frameTop, RegInstruction *pc) {
+    ObjFunction *func = frame->closure->func;
+
+    printf("          ");
+    for (Value *slot = frame->slots; slot < frameTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+
+    disassembleRegisterInstruction(func->registerCode, &func->chunk,
+                                   (size_t)(pc - func->registerCode->code));
+}
+
+#define TRACE_REGISTERS() traceRegisters(frame, frameTop, pc)
+#else
+#define TRACE_REGISTERS() ((void)0)
+#endif // DEBUG_TRACE_EXECUTION
+
+/**
+ * @brief Runs register code from the current frame until the frame at index
+ * `baseFrame` returns, like `run()` does for stack code.
+ *
+ * @details While a frame runs `vm->stackTop` stays at the end of its registers so
+ * the GC sees all of them, including dead ones left over from earlier calls.
+ * Helpers shared with the stack interpreter work on the top of the VM stack, so
+ * their operands are pushed above the registers.
+ */
+static InterpreterResult runRegisters(VM *vm, Compiler *compiler, size_t baseFrame) {
+    CallFrame *frame;
+    RegInstruction *pc;
+    RegInstruction ins;
+    Value *slots;
+    Value *frameTop;
+    Value *constants;
+
+    Value *globals = vm->globalValues.values;
+
+#define STORE_FRAME() (frame->pc = pc)
+
+#define LOAD_FRAME()                                                                     \
+    do {                                                                                 \
+        frame = &vm->frames[vm->frameCount - 1];                                         \
+        pc = frame->pc;                                                                  \
+        slots = frame->slots;                                                            \
+        frameTop = slots + frame->closure->func->registerCode->frameSize;                \
+        constants = frame->closure->func->chunk.constants.values;                        \
+    } while (false)
+
+#define R(reg) (slots[reg])
+
+#define K(index) (constants[index])
+
+#define READ_WORD() (*pc++)
+
+#define PROPERTY_CACHE(index) (&frame->closure->func->chunk.propertyCaches[index])
+
+#define INVOKE_CACHE(index) (&frame->closure->func->chunk.invokeCaches[index])
+
+#define RUNTIME_ERROR(...)                                                               \
+    do {                                                                                 \
+        STORE_FRAME();                                                                   \
+        runtimeError(vm, __VA_ARGS__);                                                   \
+        return INTERPRETER_RUNTIME_ERR;                                                  \
+    } while (false)
+
+// Continues in the frame `callValue()` or `call()` may have pushed. Closures which
+// could not be translated run in the stack interpreter.
+#define FINISH_CALL(frameCount)                                                          \
+    do {                                                                                 \
+        if (vm->frameCount > (frameCount)) {                                             \
+            CallFrame *calleeFrame = &vm->frames[vm->frameCount - 1];                    \
+                                                                                         \
+            if (calleeFrame->closure->func->registerCode != NULL) {                      \
+                enterRegisterFrame(vm, calleeFrame);                                     \
+                LOAD_FRAME();                                                            \
+                DISPATCH();                                                              \
+            }                                                                            \
+                                                                                         \
+            if (run(vm, compiler, (frameCount)) != INTERPRETER_OK) {                     \
+                return INTERPRETER_RUNTIME_ERR;                                          \
+            }                                                                            \
+        }                                                                                \
+                                                                                         \
+        LOAD_FRAME(); /* The stacks may have moved */                                    \
+        vm->stackTop = frameTop;                                                         \
+    } while (false)
+
+// Runs `intBody' if both operands are integers and `numberBody' if both are
+// numbers, with `a' and `b' bound to them
+#define NUMBER_OPERANDS(first, second, intBody, numberBody)                              \
+    do {                                                                                 \
+        Value left = (first);                                                            \
+        Value right = (second);                                                          \
+                                                                                         \
+        if (ARE_INTS(left, right)) {                                                     \
+            int32_t a = AS_INT(left);                                                    \
+            int32_t b = AS_INT(right);                                                   \
+            intBody;                                                                     \
+        } else if (ARE_DOUBLES(left, right)) {                                           \
+            double a = AS_DOUBLE(left);                                                  \
+            double b = AS_DOUBLE(right);                                                 \
+            numberBody;                                                                  \
+        } else if (IS_NUMBER(left) && IS_NUMBER(right)) {                                \
+            double a = AS_NUMBER(left);                                                  \
+            double b = AS_NUMBER(right);                                                 \
+            numberBody;                                                                  \
+        } else {                                                                         \
+            RUNTIME_ERROR("Operands must be numbers.");                                  \
+        }                                                                                \
+    } while (false)
+
+#define ARITHMETIC(intOp, op, second)                                                    \
+    NUMBER_OPERANDS(R(REG_B(ins)), second, R(REG_A(ins)) = intOp(a, b),                  \
+                    R(REG_A(ins)) = NUMBER_VAL(a op b))
+
+#define COMPARE(condition)                                                               \
+    NUMBER_OPERANDS(R(REG_B(ins)), R(REG_C(ins)), R(REG_A(ins)) = BOOL_VAL(condition),   \
+                    R(REG_A(ins)) = BOOL_VAL(condition))
+
+#define JUMP_UNLESS(condition)                                                           \
+    do {                                                                                 \
+        int32_t offset = (int32_t)READ_WORD();                                           \
+                                                                                         \
+        if (!(condition)) {                                                              \
+            pc += offset;                                                                \
+        }                                                                                \
+    } while (false)
+
+// Registers are frame slots, so ropes in them are flattened in place
+#define VALUES_EQUAL(a, b)                                                               \
+    (needsStringsEqual(a, b) ? runtimeStringsEqual(vm, compiler, &(a), &(b))             \
+                             : valuesEqual(a, b))
+
+// Compare-and-branch instructions take their operands from A and B
+#define NUMBER_JUMP_UNLESS(condition, second)                                            \
+    NUMBER_OPERANDS(R(REG_A(ins)), second, JUMP_UNLESS(condition), JUMP_UNLESS(condition))
+
+#ifdef CLOX_COMPUTED_GOTO
+    static void *dispatchTable[] = {
+        [REG_MOVE] = &&label_REG_MOVE,
+        [REG_LOAD_CONSTANT] = &&label_REG_LOAD_CONSTANT,
+        [REG_NIL] = &&label_REG_NIL,
+        [REG_TRUE] = &&label_REG_TRUE,
+        [REG_FALSE] = &&label_REG_FALSE,
+        [REG_GET_GLOBAL] = &&label_REG_GET_GLOBAL,
+        [REG_DEFINE_GLOBAL] = &&label_REG_DEFINE_GLOBAL,
+        [REG_SET_GLOBAL] = &&label_REG_SET_GLOBAL,
+        [REG_GET_UPVALUE] = &&label_REG_GET_UPVALUE,
+        [REG_SET_UPVALUE] = &&label_REG_SET_UPVALUE,
+        [REG_GET_ENCLOSING] = &&label_REG_GET_ENCLOSING,
+        [REG_SET_ENCLOSING] = &&label_REG_SET_ENCLOSING,
+        [REG_GET_PROPERTY] = &&label_REG_GET_PROPERTY,
+        [REG_SET_PROPERTY] = &&label_REG_SET_PROPERTY,
+        [REG_GET_SUPER] = &&label_REG_GET_SUPER,
+        [REG_EQUAL] = &&label_REG_EQUAL,
+        [REG_NOT_EQUAL] = &&label_REG_NOT_EQUAL,
+        [REG_GREATER] = &&label_REG_GREATER,
+        [REG_GREATER_EQUAL] = &&label_REG_GREATER_EQUAL,
+        [REG_LESS] = &&label_REG_LESS,
+        [REG_LESS_EQUAL] = &&label_REG_LESS_EQUAL,
+        [REG_ADD] = &&label_REG_ADD,
+        [REG_SUBTRACT] = &&label_REG_SUBTRACT,
+        [REG_MULTIPLY] = &&label_REG_MULTIPLY,
+        [REG_DIVIDE] = &&label_REG_DIVIDE,
+        [REG_ADD_CONSTANT] = &&label_REG_ADD_CONSTANT,
+        [REG_SUBTRACT_CONSTANT] = &&label_REG_SUBTRACT_CONSTANT,
+        [REG_MULTIPLY_CONSTANT] = &&label_REG_MULTIPLY_CONSTANT,
+        [REG_DIVIDE_CONSTANT] = &&label_REG_DIVIDE_CONSTANT,
+        [REG_NOT] = &&label_REG_NOT,
+        [REG_NEGATE] = &&label_REG_NEGATE,
+        [REG_PRINT] = &&label_REG_PRINT,
+        [REG_JUMP] = &&label_REG_JUMP,
+        [REG_JUMP_IF_FALSE] = &&label_REG_JUMP_IF_FALSE,
+        [REG_JUMP_UNLESS_EQUAL] = &&label_REG_JUMP_UNLESS_EQUAL,
+        [REG_JUMP_UNLESS_NOT_EQUAL] = &&label_REG_JUMP_UNLESS_NOT_EQUAL,
+        [REG_JUMP_UNLESS_GREATER] = &&label_REG_JUMP_UNLESS_GREATER,
+        [REG_JUMP_UNLESS_GREATER_EQUAL] = &&label_REG_JUMP_UNLESS_GREATER_EQUAL,
+        [REG_JUMP_UNLESS_LESS] = &&label_REG_JUMP_UNLESS_LESS,
+        [REG_JUMP_UNLESS_LESS_EQUAL] = &&label_REG_JUMP_UNLESS_LESS_EQUAL,
+        [REG_JUMP_UNLESS_EQUAL_CONSTANT] = &&label_REG_JUMP_UNLESS_EQUAL_CONSTANT,
+        [REG_JUMP_UNLESS_NOT_EQUAL_CONSTANT] = &&label_REG_JUMP_UNLESS_NOT_EQUAL_CONSTANT,
+        [REG_JUMP_UNLESS_GREATER_CONSTANT] = &&label_REG_JUMP_UNLESS_GREATER_CONSTANT,
+        [REG_JUMP_UNLESS_GREATER_EQUAL_CONSTANT] =
+            &&label_REG_JUMP_UNLESS_GREATER_EQUAL_CONSTANT,
+        [REG_JUMP_UNLESS_LESS_CONSTANT] = &&label_REG_JUMP_UNLESS_LESS_CONSTANT,
+        [REG_JUMP_UNLESS_LESS_EQUAL_CONSTANT] =
+            &&label_REG_JUMP_UNLESS_LESS_EQUAL_CONSTANT,
+        [REG_CALL] = &&label_REG_CALL,
+        [REG_TAIL_CALL] = &&label_REG_TAIL_CALL,
+        [REG_INVOKE] = &&label_REG_INVOKE,
+        [REG_TAIL_INVOKE] = &&label_REG_TAIL_INVOKE,
+        [REG_SUPER_INVOKE] = &&label_REG_SUPER_INVOKE,
+        [REG_CLOSURE] = &&label_REG_CLOSURE,
+        [REG_CLOSE_UPVALUE] = &&label_REG_CLOSE_UPVALUE,
+        [REG_RETURN] = &&label_REG_RETURN,
+        [REG_CLASS] = &&label_REG_CLASS,
+        [REG_INHERIT] = &&label_REG_INHERIT,
+        [REG_METHOD] = &&label_REG_METHOD,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(opcode) label_##opcode
+#define DISPATCH()                                                                       \
+    do {                                                                                 \
+        TRACE_REGISTERS();                                                               \
+        ins = READ_WORD();                                                               \
+        goto *dispatchTable[REG_OP(ins)];                                                \
+    } while (false)
+#else
+#define INTERPRET_LOOP                                                                   \
+    loop:                                                                                \
+    TRACE_REGISTERS();                                                                   \
+    ins = READ_WORD();                                                                   \
+    switch (REG_OP(ins))
+#define CASE(opcode) case opcode
+#define DISPATCH() goto loop
+#endif // CLOX_COMPUTED_GOTO
+
+    LOAD_FRAME();
+
+    INTERPRET_LOOP {
+        CASE(REG_MOVE):
+            R(REG_A(ins)) = R(REG_B(ins));
+            DISPATCH();
+        CASE(REG_LOAD_CONSTANT):
+            R(REG_A(ins)) = K(REG_BX(ins));
+            DISPATCH();
+        CASE(REG_NIL):
+            R(REG_A(ins)) = NIL_VAL;
+            DISPATCH();
+        CASE(REG_TRUE):
+            R(REG_A(ins)) = BOOL_VAL(true);
+            DISPATCH();
+        CASE(REG_FALSE):
+            R(REG_A(ins)) = BOOL_VAL(false);
+            DISPATCH();
+        CASE(REG_GET_GLOBAL): {
+            Value value = globals[REG_BX(ins)];
+
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.",
+                              globalName(vm, REG_BX(ins))->chars);
+            }
+
+            R(REG_A(ins)) = value;
+            DISPATCH();
+        }
+        CASE(REG_DEFINE_GLOBAL):
+            globals[REG_BX(ins)] = R(REG_A(ins));
+            DISPATCH();
+        CASE(REG_SET_GLOBAL): {
+            if (IS_UNDEFINED(globals[REG_BX(ins)])) {
+                RUNTIME_ERROR("Undefined variable '%s'.",
+                              globalName(vm, REG_BX(ins))->chars);
+            }
+
+            globals[REG_BX(ins)] = R(REG_A(ins));
+            DISPATCH();
+        }
+        CASE(REG_GET_UPVALUE):
+            R(REG_A(ins)) = *frame->closure->upvalues[REG_B(ins)]->location;
+            DISPATCH();
+        CASE(REG_SET_UPVALUE):
+            *frame->closure->upvalues[REG_B(ins)]->location = R(REG_A(ins));
+            DISPATCH();
+        CASE(REG_GET_ENCLOSING):
+            R(REG_A(ins)) = frame[-1].slots[REG_B(ins)];
+            DISPATCH();
+        CASE(REG_SET_ENCLOSING):
+            frame[-1].slots[REG_B(ins)] = R(REG_A(ins));
+            DISPATCH();
+        CASE(REG_GET_PROPERTY): {
+            Value receiver = R(REG_B(ins));
+            ObjString *name = AS_STRING(K(REG_C(ins)));
+            PropertyCache *cache = PROPERTY_CACHE(READ_WORD());
+
+            if (!IS_INSTANCE(receiver)) {
+                RUNTIME_ERROR("Only instances have properties.");
+            }
+
+            ObjInstance *instance = AS_INSTANCE(receiver);
+
+            for (size_t idx = 0; idx < PROPERTY_CACHE_SIZE; idx++) {
+                if (cache->entries[idx].shape == instance->shape) {
+                    R(REG_A(ins)) = instance->fields[cache->entries[idx].slot];
+                    DISPATCH();
+                }
+            }
+
+            STORE_FRAME();
+            push(vm, receiver);
+
+            if (!getPropertySlow(vm, compiler, instance, name, cache)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            R(REG_A(ins)) = pop(vm);
+            DISPATCH();
+        }
+        CASE(REG_SET_PROPERTY): {
+            Value receiver = R(REG_A(ins));
+            Value value = R(REG_B(ins));
+            RegInstruction data = READ_WORD();
+            ObjString *name = AS_STRING(K(data >> 16));
+            PropertyCache *cache = PROPERTY_CACHE(data & 0xffff);
+
+            if (!IS_INSTANCE(receiver)) {
+                RUNTIME_ERROR("Only instances have fields.");
+            }
+
+            ObjInstance *instance = AS_INSTANCE(receiver);
+            PropertyCacheEntry *entry = NULL;
+
+            for (size_t idx = 0; idx < PROPERTY_CACHE_SIZE; idx++) {
+                if (cache->entries[idx].shape == instance->shape) {
+                    entry = &cache->entries[idx];
+                    break;
+                }
+            }
+
+            STORE_FRAME();
+
+            if (entry == NULL) {
+                push(vm, value);
+                setPropertySlow(vm, compiler, instance, name, cache);
+                pop(vm);
+            } else {
+                if (entry->slot >= instance->fieldCapacity) {
+                    instanceEnsureSlot(vm, compiler, instance, entry->slot);
+                }
+
+                instance->fields[entry->slot] = value;
+                instance->shape = entry->transition;
+            }
+
+            R(REG_C(ins)) = value;
+            DISPATCH();
+        }
+        CASE(REG_GET_SUPER): {
+            ObjString *name = AS_STRING(K(REG_B(ins)));
+            ObjClass *superclass = AS_CLASS(R(REG_A(ins) + 1));
+            STORE_FRAME();
+            push(vm, R(REG_A(ins)));
+
+            if (!bindMethod(vm, compiler, superclass, name)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            R(REG_A(ins)) = pop(vm);
+            DISPATCH();
+        }
+        CASE(REG_EQUAL):
+            R(REG_A(ins)) = BOOL_VAL(VALUES_EQUAL(R(REG_B(ins)), R(REG_C(ins))));
+            DISPATCH();
+        CASE(REG_NOT_EQUAL):
+            R(REG_A(ins)) = BOOL_VAL(!VALUES_EQUAL(R(REG_B(ins)), R(REG_C(ins))));
+            DISPATCH();
+        CASE(REG_GREATER):
+            COMPARE(a > b);
+            DISPATCH();
+        CASE(REG_GREATER_EQUAL):
+            COMPARE(!(a < b));
+            DISPATCH();
+        CASE(REG_LESS):
+            COMPARE(a < b);
+            DISPATCH();
+        CASE(REG_LESS_EQUAL):
+            COMPARE(!(a > b));
+            DISPATCH();
+        CASE(REG_ADD_CONSTANT):
+        CASE(REG_ADD): {
+            Value left = R(REG_B(ins));
+            Value right = REG_OP(ins) == REG_ADD ? R(REG_C(ins)) : K(REG_C(ins));
+
+            if (IS_INT(left) && IS_INT(right)) {
+                R(REG_A(ins)) = intAdd(AS_INT(left), AS_INT(right));
+            } else if (IS_NUMBER(left) && IS_NUMBER(right)) {
+                R(REG_A(ins)) = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right));
+            } else if (IS_STRING(left) && IS_STRING(right)) {
+                STORE_FRAME();
+                push(vm, left);
+                push(vm, right);
+                concatenate(vm, compiler);
+                R(REG_A(ins)) = pop(vm);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+
+            DISPATCH();
+        }
+        CASE(REG_SUBTRACT):
+            ARITHMETIC(intSubtract, -, R(REG_C(ins)));
+            DISPATCH();
+        CASE(REG_MULTIPLY):
+            ARITHMETIC(intMultiply, *, R(REG_C(ins)));
+            DISPATCH();
+        CASE(REG_DIVIDE):
+            ARITHMETIC(intDivide, /, R(REG_C(ins)));
+            DISPATCH();
+        CASE(REG_SUBTRACT_CONSTANT):
+            ARITHMETIC(intSubtract, -, K(REG_C(ins)));
+            DISPATCH();
+        CASE(REG_MULTIPLY_CONSTANT):
+            ARITHMETIC(intMultiply, *, K(REG_C(ins)));
+            DISPATCH();
+        CASE(REG_DIVIDE_CONSTANT):
+            ARITHMETIC(intDivide, /, K(REG_C(ins)));
+            DISPATCH();
+        CASE(REG_NOT):
+            R(REG_A(ins)) = BOOL_VAL(isFalsey(R(REG_B(ins))));
+            DISPATCH();
+        CASE(REG_NEGATE): {
+            Value value = R(REG_B(ins));
+
+            if (IS_INT(value)) {
+                R(REG_A(ins)) = intNegate(AS_INT(value));
+                DISPATCH();
+            }
+
+            if (!IS_NUMBER(value)) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+
+            R(REG_A(ins)) = NUMBER_VAL(-AS_NUMBER(value));
+            DISPATCH();
+        }
+        CASE(REG_PRINT):
+            flattenRope(vm, compiler, &R(REG_A(ins)));
+            printValue(R(REG_A(ins)));
+            printf("\n");
+            DISPATCH();
+        CASE(REG_JUMP):
+            pc += REG_SBX(ins);
+            DISPATCH();
+        CASE(REG_JUMP_IF_FALSE):
+            if (isFalsey(R(REG_A(ins)))) {
+                pc += REG_SBX(ins);
+            }
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_EQUAL):
+            JUMP_UNLESS(VALUES_EQUAL(R(REG_A(ins)), R(REG_B(ins))));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_NOT_EQUAL):
+            JUMP_UNLESS(!VALUES_EQUAL(R(REG_A(ins)), R(REG_B(ins))));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_GREATER):
+            NUMBER_JUMP_UNLESS(a > b, R(REG_B(ins)));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_GREATER_EQUAL):
+            NUMBER_JUMP_UNLESS(!(a < b), R(REG_B(ins)));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_LESS):
+            NUMBER_JUMP_UNLESS(a < b, R(REG_B(ins)));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_LESS_EQUAL):
+            NUMBER_JUMP_UNLESS(!(a > b), R(REG_B(ins)));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_EQUAL_CONSTANT):
+            JUMP_UNLESS(VALUES_EQUAL(R(REG_A(ins)), K(REG_B(ins))));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_NOT_EQUAL_CONSTANT):
+            JUMP_UNLESS(!VALUES_EQUAL(R(REG_A(ins)), K(REG_B(ins))));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_GREATER_CONSTANT):
+            NUMBER_JUMP_UNLESS(a > b, K(REG_B(ins)));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_GREATER_EQUAL_CONSTANT):
+            NUMBER_JUMP_UNLESS(!(a < b), K(REG_B(ins)));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_LESS_CONSTANT):
+            NUMBER_JUMP_UNLESS(a < b, K(REG_B(ins)));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_LESS_EQUAL_CONSTANT):
+            NUMBER_JUMP_UNLESS(!(a > b), K(REG_B(ins)));
+            DISPATCH();
+        CASE(REG_CALL): {
+            uint8_t base = (uint8_t)REG_A(ins);
+            uint8_t argCount = (uint8_t)REG_B(ins);
+            size_t frameCount = vm->frameCount;
+            STORE_FRAME();
+            vm->stackTop = slots + base + argCount + 1;
+
+            if (!callValue(vm, compiler, R(base), argCount)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            FINISH_CALL(frameCount);
+            DISPATCH();
+        }
+        CASE(REG_TAIL_CALL): {
+            uint8_t base = (uint8_t)REG_A(ins);
+            uint8_t argCount = (uint8_t)REG_B(ins);
+            Value callee = R(base);
+            ObjClosure *closure = NULL;
+
+            if (IS_CLOSURE(callee)) {
+                closure = AS_CLOSURE(callee);
+            } else if (IS_BOUND_METHOD(callee)) {
+                closure = AS_BOUND_METHOD(callee)->method;
+            }
+
+            // The frame can only be handed over to register code, anything else is
+            // called normally and followed by REG_RETURN
+            if (closure != NULL && closure->func->registerCode != NULL &&
+                closure->func->arity == argCount && !closure->func->usesCallerFrame) {
+                if (IS_BOUND_METHOD(callee)) {
+                    R(base) = AS_BOUND_METHOD(callee)->receiver;
+                }
+
+                closeUpvalues(vm, slots);
+                memmove(slots, slots + base, sizeof(Value) * (argCount + 1u));
+                frame->closure = closure;
+                enterRegisterFrame(vm, frame);
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            size_t frameCount = vm->frameCount;
+            STORE_FRAME();
+            vm->stackTop = slots + base + argCount + 1;
+
+            if (!callValue(vm, compiler, callee, argCount)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            FINISH_CALL(frameCount);
+            DISPATCH();
+        }
+        CASE(REG_INVOKE): {
+            uint8_t base = (uint8_t)REG_A(ins);
+            uint8_t argCount = (uint8_t)REG_B(ins);
+            ObjString *method = AS_STRING(K(REG_C(ins)));
+            InvokeCache *cache = INVOKE_CACHE(READ_WORD());
+            Value receiver = R(base);
+            size_t frameCount = vm->frameCount;
+            STORE_FRAME();
+            vm->stackTop = slots + base + argCount + 1;
+
+            if (IS_INSTANCE(receiver) && cache->klass == AS_INSTANCE(receiver)->klass &&
+                cache->shape == AS_INSTANCE(receiver)->shape &&
+                cache->version == cache->klass->version) {
+                if (!call(vm, cache->method, argCount)) {
+                    return INTERPRETER_RUNTIME_ERR;
+                }
+            } else if (!invoke(vm, compiler, method, argCount, cache)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            FINISH_CALL(frameCount);
+            DISPATCH();
+        }
+        CASE(REG_TAIL_INVOKE): {
+            uint8_t base = (uint8_t)REG_A(ins);
+            uint8_t argCount = (uint8_t)REG_B(ins);
+            ObjString *method = AS_STRING(K(REG_C(ins)));
+            InvokeCache *cache = INVOKE_CACHE(READ_WORD());
+            Value receiver = R(base);
+            bool cached = IS_INSTANCE(receiver) &&
+                          cache->klass == AS_INSTANCE(receiver)->klass &&
+                          cache->shape == AS_INSTANCE(receiver)->shape &&
+                          cache->version == cache->klass->version;
+
+            // Only a cached method running register code takes over the frame, as
+            // in REG_TAIL_CALL
+            if (cached && cache->method->func->registerCode != NULL &&
+                cache->method->func->arity == argCount &&
+                !cache->method->func->usesCallerFrame) {
+                closeUpvalues(vm, slots);
+                memmove(slots, slots + base, sizeof(Value) * (argCount + 1u));
+                frame->closure = cache->method;
+                enterRegisterFrame(vm, frame);
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            size_t frameCount = vm->frameCount;
+            STORE_FRAME();
+            vm->stackTop = slots + base + argCount + 1;
+
+            if (cached) {
+                if (!call(vm, cache->method, argCount)) {
+                    return INTERPRETER_RUNTIME_ERR;
+                }
+            } else if (!invoke(vm, compiler, method, argCount, cache)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            FINISH_CALL(frameCount);
+            DISPATCH();
+        }
+        CASE(REG_SUPER_INVOKE): {
+            uint8_t base = (uint8_t)REG_A(ins);
+            uint8_t argCount = (uint8_t)REG_B(ins);
+            ObjString *method = AS_STRING(K(REG_C(ins)));
+            InvokeCache *cache = INVOKE_CACHE(READ_WORD());
+            ObjClass *superclass = AS_CLASS(R(base + argCount + 1));
+            size_t frameCount = vm->frameCount;
+            STORE_FRAME();
+            vm->stackTop = slots + base + argCount + 1;
+
+            if (cache->klass == superclass && cache->version == superclass->version) {
+                if (!call(vm, cache->method, argCount)) {
+                    return INTERPRETER_RUNTIME_ERR;
+                }
+            } else if (!invokeFromClass(vm, superclass, NULL, method, argCount, cache)) {
+                return INTERPRETER_RUNTIME_ERR;
+            }
+
+            FINISH_CALL(frameCount);
+            DISPATCH();
+        }
+        CASE(REG_CLOSURE): {
+            ObjFunction *func = AS_FUNCTION(K(REG_BX(ins)));
+            STORE_FRAME();
+            ObjClosure *closure = makeClosure(vm, compiler, func);
+            R(REG_A(ins)) = OBJ_VAL(closure);
+
+            for (size_t idx = 0; idx < closure->upvalueCount; idx++) {
+                RegInstruction upvalue = READ_WORD();
+                uint8_t index = (uint8_t)(upvalue >> 8);
+
+                if (upvalue & 0xff) {
+                    closure->upvalues[idx] = captureUpvalue(vm, compiler, slots + index);
+                } else {
+                    closure->upvalues[idx] = frame->closure->upvalues[index];
+                }
+            }
+
+            DISPATCH();
+        }
+        CASE(REG_CLOSE_UPVALUE):
+            closeUpvalue(vm, slots + REG_A(ins));
+            DISPATCH();
+        CASE(REG_RETURN): {
+            Value result = R(REG_A(ins));
+            closeUpvalues(vm, slots);
+            vm->frameCount -= 1;
+
+            if (vm->frameCount == baseFrame) {
+                vm->stackTop = slots;
+
+                if (baseFrame > 0) {
+                    push(vm, result);
+                }
+
+                return INTERPRETER_OK;
+            }
+
+            // The result goes where the caller had the callee
+            slots[0] = result;
+            LOAD_FRAME();
+            vm->stackTop = frameTop;
+            DISPATCH();
+        }
+        CASE(REG_CLASS):
+            STORE_FRAME();
+            R(REG_A(ins)) = OBJ_VAL(newClass(vm, compiler, AS_STRING(K(REG_B(ins)))));
+            DISPATCH();
+        CASE(REG_INHERIT): {
+            Value superclass = R(REG_A(ins));
+
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
+            }
+
+            STORE_FRAME();
+            inheritMethods(vm, compiler, AS_CLASS(superclass),
+                           AS_CLASS(R(REG_A(ins) + 1)));
+            DISPATCH();
+        }
+        CASE(REG_METHOD):
+            STORE_FRAME();
+            push(vm, R(REG_A(ins)));
+            push(vm, R(REG_A(ins) + 1));
+            defineMethod(vm, compiler, AS_STRING(K(REG_B(ins))));
+            pop(vm);
+            DISPATCH();
+    }
+
+    return INTERPRETER_RUNTIME_ERR; // Unreachable
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef R
+#undef K
+#undef READ_WORD
+#undef PROPERTY_CACHE
+#undef INVOKE_CACHE
+#undef RUNTIME_ERROR
+#undef FINISH_CALL
+#undef NUMBER_OPERANDS
+#undef ARITHMETIC
+#undef COMPARE
+#undef VALUES_EQUAL
+#undef JUMP_UNLESS
+#undef NUMBER_JUMP_UNLESS
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
+#if defined(CLOX_COMPUTED_GOTO) && defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef CLOX_JIT
+bool jitAdd(VM *vm) {
+    if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+        concatenate(vm, NULL);
+        return true;
+    }
+
+    runtimeError(vm, "Operands must be two numbers or two strings.");
+    return false;
+}
+
+CallFrame *jitCall(VM *vm, uint8_t argCount) {
+    size_t frameCount = vm->frameCount;
+
+    if (!callValue(vm, NULL, peek(vm, argCount), argCount)) {
+        return NULL;
+    }
+
+    // Closures which are not compiled have only had their frame pushed
+    if (vm->frameCount > frameCount && run(vm, NULL, frameCount) != INTERPRETER_OK) {
+        return NULL;
+    }
+
+    return &vm->frames[frameCount - 1];
+}
+
+bool jitOperandError(VM *vm) {
+    runtimeError(vm, "Operand must be a number.");
+    return false;
+}
+
+bool jitOperandsError(VM *vm) {
+    runtimeError(vm, "Operands must be numbers.");
+    return false;
+}
+
+bool jitUndefinedVariable(VM *vm, uint16_t slot) {
+    runtimeError(vm, "Undefined variable '%s'.", globalName(vm, slot)->chars);
+    return false;
+}
+
+bool jitEqual(VM *vm) {
+    Value *a = vm->stackTop - 2;
+    Value *b = vm->stackTop - 1;
+    return needsStringsEqual(*a, *b) ? runtimeStringsEqual(vm, NULL, a, b)
+                                     : valuesEqual(*a, *b);
+}
+
+void jitPrint(VM *vm) {
+    flattenRope(vm, NULL, vm->stackTop - 1);
+    printValue(pop(vm));
+    printf("\n");
+}
+
+void jitCloseUpvalue(VM *vm) {
+    closeUpvalue(vm, vm->stackTop - 1);
+    pop(vm);
+}
+#endif // CLOX_JIT
+
 InterpreterResult interpret(VM *vm, Scanner *scanner, const char *source) {
     ObjFunction *func = compile(scanner, source, vm);
 
@@ -611,7 +2529,12 @@ InterpreterResult interpret(VM *vm, Scanner *scanner, const char *source) {
     push(vm, OBJ_VAL(closure));
     call(vm, closure, 0);
 
-    return run(vm, NULL);
+    if (func->registerCode != NULL) {
+        enterRegisterFrame(vm, &vm->frames[0]);
+        return runRegisters(vm, NULL, 0);
+    }
+
+    return run(vm, NULL, 0);
 }
 
 void push(VM *vm, Value value) {
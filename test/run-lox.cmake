@@ -0,0 +1,52 @@
+# Runs one Lox script and compares what it prints with the `// expect: <line>`
+# comments in it, in order. A script stopping with a runtime error states its
+# message with `// expect runtime error: <message>`, and `// flags: <flags>` passes
+# further flags to clox after the ones the test is registered with.
+#
+# Usage: cmake -DCLOX=<clox> -DFLAGS=<flags> -DSCRIPT=<script> -P run-lox.cmake
+
+file(STRINGS "${SCRIPT}" lines)
+
+set(expected "")
+set(expected_error "")
+set(script_flags "")
+
+foreach(line IN LISTS lines)
+    if(line MATCHES "// expect: (.*)$")
+        string(APPEND expected "${CMAKE_MATCH_1}\n")
+    elseif(line MATCHES "// expect runtime error: (.*)$")
+        set(expected_error "${CMAKE_MATCH_1}")
+    elseif(line MATCHES "^// flags: (.*)$")
+        separate_arguments(script_flags UNIX_COMMAND "${CMAKE_MATCH_1}")
+    endif()
+endforeach()
+
+separate_arguments(flags UNIX_COMMAND "${FLAGS}")
+
+execute_process(
+    COMMAND "${CLOX}" ${flags} ${script_flags} "${SCRIPT}"
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE error
+    RESULT_VARIABLE result
+    TIMEOUT 300
+)
+
+if(expected_error STREQUAL "")
+    set(expected_result 0)
+else()
+    set(expected_result 70)
+endif()
+
+string(REGEX REPLACE "\n.*" "" error_line "${error}")
+
+if(NOT output STREQUAL expected OR NOT result STREQUAL expected_result
+   OR NOT error_line STREQUAL expected_error)
+    message(
+        FATAL_ERROR
+        "${SCRIPT} with ${FLAGS} ${script_flags}\n"
+        "Expected output:\n${expected}"
+        "Output:\n${output}"
+        "Expected exit status ${expected_result} and error \"${expected_error}\"\n"
+        "Exit status ${result} and error:\n${error}"
+    )
+endif()